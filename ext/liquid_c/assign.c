@@ -0,0 +1,113 @@
+#include "liquid.h"
+#include "assign.h"
+#include "expression.h"
+#include "variable.h"
+#include "block.h"
+
+static ID id_ivar_to, id_ivar_from, id_ivar_markup, id_ivar_body;
+
+static VALUE cLiquidAssign, cLiquidCapture;
+
+static int add_hash_entry_assign_score(VALUE key, VALUE value, VALUE score_ptr)
+{
+    *(long *)score_ptr += assign_score_of(key) + assign_score_of(value);
+    return ST_CONTINUE;
+}
+
+// Equivalent to Liquid::Assign#assign_score_of
+long assign_score_of(VALUE value)
+{
+    if (RB_SPECIAL_CONST_P(value))
+        return 1;
+
+    VALUE klass = RBASIC_CLASS(value);
+    if (klass == rb_cString)
+        return RSTRING_LEN(value);
+
+    long score = 1;
+    if (klass == rb_cArray) {
+        for (long i = 0; i < RARRAY_LEN(value); i++)
+            score += assign_score_of(RARRAY_AREF(value, i));
+    } else if (klass == rb_cHash) {
+        rb_hash_foreach(value, add_hash_entry_assign_score, (VALUE)&score);
+    }
+    return score;
+}
+
+static bool compile_assign(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE to = rb_attr_get(tag, id_ivar_to);
+    VALUE from = rb_attr_get(tag, id_ivar_from);
+    if (!RB_TYPE_P(to, T_STRING) || RB_SPECIAL_CONST_P(from) || RBASIC_CLASS(from) != cLiquidVariable)
+        return false;
+    VALUE markup = rb_attr_get(from, id_ivar_markup);
+    if (!RB_TYPE_P(markup, T_STRING))
+        return false;
+
+    // compiled separately, since the variable's markup might not strictly parse
+    expression_t *value;
+    VALUE value_obj = expression_new(&value);
+    variable_parse_args_t parse_args = {
+        .markup = RSTRING_PTR(markup),
+        .markup_end = RSTRING_END(markup),
+        .code = &value->code,
+    };
+    if (!internal_variable_compile_value(&parse_args))
+        return false;
+
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+    vm_assembler_concat(code, &value->code);
+    vm_assembler_add_assign(code, rb_str_new_frozen(to));
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+
+    RB_GC_GUARD(value_obj);
+    return true;
+}
+
+static bool compile_capture(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE to = rb_attr_get(tag, id_ivar_to);
+    block_body_t *body = block_body_parsed_struct(rb_attr_get(tag, id_ivar_body));
+    if (!RB_TYPE_P(to, T_STRING) || !body)
+        return false;
+
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+    vm_assembler_add_capture_begin(code, rb_str_new_frozen(to));
+    vm_assembler_add_render_tag_body(code, body->render_score);
+    vm_assembler_concat_code(code, &body->code);
+    vm_assembler_add_capture_end(code);
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+    return true;
+}
+
+// Compiles a stock Liquid::Assign tag, so the VM evaluates the variable and assigns it
+// instead of rendering the tag with Liquid::BlockBody.render_node, or a stock
+// Liquid::Capture tag, so the VM renders its body into a capture buffer.
+// Returns false without adding any code if the tag can't be compiled.
+bool assign_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE tag_class = RBASIC_CLASS(tag);
+    if (tag_class == cLiquidAssign)
+        return compile_assign(code, tag, line_number, blank);
+    if (tag_class == cLiquidCapture)
+        return compile_capture(code, tag, line_number, blank);
+    return false;
+}
+
+void init_liquid_assign()
+{
+    id_ivar_to = rb_intern("@to");
+    id_ivar_from = rb_intern("@from");
+    id_ivar_markup = rb_intern("@markup");
+    id_ivar_body = rb_intern("@body");
+
+    cLiquidAssign = rb_const_get(mLiquid, rb_intern("Assign"));
+    rb_global_variable(&cLiquidAssign);
+
+    cLiquidCapture = rb_const_get(mLiquid, rb_intern("Capture"));
+    rb_global_variable(&cLiquidCapture);
+}
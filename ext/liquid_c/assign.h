@@ -0,0 +1,10 @@
+#if !defined(LIQUID_ASSIGN_H)
+#define LIQUID_ASSIGN_H
+
+#include "vm_assembler.h"
+
+void init_liquid_assign();
+bool assign_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank);
+long assign_score_of(VALUE value);
+
+#endif
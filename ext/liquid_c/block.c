@@ -4,6 +4,13 @@
 #include "stringutil.h"
 #include "vm.h"
 #include "variable.h"
+#include "condition.h"
+#include "for.h"
+#include "assign.h"
+#include "counter.h"
+#include "partial.h"
+#include "raw.h"
+#include "serialize.h"
 #include <stdio.h>
 
 static ID
@@ -14,10 +21,13 @@ static ID
     intern_square_brackets,
     intern_set_line_number,
     intern_unknown_tag_in_liquid_tag,
-    intern_ivar_nodelist;
+    intern_ivar_nodelist,
+    intern_error_mode,
+    intern_depth;
 
-static VALUE tag_registry;
+static VALUE tag_registry, cLiquidRaw, cLiquidComment, cLiquidCBlockBody, sym_lax;
 static VALUE variable_placeholder = Qnil;
+static long block_max_depth; // Liquid::Block::MAX_DEPTH
 
 typedef struct tag_markup {
     VALUE name;
@@ -28,15 +38,27 @@ typedef struct parse_context {
     tokenizer_t *tokenizer;
     VALUE tokenizer_obj;
     VALUE ruby_obj;
+    unsigned int ruby_line_number; // last line number set on ruby_obj, or 0 if unknown
 } parse_context_t;
 
 static void block_body_mark(void *ptr)
 {
     block_body_t *body = ptr;
+    // pinned, since compaction could move the bytes that OP_WRITE_RAW points to along with it
     rb_gc_mark(body->source);
+    // also pinned, since the mapped instructions point into it, and it keeps the mapping alive
+    rb_gc_mark(body->mapped_dump);
     vm_assembler_gc_mark(&body->code);
 }
 
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void block_body_compact(void *ptr)
+{
+    block_body_t *body = ptr;
+    vm_assembler_compact(&body->code);
+}
+#endif
+
 static void block_body_free(void *ptr)
 {
     block_body_t *body = ptr;
@@ -53,20 +75,23 @@ static size_t block_body_memsize(const void *ptr)
 
 const rb_data_type_t block_body_data_type = {
     "liquid_block_body",
-    { block_body_mark, block_body_free, block_body_memsize, },
-    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+    { block_body_mark, block_body_free, block_body_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+        block_body_compact,
+#endif
+    },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
 };
 
-#define BlockBody_Get_Struct(obj, sval) TypedData_Get_Struct(obj, block_body_t, &block_body_data_type, sval)
-
 static VALUE block_body_allocate(VALUE klass)
 {
     block_body_t *body;
 
     VALUE obj = TypedData_Make_Struct(klass, block_body_t, &block_body_data_type, body);
-    vm_assembler_init(&body->code);
+    vm_assembler_init(&body->code, obj);
     vm_assembler_add_leave(&body->code);
     body->source = Qnil;
+    body->mapped_dump = Qnil;
     body->render_score = 0;
     body->parsing = false;
     body->blank = true;
@@ -78,6 +103,107 @@ static int is_id(int c)
     return rb_isalnum(c) || c == '_';
 }
 
+// Ruby code only observes the parse context's line number when it is called
+// into (e.g. to parse a tag or to raise an error), so only update it then.
+static void parse_context_set_line_number(parse_context_t *parse_context, unsigned int line_number)
+{
+    if (line_number != 0 && line_number != parse_context->ruby_line_number) {
+        rb_funcall(parse_context->ruby_obj, intern_set_line_number, 1, UINT2NUM(line_number));
+        parse_context->ruby_line_number = line_number;
+    }
+}
+
+// Skips the tokens of a comment's body, which Liquid::Comment parses without rendering it,
+// up to the end of the comment. Returns false if parsing the body could raise an error or
+// have other effects, like for tags other than nested comments and raw tags, since Ruby code
+// parses those tags, for variables unless they are lax parsed, and for comments nested deep
+// enough for Liquid::Block#parse_body to raise a Liquid::StackLevelError.
+static bool skip_comment_body(parse_context_t *parse_context)
+{
+    tokenizer_t *tokenizer = parse_context->tokenizer;
+    token_t token;
+    long depth = 1;
+    long max_depth = block_max_depth - NUM2LONG(rb_funcall(parse_context->ruby_obj, intern_depth, 0));
+    bool checked_error_mode = false;
+
+    if (depth > max_depth)
+        return false;
+
+    while (true) {
+        tokenizer_next(tokenizer, &token);
+
+        switch (token.type) {
+            case TOKEN_RAW:
+                break;
+            case TOKEN_VARIABLE:
+                if (!checked_error_mode) {
+                    if (rb_funcall(parse_context->ruby_obj, intern_error_mode, 0) != sym_lax)
+                        return false;
+                    checked_error_mode = true;
+                }
+                break;
+            case TOKEN_TAG:
+            {
+                const char *end = token.str_trimmed + token.len_trimmed;
+                const char *name_start = read_while(token.str_trimmed, end, rb_isspace);
+                const char *name_end = read_while(name_start, end, is_id);
+                long name_len = name_end - name_start;
+                if (name_len == 0 || (name_len == 6 && strncmp(name_start, "liquid", 6) == 0))
+                    return false;
+
+                VALUE tag_name = rb_enc_str_new(name_start, name_len, utf8_encoding);
+                VALUE tag_class = rb_funcall(tag_registry, intern_square_brackets, 1, tag_name);
+                if (tag_class == Qnil) {
+                    // Liquid::Comment ignores unknown tags other than the end of the comment
+                    if (name_len == 10 && strncmp(name_start, "endcomment", 10) == 0 && --depth == 0)
+                        return true;
+                } else if (tag_class == cLiquidComment) {
+                    if (++depth > max_depth)
+                        return false;
+                } else if (tag_class == cLiquidRaw && read_while(name_end, end, rb_isspace) == end) {
+                    if (!raw_skip_body(tokenizer, "endraw", 6))
+                        return false;
+                } else {
+                    return false;
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+}
+
+// Parses a stock Liquid::Raw or Liquid::Comment tag by searching forward for the end of its
+// body, without creating the tag. A raw body compiles into an OP_WRITE_RAW instruction for
+// its slice of the source and a comment compiles into nothing.
+// Returns false without consuming any tokens if the tag has to be parsed by its class.
+static bool parse_raw_or_comment(block_body_t *body, parse_context_t *parse_context, VALUE tag_class, bool has_markup)
+{
+    tokenizer_t *tokenizer = parse_context->tokenizer;
+    if (tokenizer->for_liquid_tag)
+        return false;
+
+    tokenizer_t saved_tokenizer = *tokenizer;
+    if (tag_class == cLiquidComment) {
+        if (skip_comment_body(parse_context))
+            return true;
+    } else if (!has_markup) {
+        const char *raw_start = tokenizer->cursor;
+        const char *raw_end = raw_skip_body(tokenizer, "endraw", 6);
+        if (raw_end) {
+            if (raw_end > raw_start) {
+                vm_assembler_add_write_raw(&body->code, raw_start, raw_end - raw_start);
+                body->blank = false;
+            }
+            return true;
+        }
+    }
+    // let the tag parse it, which raises the errors
+    *tokenizer = saved_tokenizer;
+    return false;
+}
+
 static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_t *parse_context)
 {
     tokenizer_t *tokenizer = parse_context->tokenizer;
@@ -86,18 +212,18 @@ static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_
     int render_score_increment = 0;
 
     while (true) {
-        int token_start_line_number = tokenizer->line_number;
-        if (token_start_line_number != 0) {
-            rb_funcall(parse_context->ruby_obj, intern_set_line_number, 1, UINT2NUM(token_start_line_number));
-        }
+        const char *token_start = tokenizer->cursor;
         tokenizer_next(tokenizer, &token);
 
         switch (token.type) {
             case TOKENIZER_TOKEN_NONE:
+                parse_context_set_line_number(parse_context, tokenizer_line_number_at(tokenizer, token_start));
                 goto loop_break;
 
             case TOKEN_INVALID:
             {
+                parse_context_set_line_number(parse_context, tokenizer_line_number_at(tokenizer, token_start));
+
                 VALUE str = rb_enc_str_new(token.str_full, token.len_full, utf8_encoding);
 
                 ID raise_method_id = intern_raise_missing_variable_terminator;
@@ -144,9 +270,12 @@ static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_
                     .markup_end = token.str_trimmed + token.len_trimmed,
                     .code = &body->code,
                     .parse_context = parse_context->ruby_obj,
-                    .line_number = token_start_line_number,
+                    .line_number = tokenizer_line_number_at(tokenizer, token_start),
                 };
-                internal_variable_parse(&parse_args);
+                if (!internal_variable_parse(&parse_args)) {
+                    // the Ruby fallback set the parse context's line number
+                    parse_context->ruby_line_number = parse_args.line_number;
+                }
                 render_score_increment += 1;
                 body->blank = false;
                 break;
@@ -154,6 +283,7 @@ static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_
             case TOKEN_TAG:
             {
                 const char *start = token.str_trimmed, *end = token.str_trimmed + token.len_trimmed;
+                parse_context_set_line_number(parse_context, tokenizer_line_number_at(tokenizer, token_start));
 
                 // Imitate \s*(\w+)\s*(.*)? regex
                 const char *name_start = read_while(start, end, rb_isspace);
@@ -168,13 +298,9 @@ static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_
 
                 if (name_len == 6 && strncmp(name_start, "liquid", 6) == 0) {
                     const char *markup_start = read_while(name_end, end, rb_isspace);
-                    int line_number = token_start_line_number;
-                    if (line_number) {
-                        line_number += count_newlines(token.str_full, markup_start);
-                    }
 
                     tokenizer_t saved_tokenizer = *tokenizer;
-                    tokenizer_setup_for_liquid_tag(tokenizer, markup_start, end, line_number);
+                    tokenizer_setup_for_liquid_tag(tokenizer, markup_start, end);
                     unknown_tag = internal_block_body_parse(body, parse_context);
                     *tokenizer = saved_tokenizer;
                     if (unknown_tag.name != Qnil) {
@@ -188,6 +314,11 @@ static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_
                 VALUE tag_class = rb_funcall(tag_registry, intern_square_brackets, 1, tag_name);
 
                 const char *markup_start = read_while(name_end, end, rb_isspace);
+                if ((tag_class == cLiquidRaw || tag_class == cLiquidComment) &&
+                        parse_raw_or_comment(body, parse_context, tag_class, markup_start < end)) {
+                    render_score_increment += 1;
+                    break;
+                }
                 VALUE markup = rb_enc_str_new(markup_start, end - markup_start, utf8_encoding);
 
                 if (tag_class == Qnil) {
@@ -198,10 +329,19 @@ static tag_markup_t internal_block_body_parse(block_body_t *body, parse_context_
                 VALUE new_tag = rb_funcall(tag_class, intern_parse, 4,
                         tag_name, markup, parse_context->tokenizer_obj, parse_context->ruby_obj);
 
-                if (body->blank && !RTEST(rb_funcall(new_tag, intern_is_blank, 0)))
+                bool tag_blank = RTEST(rb_funcall(new_tag, intern_is_blank, 0));
+                if (!tag_blank)
                     body->blank = false;
 
-                vm_assembler_add_write_node(&body->code, new_tag);
+                unsigned int line_number = tokenizer_line_number_at(tokenizer, token_start);
+                // a comment doesn't render anything, so its parsed body isn't kept
+                if (tag_class != cLiquidComment &&
+                        !condition_compile_tag(&body->code, new_tag, line_number, tag_blank) &&
+                        !for_compile_tag(&body->code, new_tag, line_number, tag_blank) &&
+                        !assign_compile_tag(&body->code, new_tag, line_number, tag_blank) &&
+                        !counter_compile_tag(&body->code, new_tag, line_number, tag_blank) &&
+                        !partial_compile_tag(&body->code, new_tag, line_number, tag_blank))
+                    vm_assembler_add_write_node(&body->code, new_tag);
                 render_score_increment += 1;
                 break;
             }
@@ -224,6 +364,7 @@ static VALUE block_body_parse(VALUE self, VALUE tokenizer_obj, VALUE parse_conte
     parse_context_t parse_context = {
         .tokenizer_obj = tokenizer_obj,
         .ruby_obj = parse_context_obj,
+        .ruby_line_number = 0,
     };
     Tokenizer_Get_Struct(tokenizer_obj, parse_context.tokenizer);
     block_body_t *body;
@@ -231,7 +372,7 @@ static VALUE block_body_parse(VALUE self, VALUE tokenizer_obj, VALUE parse_conte
 
     ensure_not_parsing(body);
     if (body->source == Qnil) {
-        body->source = parse_context.tokenizer->source;
+        RB_OBJ_WRITE(self, &body->source, parse_context.tokenizer->source);
     } else if (body->source != parse_context.tokenizer->source) {
         rb_raise(rb_eArgError, "Liquid::C::BlockBody#parse must be passed the same tokenizer when called multiple times");
     }
@@ -240,6 +381,7 @@ static VALUE block_body_parse(VALUE self, VALUE tokenizer_obj, VALUE parse_conte
 
     tag_markup_t unknown_tag = internal_block_body_parse(body, &parse_context);
     vm_assembler_add_leave(&body->code);
+    vm_assembler_optimize(&body->code);
     body->parsing = false;
     return rb_yield_values(2, unknown_tag.name, unknown_tag.markup);
 }
@@ -256,6 +398,18 @@ static VALUE block_body_render_to_output_buffer(VALUE self, VALUE context, VALUE
     return output;
 }
 
+// Returns the block body of a Liquid::C::BlockBody that is done parsing, or NULL
+// for any other object, for tags whose bodies can be compiled into other code.
+block_body_t *block_body_parsed_struct(VALUE obj)
+{
+    if (!rb_typeddata_is_kind_of(obj, &block_body_data_type))
+        return NULL;
+
+    block_body_t *body;
+    BlockBody_Get_Struct(obj, body);
+    return body->parsing ? NULL : body;
+}
+
 static VALUE block_body_blank_p(VALUE self)
 {
     block_body_t *body;
@@ -263,6 +417,16 @@ static VALUE block_body_blank_p(VALUE self)
     return body->blank ? Qtrue : Qfalse;
 }
 
+// Skips from an OP_RENDER_TAG_RESCUE instruction to the end of the inlined tag, since
+// its code is from the tag's bodies, which aren't part of this block body's nodelist.
+static void skip_inlined_tag(const uint8_t **ip_ptr, const size_t **const_ptr_ptr)
+{
+    assert(**ip_ptr == OP_RENDER_TAG_RESCUE);
+    *ip_ptr += 5;
+    *const_ptr_ptr += 1;
+    vm_read_jump_target(ip_ptr, const_ptr_ptr);
+}
+
 static VALUE block_body_remove_blank_strings(VALUE self)
 {
     block_body_t *body;
@@ -280,16 +444,59 @@ static VALUE block_body_remove_blank_strings(VALUE self)
         if (*ip == OP_WRITE_RAW) {
             size_t *size_ptr = &const_ptr[1];
             if (*size_ptr) {
-                *size_ptr = 0; // effectively a no-op
+                *size_ptr = 0; // removed by vm_assembler_optimize
                 body->render_score--;
             }
+        } else if (*ip == OP_RENDER_TAG_RESCUE) {
+            skip_inlined_tag(&ip, (const size_t **)&const_ptr);
+            continue;
         }
         liquid_vm_next_instruction(&ip, (const size_t **)&const_ptr);
     }
+    vm_assembler_optimize(&body->code);
 
     return Qnil;
 }
 
+// Loads a dump of a block body, like Liquid::C::BlockBody.load, where the instructions are
+// used from the data in place if map_instructions is true, like for a mapped template store.
+VALUE block_body_new_from_dump(VALUE data, VALUE source, bool map_instructions)
+{
+    Check_Type(source, T_STRING);
+    check_utf8_encoding(source, "source");
+
+    VALUE self = rb_obj_alloc(cLiquidCBlockBody);
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+    RB_OBJ_WRITE(self, &body->source, rb_str_dup_frozen(source));
+    if (map_instructions)
+        RB_OBJ_WRITE(self, &body->mapped_dump, data);
+    deserialize_block_body(body, data, map_instructions);
+    return self;
+}
+
+// Dumps the compiled code to a binary string that Liquid::C::BlockBody.load can load with the
+// same source, where the text of the template is left out. The block is given each object that
+// the code references, other than literals and expressions, like the tags that are rendered
+// with Liquid::BlockBody.render_node, and must return a string to re-create it from.
+static VALUE block_body_dump(VALUE self)
+{
+    block_body_t *body;
+    BlockBody_Get_Struct(self, body);
+
+    ensure_not_parsing(body);
+    return serialize_block_body(body);
+}
+
+// Loads a dump of a block body that was parsed from the source. The block is given the strings
+// that the block given to Liquid::C::BlockBody#dump returned and must return the objects
+// they were returned for. The jumps and stack usage of the loaded code are checked, but its
+// operands and values are used as they were dumped, so the dump must come from a trusted source.
+static VALUE block_body_load(VALUE klass, VALUE data, VALUE source)
+{
+    return block_body_new_from_dump(data, source, false);
+}
+
 static void memoize_variable_placeholder()
 {
     if (variable_placeholder == Qnil) {
@@ -333,6 +540,15 @@ static VALUE block_body_nodelist(VALUE self)
                 rb_ary_push(nodelist, const_ptr[0]);
                 break;
             }
+            case OP_BREAK:
+            case OP_CONTINUE:
+                rb_ary_push(nodelist, const_ptr[0]);
+                break;
+
+            case OP_RENDER_TAG_RESCUE:
+                rb_ary_push(nodelist, const_ptr[0]);
+                skip_inlined_tag(&ip, &const_ptr);
+                continue;
 
             case OP_POP_WRITE_VARIABLE:
                 rb_ary_push(nodelist, variable_placeholder);
@@ -358,10 +574,25 @@ void init_liquid_block()
     intern_unknown_tag_in_liquid_tag = rb_intern("unknown_tag_in_liquid_tag");
     intern_ivar_nodelist = rb_intern("@nodelist");
 
+    intern_error_mode = rb_intern("error_mode");
+    intern_depth = rb_intern("depth");
+
+    sym_lax = ID2SYM(rb_intern("lax"));
+
+    VALUE cLiquidBlock = rb_const_get(mLiquid, rb_intern("Block"));
+    block_max_depth = NUM2LONG(rb_const_get(cLiquidBlock, rb_intern("MAX_DEPTH")));
+
     tag_registry = rb_funcall(cLiquidTemplate, rb_intern("tags"), 0);
     rb_global_variable(&tag_registry);
 
-    VALUE cLiquidCBlockBody = rb_define_class_under(mLiquidC, "BlockBody", rb_cObject);
+    cLiquidRaw = rb_const_get(mLiquid, rb_intern("Raw"));
+    rb_global_variable(&cLiquidRaw);
+
+    cLiquidComment = rb_const_get(mLiquid, rb_intern("Comment"));
+    rb_global_variable(&cLiquidComment);
+
+    cLiquidCBlockBody = rb_define_class_under(mLiquidC, "BlockBody", rb_cObject);
+    rb_global_variable(&cLiquidCBlockBody);
     rb_define_alloc_func(cLiquidCBlockBody, block_body_allocate);
 
     rb_define_method(cLiquidCBlockBody, "parse", block_body_parse, 2);
@@ -369,6 +600,8 @@ void init_liquid_block()
     rb_define_method(cLiquidCBlockBody, "remove_blank_strings", block_body_remove_blank_strings, 0);
     rb_define_method(cLiquidCBlockBody, "blank?", block_body_blank_p, 0);
     rb_define_method(cLiquidCBlockBody, "nodelist", block_body_nodelist, 0);
+    rb_define_method(cLiquidCBlockBody, "dump", block_body_dump, 0);
+    rb_define_singleton_method(cLiquidCBlockBody, "load", block_body_load, 2);
 
     rb_global_variable(&variable_placeholder);
 }
@@ -6,12 +6,18 @@
 typedef struct block_body {
     vm_assembler_t code;
     VALUE source; // hold a reference to the ruby object that OP_WRITE_RAW points to
+    VALUE mapped_dump; // the dump that the instructions point into when they are mapped, or nil
     bool parsing; // use to prevent rendering when parsing is incomplete
     bool blank;
     int render_score;
 } block_body_t;
 
+extern const rb_data_type_t block_body_data_type;
+#define BlockBody_Get_Struct(obj, sval) TypedData_Get_Struct(obj, block_body_t, &block_body_data_type, sval)
+
 void init_liquid_block();
+block_body_t *block_body_parsed_struct(VALUE obj);
+VALUE block_body_new_from_dump(VALUE data, VALUE source, bool map_instructions);
 
 #endif
 
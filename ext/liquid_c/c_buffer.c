@@ -1,3 +1,4 @@
+#include "liquid.h"
 #include "c_buffer.h"
 
 static void c_buffer_expand_for_write(c_buffer_t *buffer, size_t write_size)
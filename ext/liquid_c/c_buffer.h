@@ -46,14 +46,24 @@ inline void c_buffer_write_ruby_value(c_buffer_t *buffer, VALUE value) {
     c_buffer_write(buffer, &value, sizeof(VALUE));
 }
 
-inline void c_buffer_rb_gc_mark(c_buffer_t *buffer)
+inline void c_buffer_rb_gc_mark_movable(c_buffer_t *buffer)
 {
     VALUE *buffer_end = (VALUE *)buffer->data_end;
     for (VALUE *obj_ptr = (VALUE *)buffer->data; obj_ptr < buffer_end; obj_ptr++) {
-        rb_gc_mark(*obj_ptr);
+        rb_gc_mark_movable(*obj_ptr);
     }
 }
 
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+inline void c_buffer_rb_gc_update_references(c_buffer_t *buffer)
+{
+    VALUE *buffer_end = (VALUE *)buffer->data_end;
+    for (VALUE *obj_ptr = (VALUE *)buffer->data; obj_ptr < buffer_end; obj_ptr++) {
+        *obj_ptr = rb_gc_location(*obj_ptr);
+    }
+}
+#endif
+
 inline void c_buffer_concat(c_buffer_t *dest, c_buffer_t *src)
 {
     c_buffer_write(dest, src->data, c_buffer_size(src));
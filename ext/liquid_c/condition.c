@@ -0,0 +1,576 @@
+#include "liquid.h"
+#include "condition.h"
+#include "expression.h"
+#include "block.h"
+
+static ID id_ivar_blocks, id_ivar_left, id_ivar_operator, id_ivar_right, id_ivar_attachment,
+    id_ivar_child_relation, id_ivar_child_condition, id_operators, id_to_liquid_value,
+    id_include_p, id_eq, id_message;
+
+static VALUE sym_and, sym_or;
+static VALUE cLiquidIf, cLiquidUnless, cLiquidCase, cLiquidCondition, cLiquidElseCondition, mLiquidUtils;
+static bool has_to_liquid_value;
+
+typedef struct condition_operator {
+    const char *name;
+    enum comparison_operator op;
+    const char *method_name; // Condition.operators value when it isn't a lambda
+} condition_operator_t;
+
+static const condition_operator_t condition_operators[] = {
+    { "==", COMPARE_EQUAL, NULL },
+    { "!=", COMPARE_NOT_EQUAL, NULL },
+    { "<>", COMPARE_NOT_EQUAL, NULL },
+    { "<", COMPARE_LESS, "<" },
+    { ">", COMPARE_GREATER, ">" },
+    { "<=", COMPARE_LESS_EQUAL, "<=" },
+    { ">=", COMPARE_GREATER_EQUAL, ">=" },
+    { "contains", COMPARE_CONTAINS, NULL },
+};
+
+#define NUM_CONDITION_OPERATORS (sizeof(condition_operators) / sizeof(condition_operator_t))
+
+// Condition.operators values when liquid-c was loaded, or Qundef if they
+// didn't have the expected behaviour so can't be compiled.
+static VALUE stock_operators[NUM_CONDITION_OPERATORS];
+static VALUE contains_operator;
+static ID comparison_method_ids[COMPARE_CONTAINS];
+
+// Equivalent to Liquid::Utils.to_liquid_value, for Liquid versions that have it
+static VALUE liquid_value(VALUE value)
+{
+    if (!has_to_liquid_value || RB_SPECIAL_CONST_P(value))
+        return value;
+
+    VALUE klass = RBASIC_CLASS(value);
+    if (klass == rb_cString || klass == rb_cInteger || klass == rb_cFloat || klass == rb_cArray || klass == rb_cHash)
+        return value;
+
+    return rb_funcall(mLiquidUtils, id_to_liquid_value, 1, value);
+}
+
+bool condition_truthy(VALUE value)
+{
+    return RTEST(liquid_value(value));
+}
+
+static inline bool plain_string_p(VALUE value)
+{
+    return !RB_SPECIAL_CONST_P(value) && RBASIC_CLASS(value) == rb_cString;
+}
+
+static VALUE compare_equal(VALUE left, VALUE right)
+{
+    if ((RB_FIXNUM_P(left) && RB_FIXNUM_P(right)) || left == Qnil || left == Qtrue || left == Qfalse)
+        return left == right ? Qtrue : Qfalse;
+    if (plain_string_p(left) && plain_string_p(right))
+        return rb_str_equal(left, right);
+    return rb_funcall(left, id_eq, 1, right);
+}
+
+typedef struct comparison_args {
+    VALUE left;
+    ID method_id;
+    VALUE right;
+} comparison_args_t;
+
+static VALUE call_comparison_method(VALUE uncast_args)
+{
+    comparison_args_t *args = (void *)uncast_args;
+    return rb_funcall(args->left, args->method_id, 1, args->right);
+}
+
+static VALUE raise_comparison_argument_error(VALUE unused_arg, VALUE exception)
+{
+    VALUE message = rb_funcall(exception, id_message, 0);
+    rb_exc_raise(rb_exc_new_str(cLiquidArgumentError, message));
+}
+
+static VALUE compare_order(enum comparison_operator op, VALUE left, VALUE right)
+{
+    int cmp;
+    if (RB_FIXNUM_P(left) && RB_FIXNUM_P(right)) {
+        long left_long = RB_FIX2LONG(left), right_long = RB_FIX2LONG(right);
+        cmp = (left_long > right_long) - (left_long < right_long);
+    } else if (plain_string_p(left) && plain_string_p(right)) {
+        cmp = rb_str_cmp(left, right);
+    } else {
+        ID method_id = comparison_method_ids[op];
+        if (!rb_respond_to(left, method_id) || !rb_respond_to(right, method_id) ||
+                rb_obj_is_kind_of(left, rb_cHash) || rb_obj_is_kind_of(right, rb_cHash)) {
+            return Qnil;
+        }
+        comparison_args_t args = { left, method_id, right };
+        return rb_rescue2(call_comparison_method, (VALUE)&args,
+                raise_comparison_argument_error, Qnil, rb_eArgError, (VALUE)0);
+    }
+
+    switch (op) {
+        case COMPARE_LESS: return cmp < 0 ? Qtrue : Qfalse;
+        case COMPARE_GREATER: return cmp > 0 ? Qtrue : Qfalse;
+        case COMPARE_LESS_EQUAL: return cmp <= 0 ? Qtrue : Qfalse;
+        case COMPARE_GREATER_EQUAL: return cmp >= 0 ? Qtrue : Qfalse;
+        default: rb_bug("invalid comparison operator: %d", op);
+    }
+}
+
+static VALUE compare_contains(VALUE left, VALUE right)
+{
+    if (!RTEST(left) || !RTEST(right))
+        return Qfalse;
+    if (RB_TYPE_P(left, T_ARRAY) && RBASIC_CLASS(left) == rb_cArray)
+        return rb_ary_includes(left, right);
+    if (plain_string_p(left) && plain_string_p(right) && ENCODING_GET(left) == ENCODING_GET(right))
+        return rb_funcall(left, id_include_p, 1, right);
+    return rb_funcall(contains_operator, id_call, 3, Qnil, left, right);
+}
+
+// Equivalent to Liquid::Condition#interpret_condition for the stock operators
+VALUE condition_compare(enum comparison_operator op, VALUE left, VALUE right)
+{
+    left = liquid_value(left);
+    right = liquid_value(right);
+
+    switch (op) {
+        case COMPARE_EQUAL:
+            return compare_equal(left, right);
+        case COMPARE_NOT_EQUAL:
+            return RTEST(compare_equal(left, right)) ? Qfalse : Qtrue;
+        case COMPARE_CONTAINS:
+            return compare_contains(left, right);
+        default:
+            return compare_order(op, left, right);
+    }
+}
+
+typedef struct when_index_search {
+    VALUE value;
+    long from;
+    long index;
+} when_index_search_t;
+
+static int find_when_index(VALUE when_value, VALUE when_index, VALUE uncast_search)
+{
+    when_index_search_t *search = (void *)uncast_search;
+    long index = RB_FIX2LONG(when_index);
+    if (index < search->from || !RTEST(condition_compare(COMPARE_EQUAL, search->value, when_value)))
+        return ST_CONTINUE;
+    search->index = index;
+    return ST_STOP;
+}
+
+// Returns the index of the first when body, starting from the given index, with a value in
+// when_indexes that is equal to the value, or -1 if there isn't one. The when values are
+// strings and integers, which are only equal to other strings and integers when they are
+// eql?, so other values are compared to each of them in order, like Liquid::Case does.
+long condition_when_index(VALUE when_indexes, VALUE value, long from)
+{
+    if (RB_INTEGER_TYPE_P(value) || plain_string_p(value)) {
+        VALUE when_index = rb_hash_lookup2(when_indexes, value, Qnil);
+        if (when_index == Qnil || RB_FIX2LONG(when_index) < from)
+            return -1;
+        return RB_FIX2LONG(when_index);
+    }
+    if (value == Qnil || value == Qtrue || value == Qfalse)
+        return -1;
+
+    when_index_search_t search = { value, from, -1 };
+    rb_hash_foreach(when_indexes, find_when_index, (VALUE)&search);
+    return search.index;
+}
+
+static const condition_operator_t *find_stock_operator(VALUE operators, VALUE name)
+{
+    if (!RB_TYPE_P(name, T_STRING))
+        return NULL;
+
+    for (size_t i = 0; i < NUM_CONDITION_OPERATORS; i++) {
+        const condition_operator_t *operator = &condition_operators[i];
+        long name_len = strlen(operator->name);
+        if (RSTRING_LEN(name) != name_len || memcmp(RSTRING_PTR(name), operator->name, name_len) != 0)
+            continue;
+        if (stock_operators[i] == Qundef || rb_hash_lookup2(operators, name, Qundef) != stock_operators[i])
+            return NULL;
+        return operator;
+    }
+    return NULL;
+}
+
+// Pushes the result of the condition, without its child conditions
+static void compile_comparison(vm_assembler_t *code, VALUE operators, VALUE condition)
+{
+    VALUE left = rb_attr_get(condition, id_ivar_left);
+    VALUE operator_name = rb_attr_get(condition, id_ivar_operator);
+    VALUE right = rb_attr_get(condition, id_ivar_right);
+
+    if (operator_name == Qnil && expression_inlinable_p(left)) {
+        expression_compile_inline(code, left);
+        return;
+    }
+
+    const condition_operator_t *operator = find_stock_operator(operators, operator_name);
+    if (operator && expression_inlinable_p(left) && expression_inlinable_p(right)) {
+        expression_compile_inline(code, left);
+        expression_compile_inline(code, right);
+        vm_assembler_add_compare(code, operator->op);
+        return;
+    }
+
+    VALUE args[3] = { left, operator_name, right };
+    vm_assembler_add_eval_condition(code, rb_class_new_instance(3, args, cLiquidCondition));
+}
+
+// Compiles the condition and its child conditions, which Liquid::Condition#evaluate
+// evaluates from left to right, stopping at the first truthy result for `or` or falsy
+// result for `and`. The code falls through when the result is truthy (or falsy when
+// inverted) and jumps to next_jumps otherwise.
+static void compile_condition(vm_assembler_t *code, VALUE operators, VALUE condition, bool inverted,
+        vm_assembler_jump_list_t *next_jumps)
+{
+    vm_assembler_jump_list_t body_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_jump_list_t *truthy_jumps = inverted ? next_jumps : &body_jumps;
+    vm_assembler_jump_list_t *falsy_jumps = inverted ? &body_jumps : next_jumps;
+
+    while (true) {
+        compile_comparison(code, operators, condition);
+
+        VALUE child_relation = rb_attr_get(condition, id_ivar_child_relation);
+        if (child_relation == sym_or) {
+            vm_assembler_add_jump(code, OP_JUMP_IF, truthy_jumps);
+        } else if (child_relation == sym_and) {
+            vm_assembler_add_jump(code, OP_JUMP_UNLESS, falsy_jumps);
+        } else {
+            vm_assembler_add_jump(code, inverted ? OP_JUMP_IF : OP_JUMP_UNLESS, next_jumps);
+            break;
+        }
+        condition = rb_attr_get(condition, id_ivar_child_condition);
+    }
+    vm_assembler_patch_jumps(code, &body_jumps);
+}
+
+static block_body_t *compilable_attachment(VALUE condition)
+{
+    return block_body_parsed_struct(rb_attr_get(condition, id_ivar_attachment));
+}
+
+static bool compilable_block_p(VALUE block)
+{
+    if (RB_SPECIAL_CONST_P(block) || !compilable_attachment(block))
+        return false;
+    if (RBASIC_CLASS(block) == cLiquidElseCondition)
+        return true;
+
+    VALUE condition = block;
+    while (!RB_SPECIAL_CONST_P(condition) && RBASIC_CLASS(condition) == cLiquidCondition) {
+        VALUE child_relation = rb_attr_get(condition, id_ivar_child_relation);
+        if (child_relation == Qnil)
+            return true;
+        if (child_relation != sym_and && child_relation != sym_or)
+            return false;
+        condition = rb_attr_get(condition, id_ivar_child_condition);
+    }
+    return false;
+}
+
+// Whether the block of a Liquid::Case tag is the first one of its `when` tag, which
+// has a block for each of its values that share the same body
+static bool when_body_start_p(VALUE blocks, long i)
+{
+    VALUE attachment = rb_attr_get(RARRAY_AREF(blocks, i), id_ivar_attachment);
+    return i == 0 || rb_attr_get(RARRAY_AREF(blocks, i - 1), id_ivar_attachment) != attachment;
+}
+
+static bool when_after_p(VALUE blocks, long i)
+{
+    for (i++; i < RARRAY_LEN(blocks); i++) {
+        if (RBASIC_CLASS(RARRAY_AREF(blocks, i)) != cLiquidElseCondition)
+            return true;
+    }
+    return false;
+}
+
+// Whether the block of a Liquid::Case tag starts a body that code gets compiled for.
+// Liquid::Case renders the body of a `when` tag for each of its values that matches, so
+// each block gets its own copy of the body, unless OP_CASE_JUMP compares distinct values.
+static bool when_compiled_body_p(VALUE blocks, long i, bool hashed)
+{
+    return RBASIC_CLASS(RARRAY_AREF(blocks, i)) != cLiquidElseCondition && (!hashed || when_body_start_p(blocks, i));
+}
+
+static void compile_when_comparison(vm_assembler_t *code, VALUE left, VALUE block, vm_assembler_jump_list_t *body_jumps)
+{
+    expression_compile_inline(code, left);
+    expression_compile_inline(code, rb_attr_get(block, id_ivar_right));
+    vm_assembler_add_compare(code, COMPARE_EQUAL);
+    vm_assembler_add_jump(code, OP_JUMP_IF, body_jumps);
+}
+
+// Compiles a stock Liquid::Case tag. Like Liquid::Case, it renders the bodies of all the
+// `when` values that are equal to the left value, since the left value is evaluated again
+// after rendering one, and renders `else` bodies when no earlier `when` value was equal.
+// When the `when` values are distinct string and integer literals and the tag doesn't have
+// an `else` before the last block, OP_CASE_JUMP finds the body to render with a frozen hash
+// of the values, so it doesn't compare the left value to each of them. The other values of
+// the same `when` tag then aren't compared after rendering its body, which only matters
+// if the body changes the left value. A break or continue in a body exits the loop
+// without comparing the following values.
+static bool compile_case(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE left = rb_attr_get(tag, id_ivar_left);
+    VALUE blocks = rb_attr_get(tag, id_ivar_blocks);
+    if (!expression_inlinable_p(left) || !RB_TYPE_P(blocks, T_ARRAY) || RARRAY_LEN(blocks) == 0)
+        return false;
+
+    VALUE operators = rb_funcall(cLiquidCondition, id_operators, 0);
+    VALUE when_indexes = rb_hash_new();
+    long num_blocks = RARRAY_LEN(blocks);
+    size_t num_when_tags = 0, num_when_values = 0;
+    bool hashed = true;
+
+    for (long i = 0; i < num_blocks; i++) {
+        VALUE block = RARRAY_AREF(blocks, i);
+        if (!compilable_block_p(block))
+            return false;
+        if (RBASIC_CLASS(block) == cLiquidElseCondition) {
+            hashed = hashed && i == num_blocks - 1;
+            continue;
+        }
+
+        const condition_operator_t *operator = find_stock_operator(operators, rb_attr_get(block, id_ivar_operator));
+        VALUE right = rb_attr_get(block, id_ivar_right);
+        if (!operator || operator->op != COMPARE_EQUAL || rb_attr_get(block, id_ivar_left) != left ||
+                rb_attr_get(block, id_ivar_child_relation) != Qnil || !expression_inlinable_p(right)) {
+            return false;
+        }
+
+        num_when_values++;
+        if (when_body_start_p(blocks, i))
+            num_when_tags++;
+        if (hashed && (RB_INTEGER_TYPE_P(right) || plain_string_p(right)) &&
+                rb_hash_lookup2(when_indexes, right, Qundef) == Qundef) {
+            rb_hash_aset(when_indexes, right, LONG2FIX((long)num_when_tags - 1));
+        } else {
+            hashed = false;
+        }
+    }
+    // Liquid::Case doesn't evaluate the left value without `when` conditions
+    if (num_when_values == 0)
+        hashed = false;
+    size_t num_whens = hashed ? num_when_tags : num_when_values;
+
+    VALUE jumps_buffer, labels_buffer;
+    vm_assembler_jump_list_t *when_jumps = ALLOCV_N(vm_assembler_jump_list_t, jumps_buffer, num_whens + 1);
+    vm_assembler_label_t *next_labels = ALLOCV_N(vm_assembler_label_t, labels_buffer, num_whens + 1);
+    for (size_t i = 0; i <= num_whens; i++)
+        when_jumps[i] = (vm_assembler_jump_list_t)VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    VALUE last_block = RARRAY_AREF(blocks, num_blocks - 1);
+    bool ends_with_else = RBASIC_CLASS(last_block) == cLiquidElseCondition;
+
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+
+    if (hashed) {
+        expression_compile_inline(code, left);
+        vm_assembler_add_push_fixnum(code, INT2FIX(0));
+        next_labels[0] = vm_assembler_label(code);
+        vm_assembler_add_case_jump(code, rb_obj_freeze(when_indexes), num_whens, when_jumps, &when_jumps[num_whens]);
+        // falls through when none of the following `when` values matched after rendering a body
+        vm_assembler_add_render_tag_body(code, 0);
+        vm_assembler_add_jump(code, OP_JUMP, &end_jumps);
+    } else {
+        // compare the `when` values in order, until one matches, rendering the `else` bodies on the way
+        size_t when_index = 0;
+        for (long i = 0; i < num_blocks; i++) {
+            VALUE block = RARRAY_AREF(blocks, i);
+            if (RBASIC_CLASS(block) == cLiquidElseCondition) {
+                block_body_t *body = compilable_attachment(block);
+                vm_assembler_add_render_tag_body(code, body->render_score);
+                vm_assembler_concat_code(code, &body->code);
+                if (when_after_p(blocks, i))
+                    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+            } else {
+                compile_when_comparison(code, left, block, &when_jumps[when_index++]);
+            }
+        }
+        if (!ends_with_else)
+            vm_assembler_add_render_tag_body(code, 0);
+        vm_assembler_add_jump(code, OP_JUMP, &end_jumps);
+
+        // compare the `when` values that follow a rendered `when` body, skipping `else` bodies
+        if (num_whens > 1) {
+            when_index = 0;
+            for (long i = 0; i < num_blocks; i++) {
+                VALUE block = RARRAY_AREF(blocks, i);
+                if (RBASIC_CLASS(block) == cLiquidElseCondition)
+                    continue;
+                if (when_index > 0) {
+                    next_labels[when_index] = vm_assembler_label(code);
+                    compile_when_comparison(code, left, block, &when_jumps[when_index]);
+                }
+                when_index++;
+            }
+            vm_assembler_add_render_tag_body(code, 0);
+            vm_assembler_add_jump(code, OP_JUMP, &end_jumps);
+        }
+    }
+
+    size_t when_index = 0;
+    for (long i = 0; i < num_blocks; i++) {
+        VALUE block = RARRAY_AREF(blocks, i);
+        if (!when_compiled_body_p(blocks, i, hashed))
+            continue;
+
+        block_body_t *body = compilable_attachment(block);
+        vm_assembler_patch_jumps(code, &when_jumps[when_index]);
+        vm_assembler_add_render_tag_body(code, body->render_score);
+        vm_assembler_concat_code(code, &body->code);
+        when_index++;
+
+        if (when_index < num_whens) {
+            // the following `when` values are compared after rendering the body, which
+            // can change the left value, so exceptions need to be rescued again
+            vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+            if (hashed) {
+                expression_compile_inline(code, left);
+                vm_assembler_add_push_fixnum(code, LONG2FIX((long)when_index));
+                vm_assembler_add_jump_to_label(code, next_labels[0]);
+                code->stack_size -= 2; // popped by OP_CASE_JUMP
+            } else {
+                vm_assembler_add_jump_to_label(code, next_labels[when_index]);
+            }
+        } else if (hashed) {
+            vm_assembler_add_jump(code, OP_JUMP, &end_jumps);
+        }
+    }
+
+    if (hashed) {
+        block_body_t *else_body = ends_with_else ? compilable_attachment(last_block) : NULL;
+        vm_assembler_patch_jumps(code, &when_jumps[num_whens]);
+        vm_assembler_add_render_tag_body(code, else_body ? else_body->render_score : 0);
+        if (else_body)
+            vm_assembler_concat_code(code, &else_body->code);
+    }
+
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+
+    ALLOCV_END(jumps_buffer);
+    ALLOCV_END(labels_buffer);
+    RB_GC_GUARD(when_indexes);
+    return true;
+}
+
+// Compiles a stock Liquid::If, Liquid::Unless or Liquid::Case tag, so its conditions get
+// evaluated and its bodies rendered by the VM, instead of rendering the tag with
+// Liquid::BlockBody.render_node.
+// Returns false without adding any code if the tag can't be compiled.
+bool condition_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE tag_class = RBASIC_CLASS(tag);
+    if (tag_class == cLiquidCase)
+        return compile_case(code, tag, line_number, blank);
+    if (tag_class != cLiquidIf && tag_class != cLiquidUnless)
+        return false;
+
+    VALUE blocks = rb_attr_get(tag, id_ivar_blocks);
+    if (!RB_TYPE_P(blocks, T_ARRAY) || RARRAY_LEN(blocks) == 0)
+        return false;
+    for (long i = 0; i < RARRAY_LEN(blocks); i++) {
+        if (!compilable_block_p(RARRAY_AREF(blocks, i)))
+            return false;
+    }
+
+    VALUE operators = rb_funcall(cLiquidCondition, id_operators, 0);
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    bool has_else = false;
+
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+
+    for (long i = 0; i < RARRAY_LEN(blocks); i++) {
+        VALUE block = RARRAY_AREF(blocks, i);
+        vm_assembler_jump_list_t next_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+
+        has_else = RBASIC_CLASS(block) == cLiquidElseCondition;
+        if (!has_else) {
+            bool inverted = tag_class == cLiquidUnless && i == 0;
+            compile_condition(code, operators, block, inverted, &next_jumps);
+        }
+
+        block_body_t *body = compilable_attachment(block);
+        vm_assembler_add_render_tag_body(code, body->render_score);
+        vm_assembler_concat_code(code, &body->code);
+
+        if (has_else)
+            break; // any following blocks are unreachable
+        vm_assembler_add_jump(code, OP_JUMP, &end_jumps);
+        vm_assembler_patch_jumps(code, &next_jumps);
+    }
+
+    if (!has_else)
+        vm_assembler_add_render_tag_body(code, 0);
+
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+    return true;
+}
+
+void init_liquid_condition()
+{
+    id_ivar_blocks = rb_intern("@blocks");
+    id_ivar_left = rb_intern("@left");
+    id_ivar_operator = rb_intern("@operator");
+    id_ivar_right = rb_intern("@right");
+    id_ivar_attachment = rb_intern("@attachment");
+    id_ivar_child_relation = rb_intern("@child_relation");
+    id_ivar_child_condition = rb_intern("@child_condition");
+    id_operators = rb_intern("operators");
+    id_to_liquid_value = rb_intern("to_liquid_value");
+    id_include_p = rb_intern("include?");
+    id_eq = rb_intern("==");
+    id_message = rb_intern("message");
+
+    sym_and = ID2SYM(rb_intern("and"));
+    sym_or = ID2SYM(rb_intern("or"));
+
+    cLiquidIf = rb_const_get(mLiquid, rb_intern("If"));
+    rb_global_variable(&cLiquidIf);
+
+    cLiquidUnless = rb_const_get(mLiquid, rb_intern("Unless"));
+    rb_global_variable(&cLiquidUnless);
+
+    cLiquidCase = rb_const_get(mLiquid, rb_intern("Case"));
+    rb_global_variable(&cLiquidCase);
+
+    cLiquidCondition = rb_const_get(mLiquid, rb_intern("Condition"));
+    rb_global_variable(&cLiquidCondition);
+
+    cLiquidElseCondition = rb_const_get(mLiquid, rb_intern("ElseCondition"));
+    rb_global_variable(&cLiquidElseCondition);
+
+    mLiquidUtils = rb_const_get(mLiquid, rb_intern("Utils"));
+    rb_global_variable(&mLiquidUtils);
+    has_to_liquid_value = rb_respond_to(mLiquidUtils, id_to_liquid_value);
+
+    VALUE operators = rb_funcall(cLiquidCondition, id_operators, 0);
+    Check_Type(operators, T_HASH);
+    contains_operator = Qundef;
+    for (size_t i = 0; i < NUM_CONDITION_OPERATORS; i++) {
+        const condition_operator_t *operator = &condition_operators[i];
+        VALUE value = rb_hash_lookup2(operators, rb_str_new_cstr(operator->name), Qundef);
+
+        bool expected;
+        if (operator->method_name) {
+            ID method_id = rb_intern(operator->method_name);
+            comparison_method_ids[operator->op] = method_id;
+            expected = value == ID2SYM(method_id);
+        } else {
+            expected = value != Qundef && RTEST(rb_obj_is_proc(value));
+        }
+        stock_operators[i] = expected ? value : Qundef;
+        rb_global_variable(&stock_operators[i]);
+
+        if (operator->op == COMPARE_CONTAINS)
+            contains_operator = stock_operators[i];
+    }
+    rb_global_variable(&contains_operator);
+}
@@ -0,0 +1,12 @@
+#if !defined(LIQUID_CONDITION_H)
+#define LIQUID_CONDITION_H
+
+#include "vm_assembler.h"
+
+void init_liquid_condition();
+bool condition_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank);
+bool condition_truthy(VALUE value);
+VALUE condition_compare(enum comparison_operator op, VALUE left, VALUE right);
+long condition_when_index(VALUE when_indexes, VALUE value, long from);
+
+#endif
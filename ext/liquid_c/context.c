@@ -9,7 +9,7 @@ ID id_aset, id_set_context;
 static ID id_has_key, id_aref;
 static ID id_ivar_scopes, id_ivar_environments, id_ivar_static_environments, id_ivar_strict_variables;
 
-static VALUE context_evaluate(VALUE self, VALUE expression)
+VALUE context_evaluate(VALUE self, VALUE expression)
 {
     // Scalar type stored directly in the VALUE, this needs to be checked anyways to use RB_BUILTIN_TYPE
     if (RB_SPECIAL_CONST_P(expression))
@@ -123,6 +123,30 @@ variable_found:
     return variable;
 }
 
+// Equivalent to context.scopes.last[key] = value, which is how the assign
+// and capture tags set variables
+void context_set_last_scope_variable(VALUE self, VALUE key, VALUE value)
+{
+    VALUE scopes = rb_ivar_get(self, id_ivar_scopes);
+    Check_Type(scopes, T_ARRAY);
+
+    VALUE scope = rb_ary_entry(scopes, -1);
+    if (RB_LIKELY(RB_TYPE_P(scope, T_HASH))) {
+        rb_hash_aset(scope, key, value);
+    } else {
+        rb_funcall(scope, id_aset, 2, key, value);
+    }
+}
+
+// Equivalent to context.environments.first, which is where the increment and
+// decrement tags keep their counters
+VALUE context_first_environment(VALUE self)
+{
+    VALUE environments = rb_ivar_get(self, id_ivar_environments);
+    Check_Type(environments, T_ARRAY);
+    return rb_ary_entry(environments, 0);
+}
+
 // Shopify requires checking if we are filtering, so provide a
 // way to do that in liquid-c until we figure out how we want to
 // support that longer term.
@@ -2,8 +2,11 @@
 #define LIQUID_CONTEXT_H
 
 void init_liquid_context();
+VALUE context_evaluate(VALUE self, VALUE expression);
 VALUE context_find_variable(VALUE self, VALUE key, VALUE raise_on_not_found);
 void context_maybe_raise_undefined_variable(VALUE self, VALUE key);
+void context_set_last_scope_variable(VALUE self, VALUE key, VALUE value);
+VALUE context_first_environment(VALUE self);
 
 extern ID id_aset, id_set_context;
 
@@ -0,0 +1,94 @@
+#include "liquid.h"
+#include "counter.h"
+#include "expression.h"
+#include "block.h"
+
+static ID id_ivar_variable, id_ivar_variables, id_ivar_name, id_ivar_body;
+
+static VALUE cLiquidIncrement, cLiquidDecrement, cLiquidCycle, cLiquidIfchanged;
+
+static bool compile_counter(vm_assembler_t *code, enum opcode op, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE variable_name = rb_attr_get(tag, id_ivar_variable);
+    if (!RB_TYPE_P(variable_name, T_STRING))
+        return false;
+
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+    vm_assembler_add_counter(code, op, rb_str_new_frozen(variable_name));
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+    return true;
+}
+
+static bool compile_cycle(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE values = rb_attr_get(tag, id_ivar_variables);
+    VALUE group_name = rb_attr_get(tag, id_ivar_name);
+    if (!RB_TYPE_P(values, T_ARRAY) || RARRAY_LEN(values) == 0 || !expression_inlinable_p(group_name))
+        return false;
+
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+    expression_compile_inline(code, group_name);
+    vm_assembler_add_cycle(code, rb_ary_freeze(rb_ary_dup(values)));
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+    return true;
+}
+
+static bool compile_ifchanged(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    block_body_t *body = block_body_parsed_struct(rb_attr_get(tag, id_ivar_body));
+    if (!body)
+        return false;
+
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+    vm_assembler_add_capture_begin(code, Qnil);
+    vm_assembler_add_render_tag_body(code, body->render_score);
+    vm_assembler_concat_code(code, &body->code);
+    vm_assembler_add_capture_end(code);
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+    return true;
+}
+
+// Compiles the stock Liquid::Increment, Liquid::Decrement, Liquid::Cycle and Liquid::Ifchanged
+// tags, so the VM updates the state they keep in the context between renders, instead of
+// rendering the tag with Liquid::BlockBody.render_node. The state stays in the first
+// environment and the registers, where Ruby code can still use it.
+// Returns false without adding any code if the tag can't be compiled.
+bool counter_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE tag_class = RBASIC_CLASS(tag);
+    if (tag_class == cLiquidIncrement)
+        return compile_counter(code, OP_INCREMENT, tag, line_number, blank);
+    if (tag_class == cLiquidDecrement)
+        return compile_counter(code, OP_DECREMENT, tag, line_number, blank);
+    if (tag_class == cLiquidCycle)
+        return compile_cycle(code, tag, line_number, blank);
+    if (tag_class == cLiquidIfchanged)
+        return compile_ifchanged(code, tag, line_number, blank);
+    return false;
+}
+
+void init_liquid_counter()
+{
+    id_ivar_variable = rb_intern("@variable");
+    id_ivar_variables = rb_intern("@variables");
+    id_ivar_name = rb_intern("@name");
+    id_ivar_body = rb_intern("@body");
+
+    cLiquidIncrement = rb_const_get(mLiquid, rb_intern("Increment"));
+    rb_global_variable(&cLiquidIncrement);
+
+    cLiquidDecrement = rb_const_get(mLiquid, rb_intern("Decrement"));
+    rb_global_variable(&cLiquidDecrement);
+
+    cLiquidCycle = rb_const_get(mLiquid, rb_intern("Cycle"));
+    rb_global_variable(&cLiquidCycle);
+
+    cLiquidIfchanged = rb_const_get(mLiquid, rb_intern("Ifchanged"));
+    rb_global_variable(&cLiquidIfchanged);
+}
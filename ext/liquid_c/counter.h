@@ -0,0 +1,9 @@
+#if !defined(LIQUID_COUNTER_H)
+#define LIQUID_COUNTER_H
+
+#include "vm_assembler.h"
+
+void init_liquid_counter();
+bool counter_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank);
+
+#endif
@@ -6,12 +6,24 @@
 
 VALUE cLiquidCExpression;
 
+static ID id_ruby_parse;
+
+static VALUE cLiquidExpression;
+
 static void expression_mark(void *ptr)
 {
     expression_t *expression = ptr;
     vm_assembler_gc_mark(&expression->code);
 }
 
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void expression_compact(void *ptr)
+{
+    expression_t *expression = ptr;
+    vm_assembler_compact(&expression->code);
+}
+#endif
+
 static void expression_free(void *ptr)
 {
     expression_t *expression = ptr;
@@ -27,8 +39,12 @@ static size_t expression_memsize(const void *ptr)
 
 const rb_data_type_t expression_data_type = {
     "liquid_expression",
-    { expression_mark, expression_free, expression_memsize, },
-    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+    { expression_mark, expression_free, expression_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+        expression_compact,
+#endif
+    },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
 };
 
 VALUE expression_new(expression_t **expression_ptr)
@@ -36,7 +52,7 @@ VALUE expression_new(expression_t **expression_ptr)
     expression_t *expression;
     VALUE obj = TypedData_Make_Struct(cLiquidCExpression, expression_t, &expression_data_type, expression);
     *expression_ptr = expression;
-    vm_assembler_init(&expression->code);
+    vm_assembler_init(&expression->code, obj);
     return obj;
 }
 
@@ -47,35 +63,62 @@ static VALUE internal_expression_parse(parser_t *p)
 
     // Avoid allocating an expression object just to wrap a constant
     VALUE const_obj = try_parse_constant_expression(p);
-    if (const_obj != Qundef)
+    if (const_obj != Qundef || parser_failed(p))
         return const_obj;
 
     expression_t *expression;
     VALUE expr_obj = expression_new(&expression);
 
     parse_and_compile_expression(p, &expression->code);
+    if (parser_failed(p))
+        return Qundef;
     assert(expression->code.stack_size == 1);
     vm_assembler_add_leave(&expression->code);
 
     return expr_obj;
 }
 
-static VALUE expression_strict_parse(VALUE klass, VALUE markup)
+// Returns Qundef and leaves the parser's error set if the markup doesn't strictly parse
+static VALUE try_expression_strict_parse(parser_t *p, VALUE markup)
 {
     StringValue(markup);
     char *start = RSTRING_PTR(markup);
 
-    parser_t p;
-    init_parser(&p, start, start + RSTRING_LEN(markup));
-    VALUE expr_obj = internal_expression_parse(&p);
+    init_parser(p, start, start + RSTRING_LEN(markup));
+    VALUE expr_obj = internal_expression_parse(p);
 
-    if (p.cur.type != TOKEN_EOS)
-        rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "[:%s] is not a valid expression", symbol_names[p.cur.type]);
+    if (!parser_failed(p) && p->cur.type != TOKEN_EOS)
+        parser_set_error(p, PARSER_ERROR_UNEXPECTED_TOKEN, p->cur);
 
+    return parser_failed(p) ? Qundef : expr_obj;
+}
+
+static VALUE expression_strict_parse(VALUE klass, VALUE markup)
+{
+    parser_t p;
+    VALUE expr_obj = try_expression_strict_parse(&p, markup);
+    if (expr_obj == Qundef)
+        rb_exc_raise(parser_error_to_exception(&p.error));
     return expr_obj;
 }
 
-#define Expression_Get_Struct(obj, sval) TypedData_Get_Struct(obj, expression_t, &expression_data_type, sval)
+// Parses markup with Liquid::Expression.ruby_parse, the lax parser that
+// Liquid::Expression.parse uses for markup that doesn't strictly parse
+VALUE expression_ruby_parse(VALUE markup)
+{
+    return rb_funcall(cLiquidExpression, id_ruby_parse, 1, markup);
+}
+
+// Equivalent to Liquid::Expression.parse, without raising a syntax error
+// to fall back to the lax parser
+static VALUE expression_lax_parse(VALUE klass, VALUE markup)
+{
+    parser_t p;
+    VALUE expr_obj = try_expression_strict_parse(&p, markup);
+    if (expr_obj == Qundef)
+        return expression_ruby_parse(markup);
+    return expr_obj;
+}
 
 static VALUE expression_evaluate(VALUE self, VALUE context)
 {
@@ -89,10 +132,43 @@ VALUE internal_expression_evaluate(expression_t *expression, VALUE context)
     return liquid_vm_evaluate(context, &expression->code);
 }
 
+static bool literal_expression_p(VALUE expression)
+{
+    if (RB_SPECIAL_CONST_P(expression))
+        return true;
+    VALUE klass = RBASIC_CLASS(expression);
+    return klass == rb_cString || klass == rb_cInteger || klass == rb_cFloat;
+}
+
+// Returns true if the parsed expression is a literal or a Liquid::C::Expression,
+// so it can be compiled into other code with expression_compile_inline.
+bool expression_inlinable_p(VALUE expression)
+{
+    return literal_expression_p(expression) || RBASIC_CLASS(expression) == cLiquidCExpression;
+}
+
+// Adds code that pushes the value of the parsed expression
+void expression_compile_inline(vm_assembler_t *code, VALUE expression)
+{
+    if (literal_expression_p(expression)) {
+        vm_assembler_add_push_literal(code, expression);
+    } else {
+        expression_t *expr;
+        Expression_Get_Struct(expression, expr);
+        vm_assembler_concat_code(code, &expr->code);
+    }
+}
+
 void init_liquid_expression()
 {
+    id_ruby_parse = rb_intern("ruby_parse");
+
+    cLiquidExpression = rb_const_get(mLiquid, rb_intern("Expression"));
+    rb_global_variable(&cLiquidExpression);
+
     cLiquidCExpression = rb_define_class_under(mLiquidC, "Expression", rb_cObject);
     rb_undef_alloc_func(cLiquidCExpression);
     rb_define_singleton_method(cLiquidCExpression, "strict_parse", expression_strict_parse, 1);
+    rb_define_singleton_method(cLiquidCExpression, "lax_parse", expression_lax_parse, 1);
     rb_define_method(cLiquidCExpression, "evaluate", expression_evaluate, 1);
 }
@@ -10,10 +10,16 @@ typedef struct expression {
     vm_assembler_t code;
 } expression_t;
 
+extern const rb_data_type_t expression_data_type;
+#define Expression_Get_Struct(obj, sval) TypedData_Get_Struct(obj, expression_t, &expression_data_type, sval)
+
 void init_liquid_expression();
 
 VALUE expression_new(expression_t **expression_ptr);
 VALUE internal_expression_evaluate(expression_t *expression, VALUE context);
+VALUE expression_ruby_parse(VALUE markup);
+bool expression_inlinable_p(VALUE expression);
+void expression_compile_inline(vm_assembler_t *code, VALUE expression);
 
 #endif
 
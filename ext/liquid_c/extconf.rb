@@ -12,9 +12,18 @@ else
   $CFLAGS << ' -DNDEBUG'
 end
 
+# Use the portable switch based VM dispatch, e.g. to benchmark against it
+if ENV['LIQUID_VM_SWITCH_DISPATCH'] == 'true'
+  $CFLAGS << ' -DLIQUID_VM_SWITCH_DISPATCH'
+end
+
 if Gem::Version.new(RUBY_VERSION) >= Gem::Version.new("2.7.0") # added in 2.7
   $CFLAGS << ' -DHAVE_RB_HASH_BULK_INSERT'
+  $CFLAGS << ' -DHAVE_RB_GC_MARK_MOVABLE' # with GC.compact
 end
 
+# Used to map Liquid::C::TemplateStore files
+have_header('sys/mman.h')
+
 $warnflags.gsub!(/-Wdeclaration-after-statement/, "") if $warnflags
 create_makefile("liquid_c")
@@ -0,0 +1,203 @@
+#include "liquid.h"
+#include "for.h"
+#include "expression.h"
+#include "block.h"
+#include "vm.h"
+
+VALUE cLiquidForloopDrop, cLiquidBreakInterrupt, forloop_variable_name;
+
+static ID id_ivar_variable_name, id_ivar_collection_name, id_ivar_name, id_ivar_reversed,
+    id_ivar_from, id_ivar_limit, id_ivar_for_block, id_ivar_else_block, id_slice_collection;
+
+static VALUE cLiquidFor, cLiquidBreak, cLiquidContinue, mLiquidUtils;
+
+// Equivalent to Liquid::Utils.slice_collection
+VALUE for_slice_collection(VALUE collection, VALUE from, VALUE to)
+{
+    return rb_funcall(mLiquidUtils, id_slice_collection, 3, collection, from, to);
+}
+
+// Returns true unless the only variables the code looks up are named
+// and none of them is forloop. Filters that get the forloop object from
+// the context aren't considered. The values of a cycle tag are evaluated
+// when it renders, so they may look up forloop too, and partials may
+// start loops with a parentloop.
+static bool code_may_use_forloop(vm_assembler_t *code)
+{
+    const uint8_t *ip = code->instructions.data;
+    const size_t *const_ptr = (const size_t *)code->constants.data;
+
+    while (*ip != OP_LEAVE) {
+        switch (*ip) {
+            case OP_FIND_STATIC_VAR:
+            case OP_FIND_PATH:
+            {
+                VALUE name = (VALUE)const_ptr[0];
+                if (!RB_TYPE_P(name, T_STRING) || RTEST(rb_str_equal(name, forloop_variable_name)))
+                    return true;
+                break;
+            }
+            case OP_FIND_VAR:
+            case OP_WRITE_NODE:
+            case OP_RENDER_PARTIAL:
+            case OP_EVAL_CONDITION:
+            case OP_CYCLE:
+                return true;
+        }
+        liquid_vm_next_instruction(&ip, &const_ptr);
+    }
+    return false;
+}
+
+// Compiles a collection that is an integer range so it pushes the range's
+// begin and end values instead, which the loop iterates over without
+// creating the range. Returns false without adding any code otherwise.
+static bool compile_int_range(vm_assembler_t *code, VALUE collection)
+{
+    if (RB_SPECIAL_CONST_P(collection))
+        return false;
+
+    VALUE klass = RBASIC_CLASS(collection);
+    if (klass == rb_cRange) {
+        VALUE begin, end;
+        int exclude_end;
+        rb_range_values(collection, &begin, &end, &exclude_end);
+        if (exclude_end || !RB_FIXNUM_P(begin) || !RB_FIXNUM_P(end))
+            return false;
+        vm_assembler_add_push_fixnum(code, begin);
+        vm_assembler_add_push_fixnum(code, end);
+        return true;
+    }
+    if (klass != cLiquidCExpression)
+        return false;
+
+    expression_t *expression;
+    Expression_Get_Struct(collection, expression);
+
+    const uint8_t *ip = expression->code.instructions.data;
+    const size_t *const_ptr = (const size_t *)expression->code.constants.data;
+    const uint8_t *last_ip = ip;
+    while (*ip != OP_LEAVE) {
+        last_ip = ip;
+        liquid_vm_next_instruction(&ip, &const_ptr);
+    }
+    if (*last_ip != OP_NEW_INT_RANGE)
+        return false;
+
+    vm_assembler_concat_code(code, &expression->code);
+    // leave the range's values on the stack
+    code->instructions.data_end--;
+    assert(*code->instructions.data_end == OP_NEW_INT_RANGE);
+    code->stack_size++;
+    return true;
+}
+
+// Compiles a stock Liquid::For tag, so the VM loops over the collection and renders
+// its body, instead of rendering the tag with Liquid::BlockBody.render_node. The stock
+// Liquid::Break and Liquid::Continue tags are compiled into instructions that jump
+// within the innermost inlined loop.
+// Returns false without adding any code if the tag can't be compiled.
+bool for_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE tag_class = RBASIC_CLASS(tag);
+    if (tag_class == cLiquidBreak || tag_class == cLiquidContinue) {
+        vm_assembler_add_loop_interrupt(code, tag_class == cLiquidBreak ? OP_BREAK : OP_CONTINUE, tag);
+        return true;
+    }
+    if (tag_class != cLiquidFor)
+        return false;
+
+    VALUE variable_name = rb_attr_get(tag, id_ivar_variable_name);
+    VALUE loop_name = rb_attr_get(tag, id_ivar_name);
+    VALUE collection = rb_attr_get(tag, id_ivar_collection_name);
+    VALUE from = rb_attr_get(tag, id_ivar_from);
+    VALUE limit = rb_attr_get(tag, id_ivar_limit);
+    VALUE else_block = rb_attr_get(tag, id_ivar_else_block);
+
+    block_body_t *for_body = block_body_parsed_struct(rb_attr_get(tag, id_ivar_for_block));
+    block_body_t *else_body = NULL;
+    if (!for_body || (else_block != Qnil && !(else_body = block_body_parsed_struct(else_block))))
+        return false;
+    if (!RB_TYPE_P(variable_name, T_STRING) || !RB_TYPE_P(loop_name, T_STRING))
+        return false;
+    // offset: continue is parsed into a symbol, which needs the offset from the last loop
+    if (RB_SYMBOL_P(from) || !expression_inlinable_p(from) || !expression_inlinable_p(limit))
+        return false;
+    if (RB_SYMBOL_P(collection) || !(expression_inlinable_p(collection) || rb_obj_is_kind_of(collection, rb_cRange)))
+        return false;
+
+    uint8_t flags = 0;
+    if (RTEST(rb_attr_get(tag, id_ivar_reversed)))
+        flags |= FOR_LOOP_REVERSED;
+    if (code_may_use_forloop(&for_body->code))
+        flags |= FOR_LOOP_FORLOOP;
+
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_jump_list_t else_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_jump_list_t exit_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+
+    expression_compile_inline(code, from);
+    if (compile_int_range(code, collection)) {
+        flags |= FOR_LOOP_INT_RANGE;
+    } else if (expression_inlinable_p(collection)) {
+        expression_compile_inline(code, collection);
+    } else {
+        vm_assembler_add_push_const(code, collection);
+    }
+    expression_compile_inline(code, limit);
+    vm_assembler_add_for_init(code, flags, rb_str_new_frozen(variable_name), loop_name, &else_jumps);
+
+    vm_assembler_label_t next_label = vm_assembler_label(code);
+    vm_assembler_add_for_next(code, for_body->render_score, &exit_jumps);
+    vm_assembler_concat_code(code, &for_body->code);
+    vm_assembler_add_jump_to_label(code, next_label);
+
+    vm_assembler_patch_jumps(code, &exit_jumps);
+    vm_assembler_add_for_end(code);
+    vm_assembler_add_jump(code, OP_JUMP, &end_jumps);
+
+    vm_assembler_patch_jumps(code, &else_jumps);
+    vm_assembler_add_render_tag_body(code, else_body ? else_body->render_score : 0);
+    if (else_body)
+        vm_assembler_concat_code(code, &else_body->code);
+
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+    return true;
+}
+
+void init_liquid_for()
+{
+    id_ivar_variable_name = rb_intern("@variable_name");
+    id_ivar_collection_name = rb_intern("@collection_name");
+    id_ivar_name = rb_intern("@name");
+    id_ivar_reversed = rb_intern("@reversed");
+    id_ivar_from = rb_intern("@from");
+    id_ivar_limit = rb_intern("@limit");
+    id_ivar_for_block = rb_intern("@for_block");
+    id_ivar_else_block = rb_intern("@else_block");
+    id_slice_collection = rb_intern("slice_collection");
+
+    cLiquidFor = rb_const_get(mLiquid, rb_intern("For"));
+    rb_global_variable(&cLiquidFor);
+
+    cLiquidBreak = rb_const_get(mLiquid, rb_intern("Break"));
+    rb_global_variable(&cLiquidBreak);
+
+    cLiquidContinue = rb_const_get(mLiquid, rb_intern("Continue"));
+    rb_global_variable(&cLiquidContinue);
+
+    cLiquidForloopDrop = rb_const_get(mLiquid, rb_intern("ForloopDrop"));
+    rb_global_variable(&cLiquidForloopDrop);
+
+    cLiquidBreakInterrupt = rb_const_get(mLiquid, rb_intern("BreakInterrupt"));
+    rb_global_variable(&cLiquidBreakInterrupt);
+
+    mLiquidUtils = rb_const_get(mLiquid, rb_intern("Utils"));
+    rb_global_variable(&mLiquidUtils);
+
+    forloop_variable_name = rb_obj_freeze(rb_str_new_literal("forloop"));
+    rb_global_variable(&forloop_variable_name);
+}
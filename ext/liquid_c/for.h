@@ -0,0 +1,12 @@
+#if !defined(LIQUID_FOR_H)
+#define LIQUID_FOR_H
+
+#include "vm_assembler.h"
+
+extern VALUE cLiquidForloopDrop, cLiquidBreakInterrupt, forloop_variable_name;
+
+void init_liquid_for();
+bool for_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank);
+VALUE for_slice_collection(VALUE collection, VALUE from, VALUE to);
+
+#endif
@@ -22,31 +22,50 @@ const char *symbol_names[TOKEN_END] = {
     [TOKEN_DASH] = "dash"
 };
 
-inline static int is_identifier(char c)
-{
-    return ISALNUM(c) || c == '_' || c == '-';
-}
+// Character classes used by lex_one, indexed by the unsigned value of a byte.
+#define CHAR_SPACE 0x1
+#define CHAR_DIGIT 0x2
+#define CHAR_ALPHA 0x4 // also includes '_'
+#define CHAR_DASH 0x8
+#define CHAR_SPECIAL 0x10 // single character tokens
+
+#define CHAR_NUMBER_START (CHAR_DIGIT | CHAR_DASH)
+#define CHAR_IDENTIFIER (CHAR_ALPHA | CHAR_DIGIT | CHAR_DASH)
+
+#define S CHAR_SPACE
+#define D CHAR_DIGIT
+#define A CHAR_ALPHA
+#define N CHAR_DASH
+#define P CHAR_SPECIAL
+
+static const unsigned char char_classes[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, S, S, S, S, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    S, 0, 0, 0, 0, 0, 0, 0, P, P, 0, 0, P, N|P, P, 0,
+    D, D, D, D, D, D, D, D, D, D, P, 0, 0, 0, 0, P,
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, P, 0, P, 0, A,
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, 0, P, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
 
-inline static int is_special(char c)
-{
-    switch (c) {
-        case '|': case '.': case ':': case ',':
-        case '[': case ']': case '(': case ')':
-        case '?': case '-':
-            return 1;
-    }
-    return 0;
-}
+#undef S
+#undef D
+#undef A
+#undef N
+#undef P
 
-// Returns a pointer to the character after the end of the match.
-inline static const char *prefix_end(const char *cur, const char *end, const char *pattern)
+inline static int char_is(char c, unsigned char char_class)
 {
-    size_t pattern_len = strlen(pattern);
-
-    if (pattern_len > (size_t)(end - cur)) return NULL;
-    if (memcmp(cur, pattern, pattern_len) != 0) return NULL;
-
-    return cur + pattern_len;
+    return char_classes[(unsigned char)c] & char_class;
 }
 
 inline static const char *scan_past(const char *cur, const char *end, char target)
@@ -55,24 +74,27 @@ inline static const char *scan_past(const char *cur, const char *end, char targe
     return match ? match + 1 : NULL;
 }
 
+#define CONTAINS_LEN 8
+
 #define RETURN_TOKEN(t, n) { \
     const char *tok_end = str + (n); \
     token->type = (t); \
     token->val = str; \
     if (str != start) token->flags |= TOKEN_SPACE_PREFIX; \
-    if (tok_end < end && ISSPACE(*tok_end)) token->flags |= TOKEN_SPACE_SUFFIX; \
+    if (tok_end < end && char_is(*tok_end, CHAR_SPACE)) token->flags |= TOKEN_SPACE_SUFFIX; \
     return (token->val_end = tok_end); \
 }
 
 // Reads one token from start, and fills it into the token argument.
 // Returns the start of the next token if any, otherwise the end of the string.
+// An unexpected character is returned as a TOKEN_NONE token for the parser to report.
 const char *lex_one(const char *start, const char *end, lexer_token_t *token)
 {
     // str references the start of the token, after whitespace is skipped.
     // cur references the currently processing character during iterative lexing.
     const char *str = start, *cur;
 
-    while (str < end && ISSPACE(*str)) ++str;
+    while (str < end && char_is(*str, CHAR_SPACE)) ++str;
 
     token->val = token->val_end = NULL;
     token->flags = 0;
@@ -97,9 +119,6 @@ const char *lex_one(const char *start, const char *end, lexer_token_t *token)
             break;
     }
 
-    if ((cur = prefix_end(str, end, "contains")))
-        RETURN_TOKEN(TOKEN_COMPARISON, cur - str);
-
     if (c == '\'' || c == '"') {
         cur = scan_past(str, end, c);
 
@@ -109,13 +128,13 @@ const char *lex_one(const char *start, const char *end, lexer_token_t *token)
         }
     }
 
-    if (ISDIGIT(c) || c == '-') {
+    if (char_is(c, CHAR_NUMBER_START)) {
         int has_dot = 0;
         cur = str;
         while (++cur < end) {
             if (!has_dot && *cur == '.') {
                 has_dot = 1;
-            } else if (!ISDIGIT(*cur)) {
+            } else if (!char_is(*cur, CHAR_DIGIT)) {
                 break;
             }
         }
@@ -131,18 +150,28 @@ const char *lex_one(const char *start, const char *end, lexer_token_t *token)
         }
     }
 
-    if (ISALPHA(c) || c == '_') {
+    if (char_is(c, CHAR_ALPHA)) {
         cur = str;
-        while (++cur < end && is_identifier(*cur)) {}
+        while (++cur < end && char_is(*cur, CHAR_IDENTIFIER)) {}
+
+        // The contains operator is matched as a prefix, so "containsx" is
+        // lexed as the comparison followed by the identifier "x".
+        if (c == 'c' && cur - str >= CONTAINS_LEN && memcmp(str, "contains", CONTAINS_LEN) == 0)
+            RETURN_TOKEN(TOKEN_COMPARISON, CONTAINS_LEN);
+
         if (cur < end && *cur == '?') cur++;
         RETURN_TOKEN(TOKEN_IDENTIFIER, cur - str);
     }
 
-    if (is_special(c)) RETURN_TOKEN(c, 1);
+    if (char_is(c, CHAR_SPECIAL)) RETURN_TOKEN(c, 1);
 
-    rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "Unexpected character %c", c);
-    return NULL;
+    // Unexpected character, which ends the tokens of the string
+    token->type = TOKEN_NONE;
+    token->val = str;
+    token->val_end = str + 1;
+    return end;
 }
 
 #undef RETURN_TOKEN
+#undef CONTAINS_LEN
 
@@ -10,6 +10,14 @@
 #include "context.h"
 #include "variable_lookup.h"
 #include "vm.h"
+#include "simd.h"
+#include "standard_filters.h"
+#include "condition.h"
+#include "for.h"
+#include "assign.h"
+#include "counter.h"
+#include "partial.h"
+#include "template_store.h"
 
 ID id_evaluate;
 ID id_to_liquid;
@@ -26,6 +34,14 @@ __attribute__((noreturn)) void raise_non_utf8_encoding_error(VALUE string, const
     rb_raise(rb_eEncCompatError, "non-UTF8 encoded %s (%"PRIsVALUE") not supported", value_name, rb_obj_encoding(string));
 }
 
+// rb_hash_foreach callback that flattens the hash's entries into the array
+int add_hash_entry_to_array(VALUE key, VALUE value, VALUE array)
+{
+    rb_ary_push(array, key);
+    rb_ary_push(array, value);
+    return ST_CONTINUE;
+}
+
 void Init_liquid_c(void)
 {
     id_evaluate = rb_intern("evaluate");
@@ -60,6 +76,7 @@ void Init_liquid_c(void)
     cLiquidBlockBody = rb_const_get(mLiquid, rb_intern("BlockBody"));
     rb_global_variable(&cLiquidBlockBody);
 
+    init_liquid_simd();
     init_liquid_tokenizer();
     init_liquid_parser();
     init_liquid_raw();
@@ -67,8 +84,15 @@ void Init_liquid_c(void)
     init_liquid_expression();
     init_liquid_variable();
     init_liquid_block();
+    init_liquid_condition();
+    init_liquid_for();
+    init_liquid_assign();
+    init_liquid_counter();
+    init_liquid_partial();
+    init_liquid_template_store();
     init_liquid_context();
     init_liquid_variable_lookup();
     init_liquid_vm();
+    init_liquid_standard_filters();
 }
 
@@ -16,6 +16,7 @@ extern rb_encoding *utf8_encoding;
 extern int utf8_encoding_index;
 
 __attribute__((noreturn)) void raise_non_utf8_encoding_error(VALUE string, const char *string_name);
+int add_hash_entry_to_array(VALUE key, VALUE value, VALUE array);
 
 inline void check_utf8_encoding(VALUE string, const char *string_name)
 {
@@ -28,5 +29,10 @@ inline void check_utf8_encoding(VALUE string, const char *string_name)
 #define RB_LIKELY(x) (__builtin_expect(!!(x), 1))
 #endif
 
+#ifndef HAVE_RB_GC_MARK_MOVABLE
+// objects never move before GC compaction was added in Ruby 2.7
+#define rb_gc_mark_movable(value) rb_gc_mark(value)
+#endif
+
 #endif
 
@@ -0,0 +1,16 @@
+#if !defined(LIQUID_NUMBER_H)
+#define LIQUID_NUMBER_H
+
+// Up to this many decimal digits always fit in an int64_t.
+#define MAX_INT64_DIGITS 18
+// Up to this many decimal digits always fit in the mantissa of a double.
+#define MAX_EXACT_DOUBLE_DIGITS 15
+
+// Every power of ten that is exactly representable as a double.
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define MAX_EXACT_DOUBLE_SCALE 22
+
+#endif
@@ -1,32 +1,93 @@
 #include "liquid.h"
 #include "parser.h"
 #include "lexer.h"
+#include "number.h"
 
 static VALUE empty_string;
 static ID id_to_i, idEvaluate;
 
+static void parser_lex(parser_t *p, lexer_token_t *token)
+{
+    token->type = TOKEN_EOS;
+    p->str = lex_one(p->str, p->str_end, token);
+    if (token->type == TOKEN_NONE)
+        parser_set_error(p, PARSER_ERROR_UNEXPECTED_CHARACTER, *token);
+}
+
 void init_parser(parser_t *p, const char *str, const char *end)
 {
+    p->str = str;
     p->str_end = end;
-    p->cur.type = p->next.type = TOKEN_EOS;
-    p->str = lex_one(str, end, &p->cur);
-    p->str = lex_one(p->str, end, &p->next);
+    p->error.type = PARSER_ERROR_NONE;
+    parser_lex(p, &p->cur);
+    parser_lex(p, &p->next);
+}
+
+// Keeps the first error, which is the one that would have been raised
+// if the parser stopped at the first syntax error
+void parser_set_error(parser_t *p, enum parser_error_type type, lexer_token_t token)
+{
+    if (parser_failed(p))
+        return;
+    p->error.type = type;
+    p->error.token = token;
+}
+
+VALUE parser_error_to_exception(const parser_error_t *error)
+{
+    const lexer_token_t *token = &error->token;
+    VALUE message;
+    switch (error->type) {
+        case PARSER_ERROR_UNEXPECTED_CHARACTER:
+            message = rb_enc_sprintf(utf8_encoding, "Unexpected character %c", *token->val);
+            break;
+        case PARSER_ERROR_EXPECTED_TOKEN:
+            message = rb_enc_sprintf(utf8_encoding, "Expected %s but found %s",
+                    symbol_names[error->expected_token_type], symbol_names[token->type]);
+            break;
+        case PARSER_ERROR_UNEXPECTED_DOT:
+            message = rb_enc_sprintf(utf8_encoding, "Unexpected dot");
+            break;
+        case PARSER_ERROR_INVALID_EXPRESSION:
+            if (token->type == TOKEN_EOS) {
+                message = rb_enc_sprintf(utf8_encoding, "[:%s] is not a valid expression", symbol_names[token->type]);
+            } else {
+                message = rb_enc_sprintf(utf8_encoding, "[:%s, \"%.*s\"] is not a valid expression",
+                        symbol_names[token->type], (int)(token->val_end - token->val), token->val);
+            }
+            break;
+        case PARSER_ERROR_UNEXPECTED_TOKEN:
+            message = rb_enc_sprintf(utf8_encoding, "[:%s] is not a valid expression", symbol_names[token->type]);
+            break;
+        case PARSER_ERROR_TOO_MANY_FILTER_ARGUMENTS:
+            message = rb_enc_sprintf(utf8_encoding, "Too many filter arguments");
+            break;
+        case PARSER_ERROR_TOO_MANY_FILTER_KEYWORD_ARGUMENTS:
+            message = rb_enc_sprintf(utf8_encoding, "Too many filter keyword arguments");
+            break;
+        default:
+            rb_bug("invalid parser error type: %d", error->type);
+    }
+    return rb_exc_new_str(cLiquidSyntaxError, message);
 }
 
 lexer_token_t parser_consume_any(parser_t *p)
 {
     lexer_token_t cur = p->cur;
     p->cur = p->next;
-    p->next.type = TOKEN_EOS;
-    p->str = lex_one(p->str, p->str_end, &p->next);
+    parser_lex(p, &p->next);
     return cur;
 }
 
 lexer_token_t parser_must_consume(parser_t *p, unsigned char type)
 {
     if (p->cur.type != type) {
-        rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "Expected %s but found %s",
-                 symbol_names[type], symbol_names[p->cur.type]);
+        if (!parser_failed(p)) {
+            parser_set_error(p, PARSER_ERROR_EXPECTED_TOKEN, p->cur);
+            p->error.expected_token_type = type;
+        }
+        lexer_token_t zero = {0};
+        return zero;
     }
     return parser_consume_any(p);
 }
@@ -48,23 +109,59 @@ inline static int rstring_eq(VALUE rstr, const char *str) {
            memcmp(RSTRING_PTR(rstr), str, str_len) == 0;
 }
 
+// The lexer guarantees that a number token is an optional '-' followed by
+// digits with at most one '.', which is always followed by a digit.
+static VALUE parse_integer(const char *str, const char *end)
+{
+    const char *cur = str;
+    bool negative = *cur == '-';
+    if (negative) cur++;
+
+    if (end - cur > MAX_INT64_DIGITS) // may need a bignum
+        return rb_str_to_inum(rb_str_new(str, end - str), 10, 1);
+
+    int64_t value = 0;
+    for (; cur < end; cur++)
+        value = value * 10 + (*cur - '0');
+
+    return LL2NUM(negative ? -value : value);
+}
+
+static VALUE parse_float(const char *str, const char *end)
+{
+    const char *cur = str;
+    bool negative = *cur == '-';
+    if (negative) cur++;
+
+    // Both the mantissa and the power of ten are exactly representable, so a
+    // single division gives the correctly rounded result.
+    uint64_t mantissa = 0;
+    int digits = 0, fraction_digits = -1;
+    for (; cur < end; cur++) {
+        if (*cur == '.') {
+            fraction_digits = 0;
+            continue;
+        }
+        mantissa = mantissa * 10 + (*cur - '0');
+        digits++;
+        if (fraction_digits >= 0) fraction_digits++;
+        if (digits > MAX_EXACT_DOUBLE_DIGITS)
+            return DBL2NUM(rb_str_to_dbl(rb_str_new(str, end - str), 1));
+    }
+
+    double value = (double)mantissa / exact_powers_of_ten[fraction_digits];
+    return DBL2NUM(negative ? -value : value);
+}
+
 static VALUE parse_number(parser_t *p)
 {
-    VALUE out;
     lexer_token_t token = parser_must_consume(p, TOKEN_NUMBER);
 
-    // Set up sentinel for rb_cstr operations.
-    char tmp = *token.val_end;
-    *(char *)token.val_end = '\0';
-
     if (token.flags & TOKEN_FLOAT_NUMBER) {
-        out = DBL2NUM(rb_cstr_to_dbl(token.val, 1));
+        return parse_float(token.val, token.val_end);
     } else {
-        out = rb_cstr_to_inum(token.val, 10, 1);
+        return parse_integer(token.val, token.val_end);
     }
-
-    *(char *)token.val_end = tmp;
-    return out;
 }
 
 static VALUE try_parse_constant_range(parser_t *p)
@@ -74,6 +171,8 @@ static VALUE try_parse_constant_range(parser_t *p)
     parser_must_consume(p, TOKEN_OPEN_ROUND);
 
     VALUE begin = try_parse_constant_expression(p);
+    if (parser_failed(p))
+        return Qundef;
     if (begin == Qundef) {
         *p = saved_state;
         return Qundef;
@@ -81,11 +180,15 @@ static VALUE try_parse_constant_range(parser_t *p)
     parser_must_consume(p, TOKEN_DOTDOT);
 
     VALUE end = try_parse_constant_expression(p);
+    if (parser_failed(p))
+        return Qundef;
     if (end == Qundef) {
         *p = saved_state;
         return Qundef;
     }
     parser_must_consume(p, TOKEN_CLOSE_ROUND);
+    if (parser_failed(p))
+        return Qundef;
 
     begin = rb_funcall(begin, id_to_i, 0);
     end = rb_funcall(end, id_to_i, 0);
@@ -97,6 +200,8 @@ static VALUE try_parse_constant_range(parser_t *p)
 static void parse_and_compile_range(parser_t *p, vm_assembler_t *code)
 {
     VALUE const_range = try_parse_constant_range(p);
+    if (parser_failed(p))
+        return;
     if (const_range != Qundef) {
         vm_assembler_add_push_const(code, const_range);
         return;
@@ -104,44 +209,85 @@ static void parse_and_compile_range(parser_t *p, vm_assembler_t *code)
 
     parser_must_consume(p, TOKEN_OPEN_ROUND);
     parse_and_compile_expression(p, code);
+    if (parser_failed(p))
+        return;
     parser_must_consume(p, TOKEN_DOTDOT);
     parse_and_compile_expression(p, code);
+    if (parser_failed(p))
+        return;
     parser_must_consume(p, TOKEN_CLOSE_ROUND);
+    if (parser_failed(p))
+        return;
     vm_assembler_add_new_int_range(code);
 }
 
 static void parse_and_compile_variable_lookup(parser_t *p, vm_assembler_t *code)
 {
+    // Lookups from a static variable name through static keys are compiled as usual,
+    // then fused into a single OP_FIND_PATH instruction once the static path ends.
+    bool static_path = false;
+    size_t path_start = 0, path_lookups = 0;
+
     if (parser_consume(p, TOKEN_OPEN_SQUARE).type) {
         parse_and_compile_expression(p, code);
+        if (parser_failed(p))
+            return;
         parser_must_consume(p, TOKEN_CLOSE_SQUARE);
+        if (parser_failed(p))
+            return;
         vm_assembler_add_find_variable(code);
     } else {
-        VALUE name = token_to_rstr_leveraging_existing_symbol(parser_must_consume(p, TOKEN_IDENTIFIER));
+        lexer_token_t name_token = parser_must_consume(p, TOKEN_IDENTIFIER);
+        if (parser_failed(p))
+            return;
+        VALUE name = token_to_rstr_leveraging_existing_symbol(name_token);
+        static_path = true;
+        path_start = c_buffer_size(&code->instructions);
         vm_assembler_add_find_static_variable(code, name);
     }
 
     while (true) {
         if (p->cur.type == TOKEN_OPEN_SQUARE) {
+            if (static_path) {
+                vm_assembler_fuse_find_path(code, path_start);
+                static_path = false;
+            }
             parser_consume_any(p);
             parse_and_compile_expression(p, code);
+            if (parser_failed(p))
+                return;
             parser_must_consume(p, TOKEN_CLOSE_SQUARE);
+            if (parser_failed(p))
+                return;
             vm_assembler_add_lookup_key(code);
         } else if (p->cur.type == TOKEN_DOT) {
-            int has_space_affix = parser_consume_any(p).flags & TOKEN_SPACE_AFFIX;
-            VALUE key = token_to_rstr_leveraging_existing_symbol(parser_must_consume(p, TOKEN_IDENTIFIER));
+            lexer_token_t dot_token = parser_consume_any(p);
+            lexer_token_t key_token = parser_must_consume(p, TOKEN_IDENTIFIER);
+            if (parser_failed(p))
+                return;
+            VALUE key = token_to_rstr_leveraging_existing_symbol(key_token);
 
-            if (has_space_affix)
-                rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "Unexpected dot");
+            if (dot_token.flags & TOKEN_SPACE_AFFIX) {
+                parser_set_error(p, PARSER_ERROR_UNEXPECTED_DOT, dot_token);
+                return;
+            }
 
             if (rstring_eq(key, "size") || rstring_eq(key, "first") || rstring_eq(key, "last"))
                 vm_assembler_add_lookup_command(code, key);
             else
                 vm_assembler_add_lookup_const_key(code, key);
+
+            if (static_path && ++path_lookups == VM_FIND_PATH_MAX_LOOKUPS) {
+                vm_assembler_fuse_find_path(code, path_start);
+                static_path = false;
+            }
         } else {
             break;
         }
     }
+
+    if (static_path)
+        vm_assembler_fuse_find_path(code, path_start);
 }
 
 static VALUE try_parse_literal(parser_t *p)
@@ -209,6 +355,8 @@ VALUE try_parse_constant_expression(parser_t *p)
 static void parse_and_compile_number(parser_t *p, vm_assembler_t *code)
 {
     VALUE num = parse_number(p);
+    if (parser_failed(p))
+        return;
     if (RB_FIXNUM_P(num))
         vm_assembler_add_push_fixnum(code, num);
     else
@@ -251,12 +399,7 @@ void parse_and_compile_expression(parser_t *p, vm_assembler_t *code)
         }
     }
 
-    if (p->cur.type == TOKEN_EOS) {
-        rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "[:%s] is not a valid expression", symbol_names[p->cur.type]);
-    } else {
-        rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "[:%s, \"%.*s\"] is not a valid expression",
-                 symbol_names[p->cur.type], (int)(p->cur.val_end - p->cur.val), p->cur.val);
-    }
+    parser_set_error(p, PARSER_ERROR_INVALID_EXPRESSION, p->cur);
 }
 
 void init_liquid_parser(void)
@@ -4,17 +4,47 @@
 #include "lexer.h"
 #include "vm_assembler.h"
 
+enum parser_error_type {
+    PARSER_ERROR_NONE = 0,
+    PARSER_ERROR_UNEXPECTED_CHARACTER,
+    PARSER_ERROR_EXPECTED_TOKEN,
+    PARSER_ERROR_UNEXPECTED_DOT,
+    PARSER_ERROR_INVALID_EXPRESSION,
+    PARSER_ERROR_UNEXPECTED_TOKEN,
+    PARSER_ERROR_TOO_MANY_FILTER_ARGUMENTS,
+    PARSER_ERROR_TOO_MANY_FILTER_KEYWORD_ARGUMENTS,
+};
+
+// The first syntax error found by the parser, which is only turned into a
+// Liquid::SyntaxError if it needs to be raised or reported
+typedef struct parser_error {
+    unsigned char type;
+    unsigned char expected_token_type; // for PARSER_ERROR_EXPECTED_TOKEN
+    lexer_token_t token; // where the error was found, which points into the parsed markup
+} parser_error_t;
+
 typedef struct parser {
     lexer_token_t cur, next;
     const char *str, *str_end;
+    parser_error_t error;
 } parser_t;
 
 void init_parser(parser_t *parser, const char *str, const char *end);
 
+void parser_set_error(parser_t *parser, enum parser_error_type type, lexer_token_t token);
+VALUE parser_error_to_exception(const parser_error_t *error);
+
+static inline bool parser_failed(const parser_t *parser)
+{
+    return parser->error.type != PARSER_ERROR_NONE;
+}
+
 lexer_token_t parser_must_consume(parser_t *parser, unsigned char type);
 lexer_token_t parser_consume(parser_t *parser, unsigned char type);
 lexer_token_t parser_consume_any(parser_t *parser);
 
+// These leave the parser's error set instead of raising a syntax error, after which
+// any value or code they returned or added should be discarded
 void parse_and_compile_expression(parser_t *p, vm_assembler_t *code);
 VALUE try_parse_constant_expression(parser_t *p);
 
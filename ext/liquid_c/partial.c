@@ -0,0 +1,239 @@
+#include "liquid.h"
+#include "partial.h"
+#include "expression.h"
+#include "block.h"
+#include "context.h"
+#include "vm.h"
+
+static ID id_ivar_template_name_expr, id_ivar_variable_name_expr, id_ivar_alias_name, id_ivar_attributes,
+    id_ivar_is_for_loop, id_ivar_root, id_ivar_body, id_ivar_resource_limits, id_split, id_registers, id_aref,
+    id_load, id_parse_context, id_new_isolated_subcontext, id_set_template_name, id_set_partial, id_reset,
+    id_render_to_output_buffer, id_handle_error, id_with_disabled_tags;
+
+static VALUE sym_cached_partials, sym_context, sym_parse_context;
+
+static VALUE cLiquidRender, cLiquidDocument, cLiquidPartialCache, render_disabled_tags, path_separator;
+
+static bool compile_render(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    VALUE template_name = rb_attr_get(tag, id_ivar_template_name_expr);
+    VALUE variable = rb_attr_get(tag, id_ivar_variable_name_expr);
+    VALUE alias_name = rb_attr_get(tag, id_ivar_alias_name);
+    VALUE attributes = rb_attr_get(tag, id_ivar_attributes);
+    // rendering the partial for each item of a collection is left to the tag
+    if (!RB_TYPE_P(template_name, T_STRING) || RTEST(rb_attr_get(tag, id_ivar_is_for_loop)))
+        return false;
+    if (!expression_inlinable_p(variable) || !RB_TYPE_P(attributes, T_HASH) || RHASH_SIZE(attributes) > UINT8_MAX)
+        return false;
+
+    // Equivalent to @alias_name || template_name.split('/').last
+    VALUE variable_name = alias_name;
+    if (variable_name == Qnil)
+        variable_name = rb_ary_entry(rb_funcall(template_name, id_split, 1, path_separator), -1);
+    if (!RB_TYPE_P(variable_name, T_STRING))
+        return false;
+
+    VALUE attribute_pairs = rb_ary_new_capa(RHASH_SIZE(attributes) * 2);
+    rb_hash_foreach(attributes, add_hash_entry_to_array, attribute_pairs);
+    VALUE attribute_keys = rb_ary_new_capa(RHASH_SIZE(attributes));
+    for (long i = 0; i < RARRAY_LEN(attribute_pairs); i += 2) {
+        VALUE key = RARRAY_AREF(attribute_pairs, i);
+        if (!RB_TYPE_P(key, T_STRING) || !expression_inlinable_p(RARRAY_AREF(attribute_pairs, i + 1)))
+            return false;
+        rb_ary_push(attribute_keys, rb_str_new_frozen(key));
+    }
+
+    vm_assembler_jump_list_t end_jumps = VM_ASSEMBLER_JUMP_LIST_INIT;
+    vm_assembler_add_render_tag_rescue(code, tag, line_number, blank, &end_jumps);
+    expression_compile_inline(code, variable);
+    for (long i = 1; i < RARRAY_LEN(attribute_pairs); i += 2)
+        expression_compile_inline(code, RARRAY_AREF(attribute_pairs, i));
+    vm_assembler_add_render_partial(code, tag, rb_str_new_frozen(template_name), rb_str_new_frozen(variable_name),
+            attribute_keys);
+    vm_assembler_patch_jumps(code, &end_jumps);
+    vm_assembler_add_render_tag_end(code);
+
+    RB_GC_GUARD(attribute_pairs);
+    return true;
+}
+
+// Compiles a stock Liquid::Render tag with a constant template name, so the VM binds the
+// tag's variable and attributes in the partial's isolated context and renders the partial's
+// compiled body, instead of rendering the tag with Liquid::BlockBody.render_node.
+// Returns false without adding any code if the tag can't be compiled.
+bool partial_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank)
+{
+    if (RBASIC_CLASS(tag) != cLiquidRender)
+        return false;
+    return compile_render(code, tag, line_number, blank);
+}
+
+typedef struct render_partial_args {
+    VALUE context;
+    VALUE output;
+    VALUE tag;
+    VALUE template_name;
+    VALUE variable_name;
+    size_t num_attributes;
+    const VALUE *attribute_keys;
+    const VALUE *values; // the tag's variable followed by the attribute values
+    VALUE inner_context;
+    block_body_t *body;
+} render_partial_args_t;
+
+// Equivalent to Liquid::PartialCache.load, without leaving C for the partials that
+// were already loaded for the render
+static VALUE load_partial(render_partial_args_t *args)
+{
+    VALUE registers = rb_funcall(args->context, id_registers, 0);
+    VALUE cached_partials = RB_TYPE_P(registers, T_HASH) ? rb_hash_aref(registers, sym_cached_partials) :
+        rb_funcall(registers, id_aref, 1, sym_cached_partials);
+    if (RB_TYPE_P(cached_partials, T_HASH)) {
+        VALUE partial = rb_hash_aref(cached_partials, args->template_name);
+        if (RTEST(partial))
+            return partial;
+    }
+
+    VALUE options = rb_hash_new();
+    rb_hash_aset(options, sym_context, args->context);
+    rb_hash_aset(options, sym_parse_context, rb_funcall(args->tag, id_parse_context, 0));
+    VALUE load_args[2] = { args->template_name, options };
+#ifdef RB_PASS_KEYWORDS
+    return rb_funcallv_kw(cLiquidPartialCache, id_load, 2, load_args, RB_PASS_KEYWORDS);
+#else
+    return rb_funcallv(cLiquidPartialCache, id_load, 2, load_args);
+#endif
+}
+
+// Returns the compiled body of a stock Liquid::Template, or NULL if the partial
+// has to be rendered through Ruby
+static block_body_t *partial_body(VALUE partial)
+{
+    if (RB_SPECIAL_CONST_P(partial) || RBASIC_CLASS(partial) != cLiquidTemplate)
+        return NULL;
+    VALUE root = rb_attr_get(partial, id_ivar_root);
+    if (RB_SPECIAL_CONST_P(root) || RBASIC_CLASS(root) != cLiquidDocument)
+        return NULL;
+    return block_body_parsed_struct(rb_attr_get(root, id_ivar_body));
+}
+
+static VALUE render_partial_body(VALUE uncast_args)
+{
+    render_partial_args_t *args = (void *)uncast_args;
+    liquid_vm_render(args->body, args->inner_context, args->output);
+    return Qnil;
+}
+
+static VALUE rescue_partial_memory_error(VALUE uncast_args, VALUE exception)
+{
+    render_partial_args_t *args = (void *)uncast_args;
+    rb_funcall(args->inner_context, id_handle_error, 1, exception);
+    return Qnil;
+}
+
+static VALUE render_partial(VALUE uncast_args)
+{
+    render_partial_args_t *args = (void *)uncast_args;
+    VALUE partial = load_partial(args);
+
+    VALUE inner_context = rb_funcall(args->context, id_new_isolated_subcontext, 0);
+    rb_funcall(inner_context, id_set_template_name, 1, args->template_name);
+    rb_funcall(inner_context, id_set_partial, 1, Qtrue);
+
+    // the subcontext only has the scope that the attributes are bound to
+    for (size_t i = 0; i < args->num_attributes; i++)
+        context_set_last_scope_variable(inner_context, args->attribute_keys[i], args->values[i + 1]);
+    if (args->values[0] != Qnil)
+        context_set_last_scope_variable(inner_context, args->variable_name, args->values[0]);
+
+    args->body = partial_body(partial);
+    if (!args->body) {
+        rb_funcall(partial, id_render_to_output_buffer, 2, inner_context, args->output);
+        return Qnil;
+    }
+
+    // like Liquid::Template#render, which resets the shared resource limits and
+    // handles running out of them inside of the partial
+    rb_funcall(rb_ivar_get(inner_context, id_ivar_resource_limits), id_reset, 0);
+    args->inner_context = inner_context;
+    rb_rescue2(render_partial_body, uncast_args, rescue_partial_memory_error, uncast_args, cMemoryError, (VALUE)0);
+
+    RB_GC_GUARD(partial);
+    RB_GC_GUARD(inner_context);
+    return Qnil;
+}
+
+static VALUE render_partial_with_disabled_tags(RB_BLOCK_CALL_FUNC_ARGLIST(yielded_arg, callback_arg))
+{
+    return render_partial(callback_arg);
+}
+
+// Equivalent to Liquid::Render#render_tag without a for loop, for the values of the tag's
+// variable followed by its attributes, which are bound to the partial's context without
+// building a hash of them
+void partial_render(VALUE context, VALUE output, VALUE tag, VALUE template_name, VALUE variable_name,
+        size_t num_attributes, const VALUE *attribute_keys, const VALUE *values)
+{
+    render_partial_args_t args = {
+        .context = context,
+        .output = output,
+        .tag = tag,
+        .template_name = template_name,
+        .variable_name = variable_name,
+        .num_attributes = num_attributes,
+        .attribute_keys = attribute_keys,
+        .values = values,
+        .inner_context = Qnil,
+        .body = NULL,
+    };
+    if (RARRAY_LEN(render_disabled_tags) > 0) {
+        rb_block_call(context, id_with_disabled_tags, 1, &render_disabled_tags, render_partial_with_disabled_tags, (VALUE)&args);
+    } else {
+        render_partial((VALUE)&args);
+    }
+}
+
+void init_liquid_partial()
+{
+    id_ivar_template_name_expr = rb_intern("@template_name_expr");
+    id_ivar_variable_name_expr = rb_intern("@variable_name_expr");
+    id_ivar_alias_name = rb_intern("@alias_name");
+    id_ivar_attributes = rb_intern("@attributes");
+    id_ivar_is_for_loop = rb_intern("@is_for_loop");
+    id_ivar_root = rb_intern("@root");
+    id_ivar_body = rb_intern("@body");
+    id_ivar_resource_limits = rb_intern("@resource_limits");
+    id_split = rb_intern("split");
+    id_registers = rb_intern("registers");
+    id_aref = rb_intern("[]");
+    id_load = rb_intern("load");
+    id_parse_context = rb_intern("parse_context");
+    id_new_isolated_subcontext = rb_intern("new_isolated_subcontext");
+    id_set_template_name = rb_intern("template_name=");
+    id_set_partial = rb_intern("partial=");
+    id_reset = rb_intern("reset");
+    id_render_to_output_buffer = rb_intern("render_to_output_buffer");
+    id_handle_error = rb_intern("handle_error");
+    id_with_disabled_tags = rb_intern("with_disabled_tags");
+
+    sym_cached_partials = ID2SYM(rb_intern("cached_partials"));
+    sym_context = ID2SYM(rb_intern("context"));
+    sym_parse_context = ID2SYM(rb_intern("parse_context"));
+
+    cLiquidRender = rb_const_get(mLiquid, rb_intern("Render"));
+    rb_global_variable(&cLiquidRender);
+
+    cLiquidDocument = rb_const_get(mLiquid, rb_intern("Document"));
+    rb_global_variable(&cLiquidDocument);
+
+    cLiquidPartialCache = rb_const_get(mLiquid, rb_intern("PartialCache"));
+    rb_global_variable(&cLiquidPartialCache);
+
+    // the tags that Liquid::Render disables while rendering, like include
+    render_disabled_tags = rb_funcall(cLiquidRender, rb_intern("disabled_tags"), 0);
+    Check_Type(render_disabled_tags, T_ARRAY);
+    rb_global_variable(&render_disabled_tags);
+
+    path_separator = rb_obj_freeze(rb_str_new_literal("/"));
+    rb_global_variable(&path_separator);
+}
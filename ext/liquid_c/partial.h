@@ -0,0 +1,11 @@
+#if !defined(LIQUID_PARTIAL_H)
+#define LIQUID_PARTIAL_H
+
+#include "vm_assembler.h"
+
+void init_liquid_partial();
+bool partial_compile_tag(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank);
+void partial_render(VALUE context, VALUE output, VALUE tag, VALUE template_name, VALUE variable_name,
+        size_t num_attributes, const VALUE *attribute_keys, const VALUE *values);
+
+#endif
@@ -51,44 +51,54 @@ static bool match_full_token_possibly_invalid(token_t *token, struct full_token_
     return false;
 }
 
-static VALUE raw_parse_method(VALUE self, VALUE tokens)
+// Advances the tokenizer past the token that ends a raw body with the block delimiter,
+// like Liquid::Raw#parse. Only the tokens that contain the delimiter can end the body, so
+// they are found with a forward search through the source instead of matching every token.
+// Returns the end of the body, which starts at the tokenizer's cursor, or NULL if the tag
+// is never closed.
+const char *raw_skip_body(tokenizer_t *tokenizer, const char *block_delimiter, long block_delimiter_len)
 {
-    tokenizer_t *tokenizer;
-    Tokenizer_Get_Struct(tokens, tokenizer);
-
     token_t token;
     struct full_token_possibly_invalid_t match;
-
-    VALUE block_delimiter = rb_funcall(self, id_block_delimiter, 0);
-    Check_Type(block_delimiter, T_STRING);
-    char *block_delimiter_str = RSTRING_PTR(block_delimiter);
-    long block_delimiter_len = RSTRING_LEN(block_delimiter);
-
-    const char *body = NULL;
-    long body_len = 0;
+    const char *search_start = tokenizer->cursor;
 
     while (true) {
-        tokenizer_next(tokenizer, &token);
+        const char *found = find_substring(search_start, tokenizer->cursor_end, block_delimiter, block_delimiter_len);
+        if (!found)
+            return NULL;
 
-        if (!token.type) break;
-
-        if (body == NULL) {
-            body = token.str_full;
-        }
+        do {
+            tokenizer_next(tokenizer, &token);
+            if (!token.type)
+                return NULL;
+        } while (token.str_full + token.len_full <= found);
 
         if (match_full_token_possibly_invalid(&token, &match)
                 && match.delimiter_len == block_delimiter_len
-                && memcmp(match.delimiter_start, block_delimiter_str, block_delimiter_len) == 0) {
-            body_len += match.body_len;
-            VALUE body_str = rb_enc_str_new(body, body_len, utf8_encoding);
-            rb_ivar_set(self, id_ivar_body, body_str);
-            return Qnil;
+                && memcmp(match.delimiter_start, block_delimiter, block_delimiter_len) == 0) {
+            return token.str_full + match.body_len;
         }
+        search_start = token.str_full + token.len_full;
+    }
+}
+
+static VALUE raw_parse_method(VALUE self, VALUE tokens)
+{
+    tokenizer_t *tokenizer;
+    Tokenizer_Get_Struct(tokens, tokenizer);
+
+    VALUE block_delimiter = rb_funcall(self, id_block_delimiter, 0);
+    Check_Type(block_delimiter, T_STRING);
 
-        body_len += token.len_full;
+    const char *body = tokenizer->cursor;
+    const char *body_end = raw_skip_body(tokenizer, RSTRING_PTR(block_delimiter), RSTRING_LEN(block_delimiter));
+    if (!body_end) {
+        rb_funcall(self, id_raise_tag_never_closed, 1, rb_funcall(self, id_block_name, 0));
+        return Qnil;
     }
 
-    rb_funcall(self, id_raise_tag_never_closed, 1, rb_funcall(self, id_block_name, 0));
+    VALUE body_str = rb_enc_str_new(body, body_end - body, utf8_encoding);
+    rb_ivar_set(self, id_ivar_body, body_str);
     return Qnil;
 }
 
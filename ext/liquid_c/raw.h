@@ -1,6 +1,9 @@
 #ifndef LIQUID_RAW_H
 #define LIQUID_RAW_H
 
+#include "tokenizer.h"
+
 void init_liquid_raw();
+const char *raw_skip_body(tokenizer_t *tokenizer, const char *block_delimiter, long block_delimiter_len);
 
 #endif
@@ -19,5 +19,6 @@ void init_liquid_resource_limits();
 void resource_limits_raise_limits_reached(resource_limits_t *resource_limit);
 void resource_limits_increment_render_score(resource_limits_t *resource_limits, long amount);
 void resource_limits_increment_write_score(resource_limits_t *resource_limits, VALUE output);
+void resource_limits_increment_assign_score(resource_limits_t *resource_limits, long amount);
 
 #endif
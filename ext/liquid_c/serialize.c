@@ -0,0 +1,827 @@
+#include "liquid.h"
+#include "serialize.h"
+#include "expression.h"
+#include "vm.h"
+
+// Bump whenever the instructions or the encoding of their constants change, so that
+// dumps from another version of liquid-c get rejected instead of misinterpreted.
+#define SERIALIZE_FORMAT_VERSION 1
+
+static const char serialize_magic[4] = { 'L', 'Q', 'C', 'B' };
+
+// Identifies the byte order, since sizes are dumped in the native byte order
+#define SERIALIZE_BYTE_ORDER_MARK 0x01020304
+
+enum serialized_value_type {
+    SERIALIZED_NIL,
+    SERIALIZED_TRUE,
+    SERIALIZED_FALSE,
+    SERIALIZED_FIXNUM,
+    SERIALIZED_BIGNUM, // as a hexadecimal string
+    SERIALIZED_FLOAT,
+    SERIALIZED_STRING,
+    SERIALIZED_SYMBOL,
+    SERIALIZED_RANGE,
+    SERIALIZED_ARRAY,
+    SERIALIZED_HASH,
+    SERIALIZED_EXPRESSION,
+    SERIALIZED_OBJECT, // the string that the dump block returned for the object
+};
+
+typedef struct serializer {
+    VALUE output;
+    const char *source_start;
+    size_t source_size;
+} serializer_t;
+
+typedef struct deserializer {
+    const uint8_t *cursor;
+    const uint8_t *end;
+    const char *source_start;
+    size_t source_size;
+    VALUE loaded_values; // keeps the loaded values alive until the code that references them is complete
+} deserializer_t;
+
+static void write_bytes(serializer_t *s, const void *data, size_t size)
+{
+    rb_str_buf_cat(s->output, data, size);
+}
+
+static void write_byte(serializer_t *s, uint8_t byte)
+{
+    write_bytes(s, &byte, 1);
+}
+
+static void write_size(serializer_t *s, size_t size)
+{
+    write_bytes(s, &size, sizeof(size));
+}
+
+static void write_string_bytes(serializer_t *s, VALUE string)
+{
+    write_size(s, RSTRING_LEN(string));
+    write_bytes(s, RSTRING_PTR(string), RSTRING_LEN(string));
+}
+
+static void write_encoded_string(serializer_t *s, VALUE string)
+{
+    const char *encoding_name = rb_enc_name(rb_enc_get(string));
+    size_t encoding_name_size = strlen(encoding_name);
+    write_size(s, encoding_name_size);
+    write_bytes(s, encoding_name, encoding_name_size);
+    write_string_bytes(s, string);
+}
+
+static void write_code(serializer_t *s, const vm_assembler_t *code);
+
+static void write_value(serializer_t *s, VALUE value)
+{
+    switch (value) {
+        case Qnil:
+            write_byte(s, SERIALIZED_NIL);
+            return;
+        case Qtrue:
+            write_byte(s, SERIALIZED_TRUE);
+            return;
+        case Qfalse:
+            write_byte(s, SERIALIZED_FALSE);
+            return;
+    }
+
+    if (RB_FIXNUM_P(value)) {
+        int64_t num = FIX2LONG(value);
+        write_byte(s, SERIALIZED_FIXNUM);
+        write_bytes(s, &num, sizeof(num));
+    } else if (RB_FLOAT_TYPE_P(value)) {
+        double num = RFLOAT_VALUE(value);
+        write_byte(s, SERIALIZED_FLOAT);
+        write_bytes(s, &num, sizeof(num));
+    } else if (RB_SYMBOL_P(value)) {
+        write_byte(s, SERIALIZED_SYMBOL);
+        write_encoded_string(s, rb_sym2str(value));
+    } else if (RB_TYPE_P(value, T_BIGNUM)) {
+        write_byte(s, SERIALIZED_BIGNUM);
+        write_string_bytes(s, rb_big2str(value, 16));
+    } else if (RBASIC_CLASS(value) == rb_cString) {
+        write_byte(s, SERIALIZED_STRING);
+        write_byte(s, OBJ_FROZEN(value));
+        write_encoded_string(s, value);
+    } else if (RBASIC_CLASS(value) == rb_cRange) {
+        VALUE range_begin, range_end;
+        int exclude_end;
+        rb_range_values(value, &range_begin, &range_end, &exclude_end);
+        write_byte(s, SERIALIZED_RANGE);
+        write_byte(s, exclude_end);
+        write_value(s, range_begin);
+        write_value(s, range_end);
+    } else if (RBASIC_CLASS(value) == rb_cArray) {
+        write_byte(s, SERIALIZED_ARRAY);
+        write_byte(s, OBJ_FROZEN(value));
+        write_size(s, RARRAY_LEN(value));
+        for (long i = 0; i < RARRAY_LEN(value); i++)
+            write_value(s, RARRAY_AREF(value, i));
+    } else if (RBASIC_CLASS(value) == rb_cHash) {
+        VALUE pairs = rb_ary_new_capa(RHASH_SIZE(value) * 2);
+        rb_hash_foreach(value, add_hash_entry_to_array, pairs);
+        write_byte(s, SERIALIZED_HASH);
+        write_byte(s, OBJ_FROZEN(value));
+        write_size(s, RARRAY_LEN(pairs) / 2);
+        for (long i = 0; i < RARRAY_LEN(pairs); i++)
+            write_value(s, RARRAY_AREF(pairs, i));
+        RB_GC_GUARD(pairs);
+    } else if (rb_typeddata_is_kind_of(value, &expression_data_type)) {
+        expression_t *expression;
+        Expression_Get_Struct(value, expression);
+        write_byte(s, SERIALIZED_EXPRESSION);
+        write_code(s, &expression->code);
+    } else {
+        // like the tags that are rendered with Liquid::BlockBody.render_node, which need to
+        // be re-created by the block given to Liquid::C::BlockBody.load
+        if (!rb_block_given_p())
+            rb_raise(rb_eArgError, "a block is needed to dump %"PRIsVALUE" objects", rb_obj_class(value));
+        VALUE dumped = rb_yield(value);
+        StringValue(dumped);
+        write_byte(s, SERIALIZED_OBJECT);
+        write_string_bytes(s, dumped);
+        RB_GC_GUARD(dumped);
+    }
+}
+
+static void write_values(serializer_t *s, const size_t **const_ptr_ptr, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        write_value(s, (VALUE)*(*const_ptr_ptr)++);
+}
+
+static void write_sizes(serializer_t *s, const size_t **const_ptr_ptr, size_t count)
+{
+    write_bytes(s, *const_ptr_ptr, count * sizeof(size_t));
+    *const_ptr_ptr += count;
+}
+
+// The instructions are dumped as is, since jumps are relative to them, followed by the
+// constants of each instruction in turn, with the text of raw writes as offsets in the source.
+static void write_code(serializer_t *s, const vm_assembler_t *code)
+{
+    write_size(s, code->max_stack_size);
+    write_size(s, c_buffer_size(&code->instructions));
+    write_bytes(s, code->instructions.data, c_buffer_size(&code->instructions));
+
+    const size_t *const_ptr = (const size_t *)code->constants.data;
+    const uint8_t *ip = code->instructions.data;
+    const uint8_t *end_ip = code->instructions.data_end;
+    while (ip < end_ip) {
+        switch (*ip++) {
+            case OP_LEAVE:
+            case OP_POP_WRITE_VARIABLE:
+            case OP_PUSH_NIL:
+            case OP_PUSH_TRUE:
+            case OP_PUSH_FALSE:
+            case OP_FIND_VAR:
+            case OP_LOOKUP_KEY:
+            case OP_NEW_INT_RANGE:
+            case OP_RENDER_TAG_END:
+            case OP_FOR_END:
+            case OP_CAPTURE_END:
+                break;
+
+            case OP_HASH_NEW:
+            case OP_PUSH_INT8:
+            case OP_COMPARE:
+                ip++;
+                break;
+
+            case OP_JUMP:
+            case OP_JUMP_IF:
+            case OP_JUMP_UNLESS:
+                write_sizes(s, &const_ptr, JUMP_NUM_CONSTANTS);
+                break;
+
+            case OP_RENDER_TAG_BODY:
+                write_sizes(s, &const_ptr, 1);
+                break;
+
+            case OP_FOR_INIT:
+                ip++;
+                write_values(s, &const_ptr, 2);
+                write_sizes(s, &const_ptr, JUMP_NUM_CONSTANTS);
+                break;
+
+            case OP_FOR_NEXT:
+                write_sizes(s, &const_ptr, 1 + JUMP_NUM_CONSTANTS);
+                break;
+
+            case OP_CASE_JUMP:
+            {
+                write_values(s, &const_ptr, 1);
+                size_t num_whens = *const_ptr;
+                write_sizes(s, &const_ptr, 1 + (num_whens + 1) * JUMP_NUM_CONSTANTS);
+                break;
+            }
+
+            case OP_RENDER_TAG_RESCUE:
+                ip += 4;
+                write_values(s, &const_ptr, 1);
+                write_sizes(s, &const_ptr, JUMP_NUM_CONSTANTS);
+                break;
+
+            case OP_RENDER_PARTIAL:
+                write_values(s, &const_ptr, RENDER_PARTIAL_NUM_CONSTANTS + *ip++);
+                break;
+
+            case OP_PUSH_INT16:
+                ip += 2;
+                break;
+
+            case OP_RENDER_VARIABLE_RESCUE:
+                ip += 3;
+                break;
+
+            case OP_WRITE_RAW:
+            {
+                const char *text = (const char *)*const_ptr++;
+                size_t size = *const_ptr++;
+                assert(text >= s->source_start && text + size <= s->source_start + s->source_size);
+                write_size(s, text - s->source_start);
+                write_size(s, size);
+                break;
+            }
+
+            case OP_WRITE_NODE:
+            case OP_PUSH_CONST:
+            case OP_FIND_STATIC_VAR:
+            case OP_LOOKUP_CONST_KEY:
+            case OP_LOOKUP_COMMAND:
+            case OP_EVAL_CONDITION:
+            case OP_BREAK:
+            case OP_CONTINUE:
+            case OP_ASSIGN:
+            case OP_CAPTURE_BEGIN:
+            case OP_INCREMENT:
+            case OP_DECREMENT:
+            case OP_CYCLE:
+                write_values(s, &const_ptr, 1);
+                break;
+
+            case OP_FILTER:
+                ip++;
+                write_values(s, &const_ptr, 1);
+                const_ptr += FILTER_CACHE_NUM_CONSTANTS; // the inline cache starts out empty when loaded
+                break;
+
+            case OP_FIND_PATH:
+            {
+                size_t num_lookups = *ip++;
+                ip += num_lookups;
+                write_values(s, &const_ptr, 1 + num_lookups);
+                break;
+            }
+
+            default:
+                rb_bug("invalid opcode: %u", ip[-1]);
+        }
+    }
+}
+
+VALUE serialize_block_body(const block_body_t *body)
+{
+    serializer_t s = { .output = rb_str_buf_new(0), .source_start = NULL, .source_size = 0 };
+    if (body->source != Qnil) {
+        s.source_start = RSTRING_PTR(body->source);
+        s.source_size = RSTRING_LEN(body->source);
+    }
+
+    write_bytes(&s, serialize_magic, sizeof(serialize_magic));
+    uint32_t header[2] = { SERIALIZE_FORMAT_VERSION, SERIALIZE_BYTE_ORDER_MARK };
+    write_bytes(&s, header, sizeof(header));
+    write_byte(&s, sizeof(size_t));
+
+    write_size(&s, s.source_size);
+    write_byte(&s, body->blank);
+    write_size(&s, body->render_score);
+    write_code(&s, &body->code);
+
+    return s.output;
+}
+
+__attribute__((noreturn)) static void raise_invalid_dump(void)
+{
+    rb_raise(rb_eArgError, "invalid Liquid::C::BlockBody dump");
+}
+
+static const uint8_t *read_bytes(deserializer_t *d, size_t size)
+{
+    if ((size_t)(d->end - d->cursor) < size)
+        raise_invalid_dump();
+    const uint8_t *bytes = d->cursor;
+    d->cursor += size;
+    return bytes;
+}
+
+static uint8_t read_byte(deserializer_t *d)
+{
+    return *read_bytes(d, 1);
+}
+
+static size_t read_size(deserializer_t *d)
+{
+    size_t size;
+    memcpy(&size, read_bytes(d, sizeof(size)), sizeof(size));
+    return size;
+}
+
+static VALUE read_string_bytes(deserializer_t *d, rb_encoding *encoding)
+{
+    size_t size = read_size(d);
+    return rb_enc_str_new((const char *)read_bytes(d, size), size, encoding);
+}
+
+static VALUE read_encoded_string(deserializer_t *d)
+{
+    size_t encoding_name_size = read_size(d);
+    const char *encoding_name = (const char *)read_bytes(d, encoding_name_size);
+    VALUE name = rb_str_new(encoding_name, encoding_name_size);
+    int encoding_index = rb_enc_find_index(StringValueCStr(name));
+    if (encoding_index < 0)
+        raise_invalid_dump();
+    return read_string_bytes(d, rb_enc_from_index(encoding_index));
+}
+
+static void read_code(deserializer_t *d, vm_assembler_t *code, bool map_instructions);
+
+static VALUE read_value(deserializer_t *d)
+{
+    VALUE value;
+    switch (read_byte(d)) {
+        case SERIALIZED_NIL:
+            return Qnil;
+        case SERIALIZED_TRUE:
+            return Qtrue;
+        case SERIALIZED_FALSE:
+            return Qfalse;
+        case SERIALIZED_FIXNUM:
+        {
+            int64_t num;
+            memcpy(&num, read_bytes(d, sizeof(num)), sizeof(num));
+            return LONG2FIX(num);
+        }
+        case SERIALIZED_FLOAT:
+        {
+            double num;
+            memcpy(&num, read_bytes(d, sizeof(num)), sizeof(num));
+            value = DBL2NUM(num);
+            break;
+        }
+        case SERIALIZED_SYMBOL:
+            return rb_str_intern(read_encoded_string(d));
+        case SERIALIZED_BIGNUM:
+            value = rb_str_to_inum(read_string_bytes(d, rb_usascii_encoding()), 16, true);
+            break;
+        case SERIALIZED_STRING:
+        {
+            bool frozen = read_byte(d);
+            value = read_encoded_string(d);
+            if (frozen)
+                rb_obj_freeze(value);
+            break;
+        }
+        case SERIALIZED_RANGE:
+        {
+            int exclude_end = read_byte(d);
+            VALUE range_begin = read_value(d);
+            VALUE range_end = read_value(d);
+            value = rb_range_new(range_begin, range_end, exclude_end);
+            break;
+        }
+        case SERIALIZED_ARRAY:
+        {
+            bool frozen = read_byte(d);
+            size_t size = read_size(d);
+            value = rb_ary_new();
+            rb_ary_push(d->loaded_values, value);
+            for (size_t i = 0; i < size; i++)
+                rb_ary_push(value, read_value(d));
+            if (frozen)
+                rb_ary_freeze(value);
+            return value;
+        }
+        case SERIALIZED_HASH:
+        {
+            bool frozen = read_byte(d);
+            size_t size = read_size(d);
+            value = rb_hash_new();
+            rb_ary_push(d->loaded_values, value);
+            for (size_t i = 0; i < size; i++) {
+                VALUE key = read_value(d);
+                rb_hash_aset(value, key, read_value(d));
+            }
+            if (frozen)
+                rb_obj_freeze(value);
+            return value;
+        }
+        case SERIALIZED_EXPRESSION:
+        {
+            expression_t *expression;
+            value = expression_new(&expression);
+            rb_ary_push(d->loaded_values, value);
+            read_code(d, &expression->code, false);
+            return value;
+        }
+        case SERIALIZED_OBJECT:
+        {
+            if (!rb_block_given_p())
+                rb_raise(rb_eArgError, "a block is needed to load the objects of the dump");
+            value = rb_yield(read_string_bytes(d, rb_ascii8bit_encoding()));
+            break;
+        }
+        default:
+            raise_invalid_dump();
+    }
+    rb_ary_push(d->loaded_values, value);
+    return value;
+}
+
+static void read_values(deserializer_t *d, vm_assembler_t *code, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        vm_assembler_write_ruby_constant(code, read_value(d));
+}
+
+static void read_sizes(deserializer_t *d, c_buffer_t *constants, size_t count)
+{
+    c_buffer_write(constants, (void *)read_bytes(d, count * sizeof(size_t)), count * sizeof(size_t));
+}
+
+static const uint8_t *read_operands(const uint8_t *ip, const uint8_t *end_ip, size_t count)
+{
+    if ((size_t)(end_ip - ip) < count)
+        raise_invalid_dump();
+    return ip + count;
+}
+
+// Where the instruction at an offset of the loaded instructions starts in the constants and
+// how many values are on the stack when it runs
+typedef struct loaded_instruction {
+    size_t constants_offset; // in constants, or SIZE_MAX if no instruction starts at the offset
+    size_t stack_size; // or SIZE_MAX if the instruction isn't reached
+} loaded_instruction_t;
+
+typedef struct code_verifier {
+    loaded_instruction_t *loaded;
+    size_t *pending; // offsets of the reached instructions that are left to check
+    size_t num_pending;
+    size_t max_stack_size;
+} code_verifier_t;
+
+static void reach_instruction(code_verifier_t *v, size_t offset, size_t stack_size)
+{
+    loaded_instruction_t *instruction = &v->loaded[offset];
+    if (instruction->stack_size == SIZE_MAX) {
+        instruction->stack_size = stack_size;
+        v->pending[v->num_pending++] = offset;
+        if (stack_size > v->max_stack_size)
+            v->max_stack_size = stack_size;
+    } else if (instruction->stack_size != stack_size) {
+        raise_invalid_dump();
+    }
+}
+
+// The VM trusts the jumps and the max_stack_size of the code it renders, so these are checked
+// for the loaded code: each jump must land on an instruction along with its constants, and the
+// reachable instructions must be found with the same number of values on the stack however
+// they are reached. Returns the most values that they keep on the stack.
+static size_t verify_code(const vm_assembler_t *code, const uint8_t *instructions, size_t instructions_size,
+        loaded_instruction_t *loaded)
+{
+    const size_t *start_const_ptr = (const size_t *)code->constants.data;
+    const uint8_t *end_ip = instructions + instructions_size;
+    // the last instruction must be the OP_LEAVE, rather than end with an operand of that value
+    if (loaded[instructions_size - 1].constants_offset == SIZE_MAX)
+        raise_invalid_dump();
+
+    const uint8_t *ip = instructions;
+    const size_t *const_ptr = start_const_ptr;
+    while (ip < end_ip) {
+        const size_t *targets;
+        size_t num_targets = vm_assembler_jump_targets(ip, const_ptr, &targets);
+        liquid_vm_next_instruction(&ip, &const_ptr);
+        for (size_t i = 0; i < num_targets; i++) {
+            const size_t *target = targets + i * JUMP_NUM_CONSTANTS;
+            size_t target_offset = (ip - instructions) + target[0];
+            size_t target_constants_offset = (target - start_const_ptr) + JUMP_NUM_CONSTANTS + target[1];
+            if (target_offset >= instructions_size || loaded[target_offset].constants_offset != target_constants_offset)
+                raise_invalid_dump();
+        }
+    }
+
+    VALUE pending_buffer;
+    code_verifier_t v = {
+        .loaded = loaded,
+        .pending = ALLOCV_N(size_t, pending_buffer, instructions_size),
+        .num_pending = 0,
+        .max_stack_size = 0,
+    };
+    reach_instruction(&v, 0, 0);
+    while (v.num_pending) {
+        size_t offset = v.pending[--v.num_pending];
+        size_t stack_size = loaded[offset].stack_size;
+        ip = instructions + offset;
+        const_ptr = start_const_ptr + loaded[offset].constants_offset;
+
+        // the stack values an instruction uses the way the VM runs it, where some first push
+        // one of their constants
+        size_t pushed_constants = 0, pops = 0, pushes = 0;
+        switch (*ip) {
+            case OP_PUSH_CONST:
+            case OP_PUSH_NIL:
+            case OP_PUSH_TRUE:
+            case OP_PUSH_FALSE:
+            case OP_PUSH_INT8:
+            case OP_PUSH_INT16:
+            case OP_FIND_PATH:
+            case OP_EVAL_CONDITION:
+            case OP_CAPTURE_BEGIN:
+                pushes = 1;
+                break;
+            case OP_FIND_STATIC_VAR:
+                pushed_constants = 1;
+                /* fallthrough */
+            case OP_FIND_VAR:
+                pops = 1;
+                pushes = 1;
+                break;
+            case OP_LOOKUP_CONST_KEY:
+            case OP_LOOKUP_COMMAND:
+                pushed_constants = 1;
+                /* fallthrough */
+            case OP_LOOKUP_KEY:
+            case OP_NEW_INT_RANGE:
+            case OP_COMPARE:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_HASH_NEW:
+                pops = 2 * (size_t)ip[1];
+                pushes = 1;
+                break;
+            case OP_FILTER:
+                pops = ip[1];
+                pushes = 1;
+                break;
+            case OP_POP_WRITE_VARIABLE:
+            case OP_JUMP_IF:
+            case OP_JUMP_UNLESS:
+            case OP_ASSIGN:
+            case OP_CAPTURE_END:
+            case OP_CYCLE:
+                pops = 1;
+                break;
+            case OP_CASE_JUMP:
+                pops = 2;
+                break;
+            case OP_FOR_INIT:
+                pops = (ip[1] & FOR_LOOP_INT_RANGE) ? 4 : 3;
+                pushes = FOR_LOOP_NUM_STACK_VALUES;
+                break;
+            case OP_FOR_END:
+                pops = FOR_LOOP_NUM_STACK_VALUES;
+                break;
+            case OP_RENDER_PARTIAL:
+                pops = 1 + (size_t)ip[1];
+                break;
+        }
+        stack_size += pushed_constants;
+        if (stack_size > v.max_stack_size)
+            v.max_stack_size = stack_size;
+        if (stack_size < pops)
+            raise_invalid_dump();
+        stack_size -= pops;
+
+        const size_t *targets;
+        size_t num_targets = vm_assembler_jump_targets(ip, const_ptr, &targets);
+        const uint8_t *next_ip = ip;
+        liquid_vm_next_instruction(&next_ip, &const_ptr);
+        size_t next_offset = next_ip - instructions;
+        // the jumps are taken before pushing anything, like when a loop is empty
+        for (size_t i = 0; i < num_targets; i++)
+            reach_instruction(&v, next_offset + targets[i * JUMP_NUM_CONSTANTS], stack_size);
+
+        if (*ip == OP_RENDER_VARIABLE_RESCUE) {
+            // a rescued variable resumes after the next OP_POP_WRITE_VARIABLE, which
+            // vm_render_rescue finds by decoding the instructions up to it
+            const uint8_t *resume_ip = next_ip;
+            const size_t *resume_const_ptr = const_ptr;
+            enum opcode op;
+            do {
+                op = *resume_ip;
+                if (op == OP_LEAVE || op == OP_RENDER_VARIABLE_RESCUE)
+                    raise_invalid_dump();
+                liquid_vm_next_instruction(&resume_ip, &resume_const_ptr);
+            } while (op != OP_POP_WRITE_VARIABLE);
+            reach_instruction(&v, resume_ip - instructions, stack_size);
+        }
+        if (*ip != OP_LEAVE && *ip != OP_JUMP)
+            reach_instruction(&v, next_offset, stack_size + pushes);
+    }
+    ALLOCV_END(pending_buffer);
+
+    return v.max_stack_size;
+}
+
+// Loads the code into the empty code. Its values are marked, and updated by compaction, as
+// soon as they are loaded, since loading them can run ruby code.
+static void read_code(deserializer_t *d, vm_assembler_t *code, bool map_instructions)
+{
+    code->max_stack_size = read_size(d);
+    size_t instructions_size = read_size(d);
+    const uint8_t *instructions = read_bytes(d, instructions_size);
+    if (instructions_size == 0 || instructions[instructions_size - 1] != OP_LEAVE)
+        raise_invalid_dump();
+
+    VALUE loaded_buffer;
+    loaded_instruction_t *loaded = ALLOCV_N(loaded_instruction_t, loaded_buffer, instructions_size);
+    for (size_t i = 0; i < instructions_size; i++)
+        loaded[i] = (loaded_instruction_t) { SIZE_MAX, SIZE_MAX };
+
+    c_buffer_t *constants = &code->constants;
+    const uint8_t *ip = instructions;
+    const uint8_t *end_ip = instructions + instructions_size;
+    while (ip < end_ip) {
+        loaded[ip - instructions].constants_offset = c_buffer_size(constants) / sizeof(size_t);
+        switch (*ip++) {
+            case OP_LEAVE:
+            case OP_POP_WRITE_VARIABLE:
+            case OP_PUSH_NIL:
+            case OP_PUSH_TRUE:
+            case OP_PUSH_FALSE:
+            case OP_FIND_VAR:
+            case OP_LOOKUP_KEY:
+            case OP_NEW_INT_RANGE:
+            case OP_RENDER_TAG_END:
+            case OP_FOR_END:
+            case OP_CAPTURE_END:
+                break;
+
+            case OP_HASH_NEW:
+            case OP_PUSH_INT8:
+            case OP_COMPARE:
+                ip = read_operands(ip, end_ip, 1);
+                break;
+
+            case OP_JUMP:
+            case OP_JUMP_IF:
+            case OP_JUMP_UNLESS:
+                read_sizes(d, constants, JUMP_NUM_CONSTANTS);
+                break;
+
+            case OP_RENDER_TAG_BODY:
+                read_sizes(d, constants, 1);
+                break;
+
+            case OP_FOR_INIT:
+                ip = read_operands(ip, end_ip, 1);
+                read_values(d, code, 2);
+                read_sizes(d, constants, JUMP_NUM_CONSTANTS);
+                break;
+
+            case OP_FOR_NEXT:
+                read_sizes(d, constants, 1 + JUMP_NUM_CONSTANTS);
+                break;
+
+            case OP_CASE_JUMP:
+            {
+                read_values(d, code, 1);
+                size_t num_whens = read_size(d);
+                c_buffer_write(constants, &num_whens, sizeof(size_t));
+                if (num_whens > (size_t)(d->end - d->cursor) / (JUMP_NUM_CONSTANTS * sizeof(size_t)))
+                    raise_invalid_dump();
+                read_sizes(d, constants, (num_whens + 1) * JUMP_NUM_CONSTANTS);
+                break;
+            }
+
+            case OP_RENDER_TAG_RESCUE:
+                ip = read_operands(ip, end_ip, 4);
+                read_values(d, code, 1);
+                read_sizes(d, constants, JUMP_NUM_CONSTANTS);
+                break;
+
+            case OP_RENDER_PARTIAL:
+                ip = read_operands(ip, end_ip, 1);
+                read_values(d, code, RENDER_PARTIAL_NUM_CONSTANTS + ip[-1]);
+                break;
+
+            case OP_PUSH_INT16:
+                ip = read_operands(ip, end_ip, 2);
+                break;
+
+            case OP_RENDER_VARIABLE_RESCUE:
+                ip = read_operands(ip, end_ip, 3);
+                break;
+
+            case OP_WRITE_RAW:
+            {
+                size_t offset = read_size(d);
+                size_t size = read_size(d);
+                if (offset > d->source_size || size > d->source_size - offset)
+                    raise_invalid_dump();
+                size_t slice[2] = { (size_t)(d->source_start + offset), size };
+                c_buffer_write(constants, &slice, sizeof(slice));
+                break;
+            }
+
+            case OP_WRITE_NODE:
+            case OP_PUSH_CONST:
+            case OP_FIND_STATIC_VAR:
+            case OP_LOOKUP_CONST_KEY:
+            case OP_LOOKUP_COMMAND:
+            case OP_EVAL_CONDITION:
+            case OP_BREAK:
+            case OP_CONTINUE:
+            case OP_ASSIGN:
+            case OP_CAPTURE_BEGIN:
+            case OP_INCREMENT:
+            case OP_DECREMENT:
+            case OP_CYCLE:
+                read_values(d, code, 1);
+                break;
+
+            case OP_FILTER:
+            {
+                ip = read_operands(ip, end_ip, 1);
+                read_values(d, code, 1);
+                vm_assembler_write_filter_cache(code);
+                break;
+            }
+
+            case OP_FIND_PATH:
+            {
+                ip = read_operands(ip, end_ip, 1);
+                size_t num_lookups = ip[-1];
+                ip = read_operands(ip, end_ip, num_lookups);
+                read_values(d, code, 1 + num_lookups);
+                break;
+            }
+
+            default:
+                raise_invalid_dump();
+        }
+    }
+    if (ip != end_ip)
+        raise_invalid_dump();
+    size_t max_stack_size = verify_code(code, instructions, instructions_size, loaded);
+    ALLOCV_END(loaded_buffer);
+    if (code->max_stack_size < max_stack_size)
+        raise_invalid_dump();
+    // which can be less than the compiled size, like where lookups were fused, and keeps
+    // the size from a corrupted dump from being reserved
+    code->max_stack_size = max_stack_size;
+
+    if (map_instructions) {
+        c_buffer_free(&code->instructions);
+        uint8_t *mapped = (uint8_t *)instructions;
+        code->instructions = (c_buffer_t) { mapped, mapped + instructions_size, mapped + instructions_size };
+        code->mapped_instructions = true;
+    } else {
+        c_buffer_write(&code->instructions, (void *)instructions, instructions_size);
+    }
+}
+
+// The instructions are used from the data in place if map_instructions is true, which must
+// then stay alive and unchanged for as long as the block body, like for a mapped template store.
+void deserialize_block_body(block_body_t *body, VALUE data, bool map_instructions)
+{
+    StringValue(data);
+    data = rb_str_new_frozen(data); // the loaded code must not be mutated by the load block
+    deserializer_t d = {
+        .cursor = (const uint8_t *)RSTRING_PTR(data),
+        .end = (const uint8_t *)RSTRING_END(data),
+        .source_start = NULL,
+        .source_size = 0,
+        .loaded_values = rb_ary_new(),
+    };
+    if (body->source != Qnil) {
+        d.source_start = RSTRING_PTR(body->source);
+        d.source_size = RSTRING_LEN(body->source);
+    }
+
+    if (memcmp(read_bytes(&d, sizeof(serialize_magic)), serialize_magic, sizeof(serialize_magic)) != 0)
+        raise_invalid_dump();
+    uint32_t header[2];
+    memcpy(header, read_bytes(&d, sizeof(header)), sizeof(header));
+    if (header[0] != SERIALIZE_FORMAT_VERSION || header[1] != SERIALIZE_BYTE_ORDER_MARK ||
+            read_byte(&d) != sizeof(size_t)) {
+        rb_raise(rb_eArgError, "incompatible Liquid::C::BlockBody dump format");
+    }
+
+    if (read_size(&d) != d.source_size)
+        rb_raise(rb_eArgError, "Liquid::C::BlockBody dump is for a different source");
+    body->blank = read_byte(&d);
+    body->render_score = (int)read_size(&d);
+    vm_assembler_remove_leave(&body->code);
+    read_code(&d, &body->code, map_instructions);
+    if (d.cursor != d.end)
+        raise_invalid_dump();
+
+    RB_GC_GUARD(data);
+    RB_GC_GUARD(d.loaded_values);
+}
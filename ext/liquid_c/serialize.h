@@ -0,0 +1,9 @@
+#if !defined(LIQUID_SERIALIZE_H)
+#define LIQUID_SERIALIZE_H
+
+#include "block.h"
+
+VALUE serialize_block_body(const block_body_t *body);
+void deserialize_block_body(block_body_t *body, VALUE data, bool map_instructions);
+
+#endif
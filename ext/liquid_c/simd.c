@@ -0,0 +1,189 @@
+#include "liquid.h"
+#include "simd.h"
+
+#if defined(LIQUID_HAVE_X86_SIMD)
+#include <immintrin.h>
+#endif
+
+find_byte_pair_func_t find_byte_pair_impl;
+count_byte_func_t count_byte_impl;
+find_html_special_func_t find_html_special_impl;
+
+static const char *find_byte_pair_scalar(const char *start, const char *end, char first, char second_a, char second_b)
+{
+    const char *last = end - 1;
+    const char *cursor = start;
+
+    while (cursor < last) {
+        cursor = memchr(cursor, first, last - cursor);
+        if (!cursor)
+            return NULL;
+        char c = cursor[1];
+        if (c == second_a || c == second_b)
+            return cursor;
+        cursor++;
+    }
+    return NULL;
+}
+
+static size_t count_byte_scalar(const char *start, const char *end, char byte)
+{
+    size_t count = 0;
+    while (start < end) {
+        if (*start == byte) count++;
+        start++;
+    }
+    return count;
+}
+
+static const char *find_html_special_scalar(const char *start, const char *end)
+{
+    for (const char *cursor = start; cursor < end; cursor++) {
+        switch (*cursor) {
+            case '&': case '<': case '>': case '"': case '\'':
+                return cursor;
+        }
+    }
+    return NULL;
+}
+
+#if defined(LIQUID_HAVE_X86_SIMD)
+
+// Each block compares the bytes at p[0..15] against first and the bytes at
+// p[1..16] against the second characters, so a block needs 17 readable bytes.
+static const char *find_byte_pair_sse2(const char *start, const char *end, char first, char second_a, char second_b)
+{
+    const __m128i v_first = _mm_set1_epi8(first);
+    const __m128i v_second_a = _mm_set1_epi8(second_a);
+    const __m128i v_second_b = _mm_set1_epi8(second_b);
+    const char *cursor = start;
+
+    while (end - cursor >= 17) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+        __m128i next_block = _mm_loadu_si128((const __m128i *)(cursor + 1));
+        __m128i second = _mm_or_si128(_mm_cmpeq_epi8(next_block, v_second_a), _mm_cmpeq_epi8(next_block, v_second_b));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block, v_first), second));
+        if (mask)
+            return cursor + __builtin_ctz(mask);
+        cursor += 16;
+    }
+    return find_byte_pair_scalar(cursor, end, first, second_a, second_b);
+}
+
+__attribute__((target("avx2")))
+static const char *find_byte_pair_avx2(const char *start, const char *end, char first, char second_a, char second_b)
+{
+    const __m256i v_first = _mm256_set1_epi8(first);
+    const __m256i v_second_a = _mm256_set1_epi8(second_a);
+    const __m256i v_second_b = _mm256_set1_epi8(second_b);
+    const char *cursor = start;
+
+    while (end - cursor >= 33) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cursor);
+        __m256i next_block = _mm256_loadu_si256((const __m256i *)(cursor + 1));
+        __m256i second = _mm256_or_si256(_mm256_cmpeq_epi8(next_block, v_second_a), _mm256_cmpeq_epi8(next_block, v_second_b));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block, v_first), second));
+        if (mask)
+            return cursor + __builtin_ctz(mask);
+        cursor += 32;
+    }
+    return find_byte_pair_sse2(cursor, end, first, second_a, second_b);
+}
+
+static size_t count_byte_sse2(const char *start, const char *end, char byte)
+{
+    const __m128i v_byte = _mm_set1_epi8(byte);
+    const char *cursor = start;
+    size_t count = 0;
+
+    while (end - cursor >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, v_byte)));
+        cursor += 16;
+    }
+    return count + count_byte_scalar(cursor, end, byte);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_byte_avx2(const char *start, const char *end, char byte)
+{
+    const __m256i v_byte = _mm256_set1_epi8(byte);
+    const char *cursor = start;
+    size_t count = 0;
+
+    while (end - cursor >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cursor);
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, v_byte)));
+        cursor += 32;
+    }
+    return count + count_byte_sse2(cursor, end, byte);
+}
+
+static const char *find_html_special_sse2(const char *start, const char *end)
+{
+    const __m128i v_amp = _mm_set1_epi8('&');
+    const __m128i v_lt = _mm_set1_epi8('<');
+    const __m128i v_gt = _mm_set1_epi8('>');
+    const __m128i v_quot = _mm_set1_epi8('"');
+    const __m128i v_apos = _mm_set1_epi8('\'');
+    const char *cursor = start;
+
+    while (end - cursor >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+        __m128i match = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, v_amp), _mm_cmpeq_epi8(block, v_lt)),
+            _mm_or_si128(_mm_cmpeq_epi8(block, v_gt),
+                         _mm_or_si128(_mm_cmpeq_epi8(block, v_quot), _mm_cmpeq_epi8(block, v_apos))));
+        int mask = _mm_movemask_epi8(match);
+        if (mask)
+            return cursor + __builtin_ctz(mask);
+        cursor += 16;
+    }
+    return find_html_special_scalar(cursor, end);
+}
+
+__attribute__((target("avx2")))
+static const char *find_html_special_avx2(const char *start, const char *end)
+{
+    const __m256i v_amp = _mm256_set1_epi8('&');
+    const __m256i v_lt = _mm256_set1_epi8('<');
+    const __m256i v_gt = _mm256_set1_epi8('>');
+    const __m256i v_quot = _mm256_set1_epi8('"');
+    const __m256i v_apos = _mm256_set1_epi8('\'');
+    const char *cursor = start;
+
+    while (end - cursor >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cursor);
+        __m256i match = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, v_amp), _mm256_cmpeq_epi8(block, v_lt)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, v_gt),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(block, v_quot), _mm256_cmpeq_epi8(block, v_apos))));
+        unsigned int mask = _mm256_movemask_epi8(match);
+        if (mask)
+            return cursor + __builtin_ctz(mask);
+        cursor += 32;
+    }
+    return find_html_special_sse2(cursor, end);
+}
+
+#endif
+
+void init_liquid_simd(void)
+{
+    find_byte_pair_impl = find_byte_pair_scalar;
+    count_byte_impl = count_byte_scalar;
+    find_html_special_impl = find_html_special_scalar;
+
+#if defined(LIQUID_HAVE_X86_SIMD)
+    find_byte_pair_impl = find_byte_pair_sse2;
+    count_byte_impl = count_byte_sse2;
+    find_html_special_impl = find_html_special_sse2;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_byte_pair_impl = find_byte_pair_avx2;
+        count_byte_impl = count_byte_avx2;
+        find_html_special_impl = find_html_special_avx2;
+    }
+#endif
+}
@@ -0,0 +1,42 @@
+#if !defined(LIQUID_SIMD_H)
+#define LIQUID_SIMD_H
+
+#include <stddef.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && defined(__GNUC__)
+#define LIQUID_HAVE_X86_SIMD 1
+#endif
+
+typedef const char *(*find_byte_pair_func_t)(const char *start, const char *end, char first, char second_a, char second_b);
+typedef size_t (*count_byte_func_t)(const char *start, const char *end, char byte);
+typedef const char *(*find_html_special_func_t)(const char *start, const char *end);
+
+// Selected by init_liquid_simd based on the CPU features available at runtime
+extern find_byte_pair_func_t find_byte_pair_impl;
+extern count_byte_func_t count_byte_impl;
+extern find_html_special_func_t find_html_special_impl;
+
+void init_liquid_simd(void);
+
+// Returns a pointer to the first character in [start, end - 1) that is equal
+// to first and is followed by a character equal to second_a or second_b,
+// or NULL if there is no such character.
+inline static const char *find_byte_pair(const char *start, const char *end, char first, char second_a, char second_b)
+{
+    return find_byte_pair_impl(start, end, first, second_a, second_b);
+}
+
+// Returns the number of characters in [start, end) that are equal to byte.
+inline static size_t count_byte(const char *start, const char *end, char byte)
+{
+    return count_byte_impl(start, end, byte);
+}
+
+// Returns a pointer to the first character in [start, end) that is one of
+// the HTML special characters & < > " ', or NULL if there is no such character.
+inline static const char *find_html_special(const char *start, const char *end)
+{
+    return find_html_special_impl(start, end);
+}
+
+#endif
@@ -0,0 +1,1153 @@
+#include "liquid.h"
+#include "standard_filters.h"
+#include "simd.h"
+#include "number.h"
+#include "context.h"
+#include <ruby/util.h>
+#include <math.h>
+
+// Native implementations of filters from Liquid::StandardFilters, which are used
+// in place of calling the Ruby methods when the strainer hasn't overridden them.
+// They must behave identically to the Ruby implementations, so they fall back to
+// calling the same Ruby methods that the filter would for less common types.
+
+static ID id_upcase, id_downcase, id_strip, id_plus, id_size, id_aref, id_gsub, id_escape_html, id_owner;
+static ID id_flatten, id_uniq, id_join, id_first, id_last, id_eq, id_cmp, id_to_number;
+static VALUE mLiquidStandardFilters, empty_string, space_string, allow_false_string, to_liquid_string;
+
+inline static bool plain_string_p(VALUE obj)
+{
+    return RB_TYPE_P(obj, T_STRING) && RBASIC_CLASS(obj) == rb_cString;
+}
+
+inline static bool plain_array_p(VALUE obj)
+{
+    return RB_TYPE_P(obj, T_ARRAY) && RBASIC_CLASS(obj) == rb_cArray;
+}
+
+inline static bool plain_hash_p(VALUE obj)
+{
+    return RB_TYPE_P(obj, T_HASH) && RBASIC_CLASS(obj) == rb_cHash;
+}
+
+// Equivalent to obj.to_s
+inline static VALUE filter_obj_to_s(VALUE obj)
+{
+    if (plain_string_p(obj))
+        return obj;
+    return rb_funcall(obj, id_to_s, 0);
+}
+
+// Equivalent to str + other
+static VALUE filter_str_plus(VALUE str, VALUE other)
+{
+    if (plain_string_p(str))
+        return rb_str_plus(str, other);
+    return rb_funcall(str, id_plus, 1, other);
+}
+
+static VALUE ascii_case_convert(VALUE str, char from_first, char from_last)
+{
+    long len = RSTRING_LEN(str);
+    VALUE result = rb_str_new(RSTRING_PTR(str), len);
+    rb_enc_copy(result, str);
+
+    char *ptr = RSTRING_PTR(result);
+    for (long i = 0; i < len; i++) {
+        if (ptr[i] >= from_first && ptr[i] <= from_last)
+            ptr[i] ^= 0x20; // flips the case of an ASCII letter
+    }
+    return result;
+}
+
+// input.to_s.upcase
+static VALUE filter_upcase(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE str = filter_obj_to_s(argv[0]);
+    if (!plain_string_p(str) || !rb_enc_str_asciionly_p(str))
+        return rb_funcall(str, id_upcase, 0);
+    return ascii_case_convert(str, 'a', 'z');
+}
+
+// input.to_s.downcase
+static VALUE filter_downcase(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE str = filter_obj_to_s(argv[0]);
+    if (!plain_string_p(str) || !rb_enc_str_asciionly_p(str))
+        return rb_funcall(str, id_downcase, 0);
+    return ascii_case_convert(str, 'A', 'Z');
+}
+
+// input.to_s.strip
+static VALUE filter_strip(VALUE context, int argc, const VALUE *argv)
+{
+    // String#strip's definition of whitespace differs between ruby versions
+    return rb_funcall(filter_obj_to_s(argv[0]), id_strip, 0);
+}
+
+// Matches the lookahead in /&(?!([a-zA-Z]+|(#\d+));)/, where str is after the ampersand
+static bool html_entity_follows(const char *str, const char *end)
+{
+    const char *start;
+    if (str < end && *str == '#') {
+        start = ++str;
+        while (str < end && ISDIGIT(*str)) str++;
+    } else {
+        start = str;
+        while (str < end && ISALPHA(*str)) str++;
+    }
+    return str > start && str < end && *str == ';';
+}
+
+// Copies the runs of characters that don't need escaping in bulk
+static VALUE escape_html(VALUE str, bool skip_entities)
+{
+    const char *start = RSTRING_PTR(str);
+    const char *end = start + RSTRING_LEN(str);
+    const char *cursor = start, *search = start, *special;
+    VALUE result = Qnil;
+
+    while ((special = find_html_special(search, end))) {
+        search = special + 1;
+
+        const char *replacement;
+        switch (*special) {
+            case '&':
+                if (skip_entities && html_entity_follows(search, end))
+                    continue;
+                replacement = "&amp;";
+                break;
+            case '<': replacement = "&lt;"; break;
+            case '>': replacement = "&gt;"; break;
+            case '"': replacement = "&quot;"; break;
+            default: replacement = "&#39;"; break;
+        }
+
+        if (NIL_P(result))
+            result = rb_str_buf_new(RSTRING_LEN(str) + 16);
+        rb_str_buf_cat(result, cursor, special - cursor);
+        rb_str_buf_cat(result, replacement, strlen(replacement));
+        cursor = search;
+    }
+
+    if (NIL_P(result))
+        return rb_str_dup(str);
+
+    rb_str_buf_cat(result, cursor, end - cursor);
+    rb_enc_copy(result, str);
+    return result;
+}
+
+// CGI.escapeHTML(input.to_s) unless input.nil?
+static VALUE filter_escape(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE input = argv[0];
+    if (NIL_P(input))
+        return Qnil;
+
+    VALUE str = filter_obj_to_s(input);
+    if (!plain_string_p(str) || !rb_enc_asciicompat(rb_enc_get(str))) {
+        VALUE cCGI = rb_const_get(rb_cObject, rb_intern("CGI"));
+        return rb_funcall(cCGI, id_escape_html, 1, str);
+    }
+    return escape_html(str, false);
+}
+
+// input.to_s.gsub(HTML_ESCAPE_ONCE_REGEXP, HTML_ESCAPE)
+static VALUE filter_escape_once(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE str = filter_obj_to_s(argv[0]);
+
+    // Bytes of other multibyte encodings could be mistaken for ASCII characters,
+    // and the regexp raises on invalid byte sequences.
+    bool scannable = plain_string_p(str) && (
+        rb_enc_str_asciionly_p(str) ||
+        (RB_ENCODING_GET(str) == utf8_encoding_index && rb_enc_str_coderange(str) == ENC_CODERANGE_VALID)
+    );
+    if (!scannable) {
+        VALUE regexp = rb_const_get(mLiquidStandardFilters, rb_intern("HTML_ESCAPE_ONCE_REGEXP"));
+        VALUE replacements = rb_const_get(mLiquidStandardFilters, rb_intern("HTML_ESCAPE"));
+        return rb_funcall(str, id_gsub, 2, regexp, replacements);
+    }
+    return escape_html(str, true);
+}
+
+// input.to_s + string.to_s
+static VALUE filter_append(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE str = filter_obj_to_s(argv[0]);
+    return filter_str_plus(str, filter_obj_to_s(argv[1]));
+}
+
+// string.to_s + input.to_s
+static VALUE filter_prepend(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE str = filter_obj_to_s(argv[1]);
+    return filter_str_plus(str, filter_obj_to_s(argv[0]));
+}
+
+// input.respond_to?(:size) ? input.size : 0
+static VALUE filter_size(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE input = argv[0];
+
+    if (plain_string_p(input))
+        return rb_str_length(input);
+    if (plain_array_p(input))
+        return LONG2NUM(RARRAY_LEN(input));
+    if (plain_hash_p(input))
+        return rb_hash_size(input);
+
+    if (!rb_respond_to(input, id_size))
+        return INT2FIX(0);
+    return rb_funcall(input, id_size, 0);
+}
+
+// options = {} unless options.is_a?(Hash)
+// false_check = options['allow_false'] ? input.nil? : !input
+// false_check || (input.respond_to?(:empty?) && input.empty?) ? default_value : input
+static VALUE filter_default(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE input = argv[0];
+    VALUE default_value = argc > 1 ? argv[1] : empty_string;
+    VALUE options = argc > 2 ? argv[2] : Qnil;
+
+    bool empty;
+    if (RB_SPECIAL_CONST_P(input) && !RB_SYMBOL_P(input)) {
+        empty = false; // no #empty? method
+    } else if (plain_string_p(input)) {
+        empty = RSTRING_LEN(input) == 0;
+    } else if (plain_array_p(input)) {
+        empty = RARRAY_LEN(input) == 0;
+    } else if (plain_hash_p(input)) {
+        empty = RHASH_SIZE(input) == 0;
+    } else {
+        return Qundef;
+    }
+
+    bool allow_false = false;
+    if (plain_hash_p(options)) {
+        allow_false = RTEST(rb_hash_aref(options, allow_false_string));
+    } else if (RB_TYPE_P(options, T_HASH)) {
+        allow_false = RTEST(rb_funcall(options, id_aref, 1, allow_false_string));
+    }
+
+    bool false_check = allow_false ? NIL_P(input) : !RTEST(input);
+    return (false_check || empty) ? default_value : input;
+}
+
+// Values that Liquid's InputIterator yields unchanged, since they aren't
+// flattened, have no #context= method and have a #to_liquid that returns self.
+static bool simple_liquid_value_p(VALUE obj)
+{
+    if (RB_SPECIAL_CONST_P(obj))
+        return !RB_SYMBOL_P(obj);
+
+    switch (RB_BUILTIN_TYPE(obj)) {
+        case T_FLOAT:
+        case T_BIGNUM:
+            return true;
+        case T_STRING:
+            return RBASIC_CLASS(obj) == rb_cString;
+        case T_HASH:
+            return RBASIC_CLASS(obj) == rb_cHash;
+        default:
+            return false;
+    }
+}
+
+// Returns the items that Liquid's InputIterator would yield for an array input,
+// or Qundef for other inputs, which are left to the Ruby implementation. To avoid
+// a copy, the input array itself is returned if none of its items need converting,
+// so the result must not be modified.
+static VALUE input_iterator_to_a(VALUE input, VALUE context)
+{
+    if (!plain_array_p(input))
+        return Qundef;
+
+    long len = RARRAY_LEN(input);
+    long i = 0;
+    while (i < len && simple_liquid_value_p(RARRAY_AREF(input, i))) i++;
+    if (i == len)
+        return input;
+
+    VALUE items = rb_funcall(input, id_flatten, 0);
+    for (i = 0; i < RARRAY_LEN(items); i++) {
+        VALUE item = RARRAY_AREF(items, i);
+        if (simple_liquid_value_p(item))
+            continue;
+        if (rb_respond_to(item, id_set_context))
+            rb_funcall(item, id_set_context, 1, context);
+        if (rb_respond_to(item, id_to_liquid))
+            rb_ary_store(items, i, rb_funcall(item, id_to_liquid, 0));
+    }
+    return items;
+}
+
+inline static bool item_responds_to_aref(VALUE item)
+{
+    return plain_hash_p(item) || rb_respond_to(item, id_aref);
+}
+
+// item[property]
+inline static VALUE item_property(VALUE item, VALUE property)
+{
+    if (plain_hash_p(item))
+        return rb_hash_aref(item, property);
+    return rb_funcall(item, id_aref, 1, property);
+}
+
+// a == b
+static bool filter_equal(VALUE a, VALUE b)
+{
+    if (RB_FIXNUM_P(a) && RB_FIXNUM_P(b))
+        return a == b;
+    if (plain_string_p(a) && RB_TYPE_P(b, T_STRING))
+        return RTEST(rb_str_equal(a, b));
+    return RTEST(rb_funcall(a, id_eq, 1, b));
+}
+
+typedef struct property_filter_args {
+    VALUE context;
+    VALUE input;
+    VALUE items;
+    VALUE property;
+    VALUE target_value;
+} property_filter_args_t;
+
+// Liquid rescues a TypeError from looking up the property on the items
+static VALUE raise_property_error(VALUE property, VALUE exception)
+{
+    rb_raise(cLiquidArgumentError, "cannot select the property '%"PRIsVALUE"'", property);
+}
+
+static VALUE rescue_property_error(VALUE (*body)(VALUE), property_filter_args_t *args)
+{
+    return rb_rescue2(body, (VALUE)args, raise_property_error, args->property, rb_eTypeError, (VALUE)0);
+}
+
+static VALUE map_body(VALUE uncast_args)
+{
+    property_filter_args_t *args = (void *)uncast_args;
+
+    VALUE items = input_iterator_to_a(args->input, args->context);
+    bool map_to_liquid = RTEST(rb_str_equal(args->property, to_liquid_string));
+    VALUE result = rb_ary_new_capa(RARRAY_LEN(items));
+
+    for (long i = 0; i < RARRAY_LEN(items); i++) {
+        VALUE item = RARRAY_AREF(items, i);
+        if (rb_obj_is_proc(item))
+            item = rb_funcall(item, id_call, 0);
+
+        VALUE value = Qnil;
+        if (map_to_liquid) {
+            value = item;
+        } else if (item_responds_to_aref(item)) {
+            value = item_property(item, args->property);
+            if (rb_obj_is_proc(value))
+                value = rb_funcall(value, id_call, 0);
+        }
+        rb_ary_push(result, value);
+    }
+    return result;
+}
+
+// InputIterator.new(input, context).map do |e|
+//   e = e.call if e.is_a?(Proc)
+//   if property == "to_liquid"
+//     e
+//   elsif e.respond_to?(:[])
+//     r = e[property]
+//     r.is_a?(Proc) ? r.call : r
+//   end
+// end
+// rescue TypeError
+//   raise_property_error(property)
+static VALUE filter_map(VALUE context, int argc, const VALUE *argv)
+{
+    if (!plain_array_p(argv[0]) || !plain_string_p(argv[1]))
+        return Qundef;
+
+    property_filter_args_t args = { .context = context, .input = argv[0], .property = argv[1] };
+    return rescue_property_error(map_body, &args);
+}
+
+static VALUE where_body(VALUE uncast_args)
+{
+    property_filter_args_t *args = (void *)uncast_args;
+    VALUE result = rb_ary_new();
+
+    for (long i = 0; i < RARRAY_LEN(args->items); i++) {
+        VALUE item = RARRAY_AREF(args->items, i);
+        VALUE value = item_property(item, args->property);
+        bool selected = NIL_P(args->target_value) ? RTEST(value) : filter_equal(value, args->target_value);
+        if (selected)
+            rb_ary_push(result, item);
+    }
+    return result;
+}
+
+// ary = InputIterator.new(input, context)
+// if ary.empty?
+//   []
+// elsif ary.first.respond_to?(:[])
+//   ary.select { |item| target_value.nil? ? item[property] : item[property] == target_value }
+// end
+// rescuing a TypeError from the select with raise_property_error(property)
+static VALUE filter_where(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE items = input_iterator_to_a(argv[0], context);
+    if (items == Qundef)
+        return Qundef;
+
+    if (RARRAY_LEN(items) == 0)
+        return rb_ary_new();
+    if (!item_responds_to_aref(RARRAY_AREF(items, 0)))
+        return Qnil;
+
+    property_filter_args_t args = {
+        .context = context,
+        .items = items,
+        .property = argv[1],
+        .target_value = argc > 2 ? argv[2] : Qnil,
+    };
+    return rescue_property_error(where_body, &args);
+}
+
+static VALUE sort_keys_body(VALUE uncast_args)
+{
+    property_filter_args_t *args = (void *)uncast_args;
+    long len = RARRAY_LEN(args->items);
+    VALUE keys = rb_ary_new_capa(len);
+
+    for (long i = 0; i < len; i++) {
+        rb_ary_push(keys, item_property(RARRAY_AREF(args->items, i), args->property));
+    }
+    return keys;
+}
+
+enum sort_key_type {
+    SORT_KEY_NONE,
+    SORT_KEY_NUMBER,
+    SORT_KEY_STRING,
+    SORT_KEY_UNSUPPORTED,
+};
+
+// Only sort keys that are all numbers or all strings are sorted natively, since
+// how liquid compares nil and values of different types depends on its version.
+static enum sort_key_type sort_key_type(VALUE keys)
+{
+    enum sort_key_type type = SORT_KEY_NONE;
+
+    for (long i = 0; i < RARRAY_LEN(keys); i++) {
+        VALUE key = RARRAY_AREF(keys, i);
+        enum sort_key_type key_type;
+
+        if (RB_INTEGER_TYPE_P(key)) {
+            key_type = SORT_KEY_NUMBER;
+        } else if (RB_FLOAT_TYPE_P(key) && !isnan(RFLOAT_VALUE(key))) {
+            key_type = SORT_KEY_NUMBER;
+        } else if (plain_string_p(key)) {
+            key_type = SORT_KEY_STRING;
+        } else {
+            return SORT_KEY_UNSUPPORTED;
+        }
+
+        if (type != SORT_KEY_NONE && type != key_type)
+            return SORT_KEY_UNSUPPORTED;
+        type = key_type;
+    }
+    return type;
+}
+
+typedef struct sort_keys {
+    VALUE keys;
+    enum sort_key_type type;
+} sort_keys_t;
+
+static int compare_sort_keys(const void *a_index, const void *b_index, void *data)
+{
+    sort_keys_t *sort_keys = data;
+    VALUE a = RARRAY_AREF(sort_keys->keys, *(const long *)a_index);
+    VALUE b = RARRAY_AREF(sort_keys->keys, *(const long *)b_index);
+
+    if (sort_keys->type == SORT_KEY_STRING)
+        return rb_str_cmp(a, b);
+    if (RB_FIXNUM_P(a) && RB_FIXNUM_P(b))
+        return (long)a < (long)b ? -1 : (long)a > (long)b;
+    return FIX2INT(rb_funcall(a, id_cmp, 1, b));
+}
+
+// ary = InputIterator.new(input, context)
+// return [] if ary.empty?
+// if property.nil?
+//   ary.sort { |a, b| nil_safe_compare(a, b) }
+// elsif ary.all? { |el| el.respond_to?(:[]) }
+//   ary.sort { |a, b| nil_safe_compare(a[property], b[property]) }
+// end
+// rescuing a TypeError from the property lookups with raise_property_error(property)
+static VALUE filter_sort(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE items = input_iterator_to_a(argv[0], context);
+    if (items == Qundef)
+        return Qundef;
+
+    long len = RARRAY_LEN(items);
+    if (len == 0)
+        return rb_ary_new();
+
+    VALUE property = argc > 1 ? argv[1] : Qnil;
+    VALUE keys = items;
+    if (!NIL_P(property)) {
+        // Array#sort doesn't compare the properties of a single item
+        if (len == 1) {
+            return item_responds_to_aref(RARRAY_AREF(items, 0)) ?
+                rb_ary_new_from_values(len, RARRAY_CONST_PTR(items)) : Qnil;
+        }
+        for (long i = 0; i < len; i++) {
+            if (!item_responds_to_aref(RARRAY_AREF(items, i)))
+                return Qnil;
+        }
+        // Look up each property once instead of for every comparison
+        property_filter_args_t args = { .context = context, .items = items, .property = property };
+        keys = rescue_property_error(sort_keys_body, &args);
+    }
+
+    sort_keys_t sort_keys = { .keys = keys, .type = sort_key_type(keys) };
+    if (sort_keys.type == SORT_KEY_UNSUPPORTED)
+        return Qundef;
+
+    // Sorting with the same algorithm as Array#sort results in the same order for equal keys
+    long *order = ALLOC_N(long, len);
+    for (long i = 0; i < len; i++) order[i] = i;
+    ruby_qsort(order, len, sizeof(long), compare_sort_keys, &sort_keys);
+
+    VALUE result = rb_ary_new_capa(len);
+    for (long i = 0; i < len; i++) {
+        rb_ary_push(result, RARRAY_AREF(items, order[i]));
+    }
+    xfree(order);
+    RB_GC_GUARD(keys);
+    return result;
+}
+
+static VALUE uniq_body(VALUE uncast_args)
+{
+    property_filter_args_t *args = (void *)uncast_args;
+    VALUE seen = rb_hash_new();
+    VALUE result = rb_ary_new();
+
+    for (long i = 0; i < RARRAY_LEN(args->items); i++) {
+        VALUE item = RARRAY_AREF(args->items, i);
+        VALUE key = item_property(item, args->property);
+        if (rb_hash_lookup2(seen, key, Qundef) == Qundef) {
+            rb_hash_aset(seen, key, Qtrue);
+            rb_ary_push(result, item);
+        }
+    }
+    return result;
+}
+
+// ary = InputIterator.new(input, context)
+// if property.nil?
+//   ary.to_a.uniq
+// elsif ary.empty?
+//   []
+// elsif ary.first.respond_to?(:[])
+//   ary.to_a.uniq { |a| a[property] }
+// end
+// rescuing a TypeError from the uniq with raise_property_error(property)
+static VALUE filter_uniq(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE items = input_iterator_to_a(argv[0], context);
+    if (items == Qundef)
+        return Qundef;
+
+    VALUE property = argc > 1 ? argv[1] : Qnil;
+    if (NIL_P(property))
+        return rb_funcall(items, id_uniq, 0);
+
+    long len = RARRAY_LEN(items);
+    if (len == 0)
+        return rb_ary_new();
+    if (!item_responds_to_aref(RARRAY_AREF(items, 0)))
+        return Qnil;
+    // Array#uniq doesn't call the block for arrays with a single item
+    if (len == 1)
+        return rb_ary_new_from_values(len, RARRAY_CONST_PTR(items));
+
+    property_filter_args_t args = { .context = context, .items = items, .property = property };
+    return rescue_property_error(uniq_body, &args);
+}
+
+static VALUE compact_body(VALUE uncast_args)
+{
+    property_filter_args_t *args = (void *)uncast_args;
+    VALUE result = rb_ary_new();
+
+    for (long i = 0; i < RARRAY_LEN(args->items); i++) {
+        VALUE item = RARRAY_AREF(args->items, i);
+        VALUE value = NIL_P(args->property) ? item : item_property(item, args->property);
+        if (!NIL_P(value))
+            rb_ary_push(result, item);
+    }
+    return result;
+}
+
+// ary = InputIterator.new(input, context)
+// if property.nil?
+//   ary.to_a.compact
+// elsif ary.empty?
+//   []
+// elsif ary.first.respond_to?(:[])
+//   ary.reject { |a| a[property].nil? }
+// end
+// rescuing a TypeError from the reject with raise_property_error(property)
+static VALUE filter_compact(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE items = input_iterator_to_a(argv[0], context);
+    if (items == Qundef)
+        return Qundef;
+
+    property_filter_args_t args = { .context = context, .items = items, .property = argc > 1 ? argv[1] : Qnil };
+    if (NIL_P(args.property))
+        return compact_body((VALUE)&args);
+
+    if (RARRAY_LEN(items) == 0)
+        return rb_ary_new();
+    if (!item_responds_to_aref(RARRAY_AREF(items, 0)))
+        return Qnil;
+
+    return rescue_property_error(compact_body, &args);
+}
+
+// InputIterator.new(input, context).to_a.join(glue.to_s)
+static VALUE filter_join(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE items = input_iterator_to_a(argv[0], context);
+    if (items == Qundef)
+        return Qundef;
+
+    VALUE glue = argc > 1 ? filter_obj_to_s(argv[1]) : space_string;
+    if (!RB_TYPE_P(glue, T_STRING))
+        return rb_funcall(items, id_join, 1, glue);
+    return rb_ary_join(items, glue);
+}
+
+// array.first if array.respond_to?(:first)
+static VALUE filter_first(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE array = argv[0];
+
+    if (plain_array_p(array))
+        return RARRAY_LEN(array) ? RARRAY_AREF(array, 0) : Qnil;
+
+    if (!rb_respond_to(array, id_first))
+        return Qnil;
+    return rb_funcall(array, id_first, 0);
+}
+
+// array.last if array.respond_to?(:last)
+static VALUE filter_last(VALUE context, int argc, const VALUE *argv)
+{
+    VALUE array = argv[0];
+
+    if (plain_array_p(array)) {
+        long len = RARRAY_LEN(array);
+        return len ? RARRAY_AREF(array, len - 1) : Qnil;
+    }
+
+    if (!rb_respond_to(array, id_last))
+        return Qnil;
+    return rb_funcall(array, id_last, 0);
+}
+
+// Liquid::Utils.to_number converts floats and decimal strings to a BigDecimal,
+// so the number filters use decimal arithmetic. Numbers are represented here as
+// mantissa * 10**-scale and the filters fall back to the Ruby implementation
+// when that doesn't give exactly the same result, such as on overflow.
+typedef struct filter_number {
+    int64_t mantissa;
+    int scale;
+    bool decimal; // a BigDecimal rather than an Integer
+} filter_number_t;
+
+// Integers up to this magnitude are exactly representable as a double
+#define MAX_EXACT_DOUBLE_INTEGER (1LL << 53)
+// Keeps a float's mantissa small enough that at most one decimal with the same
+// scale converts back to that float.
+#define MAX_FLOAT_DECIMAL_MANTISSA (1LL << 50)
+#define MAX_FLOAT_DECIMAL_SCALE 17
+
+static const int64_t powers_of_ten[] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL, 1000000000000LL,
+    10000000000000LL, 100000000000000LL, 1000000000000000LL, 10000000000000000LL,
+    100000000000000000LL, 1000000000000000000LL
+};
+
+// BigDecimal(float.to_s), which is the decimal with the fewest digits that
+// converts back to the float. With a small enough mantissa, the decimal with
+// the smallest scale that converts back is the only one with that scale.
+static bool float_to_number(double value, filter_number_t *num)
+{
+    // BigDecimal keeps the sign of negative zero
+    if (!isfinite(value) || (value == 0 && signbit(value)))
+        return false;
+
+    for (int scale = 0; scale <= MAX_FLOAT_DECIMAL_SCALE; scale++) {
+        double scaled = round(value * exact_powers_of_ten[scale]);
+        if (fabs(scaled) >= MAX_FLOAT_DECIMAL_MANTISSA)
+            return false;
+        if (scaled / exact_powers_of_ten[scale] == value) {
+            *num = (filter_number_t){ .mantissa = (int64_t)scaled, .scale = scale, .decimal = true };
+            return true;
+        }
+    }
+    return false;
+}
+
+// /\A-?\d+\.\d+\z/.match?(obj.strip) ? BigDecimal(obj) : obj.to_i
+// for strings that don't need stripping and are either an integer or a decimal
+static bool string_to_number(VALUE str, filter_number_t *num)
+{
+    if (!rb_enc_asciicompat(rb_enc_get(str)))
+        return false;
+
+    const char *cur = RSTRING_PTR(str);
+    const char *end = RSTRING_END(str);
+    bool negative = cur < end && *cur == '-';
+    if (negative) cur++;
+
+    int64_t mantissa = 0;
+    int digits = 0, scale = -1;
+    for (; cur < end; cur++) {
+        if (*cur == '.' && digits > 0 && scale < 0) {
+            scale = 0;
+            continue;
+        }
+        if (*cur < '0' || *cur > '9' || digits >= MAX_INT64_DIGITS)
+            return false;
+        mantissa = mantissa * 10 + (*cur - '0');
+        digits++;
+        if (scale >= 0) scale++;
+    }
+    if (digits == 0 || scale == 0)
+        return false;
+
+    bool decimal = scale > 0;
+    // BigDecimal keeps the sign of negative zero
+    if (decimal && negative && mantissa == 0)
+        return false;
+
+    *num = (filter_number_t){
+        .mantissa = negative ? -mantissa : mantissa,
+        .scale = decimal ? scale : 0,
+        .decimal = decimal,
+    };
+    return true;
+}
+
+// Liquid::Utils.to_number(obj)
+static bool to_number(VALUE obj, filter_number_t *num)
+{
+    if (RB_FIXNUM_P(obj)) {
+        *num = (filter_number_t){ .mantissa = FIX2LONG(obj) };
+        return true;
+    }
+    if (RB_FLOAT_TYPE_P(obj))
+        return float_to_number(RFLOAT_VALUE(obj), num);
+    if (plain_string_p(obj))
+        return string_to_number(obj, num);
+
+    // obj.respond_to?(:to_number) ? obj.to_number : 0
+    if (RB_SPECIAL_CONST_P(obj) && !RB_SYMBOL_P(obj) && !rb_respond_to(obj, id_to_number)) {
+        *num = (filter_number_t){ .mantissa = 0 };
+        return true;
+    }
+    return false;
+}
+
+// Converts a result, which is an Integer unless an operand was a BigDecimal,
+// in which case liquid converts it to a Float.
+static VALUE number_to_value(const filter_number_t *num)
+{
+    if (!num->decimal)
+        return LL2NUM(num->mantissa);
+
+    // Both are exact, so the division is the correctly rounded BigDecimal#to_f
+    if (llabs(num->mantissa) > MAX_EXACT_DOUBLE_INTEGER || num->scale > MAX_EXACT_DOUBLE_SCALE)
+        return Qundef;
+    return DBL2NUM((double)num->mantissa / exact_powers_of_ten[num->scale]);
+}
+
+// BigDecimal arithmetic can produce a negative zero, which number_to_value
+// can't represent.
+static VALUE arithmetic_result_to_value(const filter_number_t *num)
+{
+    if (num->decimal && num->mantissa == 0)
+        return Qundef;
+    return number_to_value(num);
+}
+
+static bool scale_mantissa(int64_t mantissa, int scale_by, int64_t *result)
+{
+    if (scale_by > MAX_INT64_DIGITS)
+        return mantissa == 0 && (*result = 0, true);
+    return !__builtin_mul_overflow(mantissa, powers_of_ten[scale_by], result);
+}
+
+// Gives both numbers the same scale
+static bool align_numbers(filter_number_t *a, filter_number_t *b)
+{
+    if (a->scale < b->scale) {
+        if (!scale_mantissa(a->mantissa, b->scale - a->scale, &a->mantissa))
+            return false;
+        a->scale = b->scale;
+    } else if (b->scale < a->scale) {
+        if (!scale_mantissa(b->mantissa, a->scale - b->scale, &b->mantissa))
+            return false;
+        b->scale = a->scale;
+    }
+    return true;
+}
+
+// Integer#div and BigDecimal#div round towards negative infinity
+static int64_t floor_div(int64_t a, int64_t b)
+{
+    int64_t quotient = a / b;
+    if (a % b != 0 && (a < 0) != (b < 0))
+        quotient--;
+    return quotient;
+}
+
+static int64_t floor_mod(int64_t a, int64_t b)
+{
+    int64_t remainder = a % b;
+    if (remainder != 0 && (remainder < 0) != (b < 0))
+        remainder += b;
+    return remainder;
+}
+
+// BigDecimal#round's default mode rounds half away from zero, like Integer#round
+static int64_t round_half_up_div(int64_t a, int64_t b)
+{
+    int64_t quotient = a / b;
+    int64_t remainder = a % b;
+    if (llabs(remainder) >= b - llabs(remainder))
+        quotient += a < 0 ? -1 : 1;
+    return quotient;
+}
+
+enum arithmetic_operation {
+    OPERATION_PLUS,
+    OPERATION_MINUS,
+    OPERATION_TIMES,
+    OPERATION_DIVIDED_BY,
+    OPERATION_MODULO,
+};
+
+static bool apply_decimal_division(filter_number_t *a, const filter_number_t *b)
+{
+    // BigDecimal#/ rounds the quotient, so only exact quotients are computed natively
+    for (int extra_scale = 0; extra_scale <= MAX_INT64_DIGITS; extra_scale++) {
+        int64_t dividend;
+        if (!scale_mantissa(a->mantissa, extra_scale, &dividend))
+            return false;
+        if (dividend % b->mantissa == 0) {
+            int64_t quotient = dividend / b->mantissa;
+            int scale = a->scale + extra_scale - b->scale;
+            if (scale < 0) {
+                if (!scale_mantissa(quotient, -scale, &quotient))
+                    return false;
+                scale = 0;
+            }
+            a->mantissa = quotient;
+            a->scale = scale;
+            return true;
+        }
+    }
+    return false;
+}
+
+// result = Utils.to_number(input).send(operation, Utils.to_number(operand))
+// result.is_a?(BigDecimal) ? result.to_f : result
+static VALUE apply_operation(const VALUE *argv, enum arithmetic_operation operation)
+{
+    filter_number_t a, b;
+    if (!to_number(argv[0], &a) || !to_number(argv[1], &b))
+        return Qundef;
+
+    bool decimal = a.decimal || b.decimal;
+    bool ok;
+
+    switch (operation) {
+        case OPERATION_PLUS:
+            ok = align_numbers(&a, &b) && !__builtin_add_overflow(a.mantissa, b.mantissa, &a.mantissa);
+            break;
+        case OPERATION_MINUS:
+            ok = align_numbers(&a, &b) && !__builtin_sub_overflow(a.mantissa, b.mantissa, &a.mantissa);
+            break;
+        case OPERATION_TIMES:
+            ok = !__builtin_mul_overflow(a.mantissa, b.mantissa, &a.mantissa);
+            a.scale += b.scale;
+            break;
+        case OPERATION_DIVIDED_BY:
+            // leave raising the ZeroDivisionError to the Ruby implementation
+            if (b.mantissa == 0)
+                return Qundef;
+            if (decimal) {
+                ok = apply_decimal_division(&a, &b);
+            } else {
+                a.mantissa = floor_div(a.mantissa, b.mantissa);
+                ok = true;
+            }
+            break;
+        case OPERATION_MODULO:
+            if (b.mantissa == 0)
+                return Qundef;
+            ok = align_numbers(&a, &b);
+            if (ok) a.mantissa = floor_mod(a.mantissa, b.mantissa);
+            break;
+        default:
+            rb_bug("unknown arithmetic operation");
+    }
+    if (!ok)
+        return Qundef;
+
+    a.decimal = decimal;
+    return arithmetic_result_to_value(&a);
+}
+
+static VALUE filter_plus(VALUE context, int argc, const VALUE *argv)
+{
+    return apply_operation(argv, OPERATION_PLUS);
+}
+
+static VALUE filter_minus(VALUE context, int argc, const VALUE *argv)
+{
+    return apply_operation(argv, OPERATION_MINUS);
+}
+
+static VALUE filter_times(VALUE context, int argc, const VALUE *argv)
+{
+    return apply_operation(argv, OPERATION_TIMES);
+}
+
+static VALUE filter_divided_by(VALUE context, int argc, const VALUE *argv)
+{
+    return apply_operation(argv, OPERATION_DIVIDED_BY);
+}
+
+static VALUE filter_modulo(VALUE context, int argc, const VALUE *argv)
+{
+    return apply_operation(argv, OPERATION_MODULO);
+}
+
+// result = Utils.to_number(input).round(Utils.to_number(n))
+// result = result.to_f if result.is_a?(BigDecimal)
+// result = result.to_i if n == 0
+static VALUE filter_round(VALUE context, int argc, const VALUE *argv)
+{
+    // only an Integer n is handled, since n == 0 compares the uncoerced value
+    VALUE n_value = argc > 1 ? argv[1] : INT2FIX(0);
+    if (!RB_FIXNUM_P(n_value))
+        return Qundef;
+    long n = FIX2LONG(n_value);
+
+    filter_number_t num;
+    if (!to_number(argv[0], &num) || n < -MAX_INT64_DIGITS)
+        return Qundef;
+    // whether BigDecimal#round returns an Integer for a negative n depends on its version
+    if (num.decimal && n < 0)
+        return Qundef;
+
+    if (n >= num.scale) {
+        if (!num.decimal || n != 0)
+            return number_to_value(&num);
+        // BigDecimal#round(0) returns an Integer
+        return LL2NUM(num.mantissa);
+    }
+
+    int64_t divisor;
+    if (!scale_mantissa(1, num.scale - n, &divisor))
+        return Qundef;
+    num.mantissa = round_half_up_div(num.mantissa, divisor);
+    if (n < 0) {
+        if (!scale_mantissa(num.mantissa, -n, &num.mantissa))
+            return Qundef;
+        return LL2NUM(num.mantissa);
+    }
+
+    num.scale = n;
+    if (n == 0)
+        num.decimal = false;
+    return arithmetic_result_to_value(&num);
+}
+
+// Utils.to_number(input).ceil.to_i
+static VALUE filter_ceil(VALUE context, int argc, const VALUE *argv)
+{
+    filter_number_t num;
+    if (!to_number(argv[0], &num))
+        return Qundef;
+
+    return LL2NUM(-floor_div(-num.mantissa, powers_of_ten[num.scale]));
+}
+
+// Utils.to_number(input).floor.to_i
+static VALUE filter_floor(VALUE context, int argc, const VALUE *argv)
+{
+    filter_number_t num;
+    if (!to_number(argv[0], &num))
+        return Qundef;
+
+    return LL2NUM(floor_div(num.mantissa, powers_of_ten[num.scale]));
+}
+
+// result = Utils.to_number(input).abs
+// result.is_a?(BigDecimal) ? result.to_f : result
+static VALUE filter_abs(VALUE context, int argc, const VALUE *argv)
+{
+    filter_number_t num;
+    if (!to_number(argv[0], &num))
+        return Qundef;
+
+    num.mantissa = llabs(num.mantissa);
+    return number_to_value(&num);
+}
+
+// Returns -1, 0 or 1 in *result like a <=> b
+static bool compare_numbers(filter_number_t a, filter_number_t b, int *result)
+{
+    if (!align_numbers(&a, &b))
+        return false;
+    *result = (a.mantissa > b.mantissa) - (a.mantissa < b.mantissa);
+    return true;
+}
+
+// min_value = Utils.to_number(n)
+// result = Utils.to_number(input)
+// result = min_value if min_value > result
+// result.is_a?(BigDecimal) ? result.to_f : result
+static VALUE filter_at_least(VALUE context, int argc, const VALUE *argv)
+{
+    filter_number_t num, min_value;
+    int cmp;
+    if (!to_number(argv[1], &min_value) || !to_number(argv[0], &num) || !compare_numbers(min_value, num, &cmp))
+        return Qundef;
+
+    return number_to_value(cmp > 0 ? &min_value : &num);
+}
+
+// max_value = Utils.to_number(n)
+// result = Utils.to_number(input)
+// result = max_value if max_value < result
+// result.is_a?(BigDecimal) ? result.to_f : result
+static VALUE filter_at_most(VALUE context, int argc, const VALUE *argv)
+{
+    filter_number_t num, max_value;
+    int cmp;
+    if (!to_number(argv[1], &max_value) || !to_number(argv[0], &num) || !compare_numbers(max_value, num, &cmp))
+        return Qundef;
+
+    return number_to_value(cmp < 0 ? &max_value : &num);
+}
+
+static const native_filter_t native_filters[] = {
+    { "upcase", filter_upcase, 1, 1 },
+    { "downcase", filter_downcase, 1, 1 },
+    { "strip", filter_strip, 1, 1 },
+    { "escape", filter_escape, 1, 1 },
+    { "h", filter_escape, 1, 1 },
+    { "escape_once", filter_escape_once, 1, 1 },
+    { "append", filter_append, 2, 2 },
+    { "prepend", filter_prepend, 2, 2 },
+    { "size", filter_size, 1, 1 },
+    { "default", filter_default, 1, 3 },
+    { "map", filter_map, 2, 2 },
+    { "where", filter_where, 2, 3 },
+    { "sort", filter_sort, 1, 2 },
+    { "uniq", filter_uniq, 1, 2 },
+    { "compact", filter_compact, 1, 2 },
+    { "join", filter_join, 1, 2 },
+    { "first", filter_first, 1, 1 },
+    { "last", filter_last, 1, 1 },
+    { "plus", filter_plus, 2, 2 },
+    { "minus", filter_minus, 2, 2 },
+    { "times", filter_times, 2, 2 },
+    { "divided_by", filter_divided_by, 2, 2 },
+    { "modulo", filter_modulo, 2, 2 },
+    { "round", filter_round, 1, 2 },
+    { "ceil", filter_ceil, 1, 1 },
+    { "floor", filter_floor, 1, 1 },
+    { "abs", filter_abs, 1, 1 },
+    { "at_least", filter_at_least, 2, 2 },
+    { "at_most", filter_at_most, 2, 2 },
+};
+
+#define NUM_NATIVE_FILTERS (sizeof(native_filters) / sizeof(native_filter_t))
+
+static ID native_filter_ids[NUM_NATIVE_FILTERS];
+
+// Returns the native implementation of the filter if the strainer's method
+// for it is still the one from Liquid::StandardFilters, otherwise NULL.
+const native_filter_t *native_filter_for_strainer(VALUE strainer, VALUE filter_name)
+{
+    ID filter_id = RB_SYM2ID(filter_name);
+
+    for (size_t i = 0; i < NUM_NATIVE_FILTERS; i++) {
+        if (native_filter_ids[i] != filter_id)
+            continue;
+
+        VALUE method = rb_obj_method(strainer, filter_name);
+        if (rb_funcall(method, id_owner, 0) != mLiquidStandardFilters)
+            return NULL;
+        return &native_filters[i];
+    }
+    return NULL;
+}
+
+void init_liquid_standard_filters()
+{
+    id_upcase = rb_intern("upcase");
+    id_downcase = rb_intern("downcase");
+    id_strip = rb_intern("strip");
+    id_plus = rb_intern("+");
+    id_size = rb_intern("size");
+    id_aref = rb_intern("[]");
+    id_gsub = rb_intern("gsub");
+    id_escape_html = rb_intern("escapeHTML");
+    id_owner = rb_intern("owner");
+    id_flatten = rb_intern("flatten");
+    id_uniq = rb_intern("uniq");
+    id_join = rb_intern("join");
+    id_first = rb_intern("first");
+    id_last = rb_intern("last");
+    id_eq = rb_intern("==");
+    id_cmp = rb_intern("<=>");
+    id_to_number = rb_intern("to_number");
+
+    for (size_t i = 0; i < NUM_NATIVE_FILTERS; i++) {
+        native_filter_ids[i] = rb_intern(native_filters[i].name);
+    }
+
+    mLiquidStandardFilters = rb_const_get(mLiquid, rb_intern("StandardFilters"));
+    rb_global_variable(&mLiquidStandardFilters);
+
+    empty_string = rb_utf8_str_new_literal("");
+    rb_global_variable(&empty_string);
+    rb_obj_freeze(empty_string);
+
+    space_string = rb_utf8_str_new_literal(" ");
+    rb_global_variable(&space_string);
+    rb_obj_freeze(space_string);
+
+    to_liquid_string = rb_utf8_str_new_literal("to_liquid");
+    rb_global_variable(&to_liquid_string);
+    rb_obj_freeze(to_liquid_string);
+
+    allow_false_string = rb_utf8_str_new_literal("allow_false");
+    rb_global_variable(&allow_false_string);
+    rb_obj_freeze(allow_false_string);
+}
@@ -0,0 +1,17 @@
+#if !defined(LIQUID_STANDARD_FILTERS_H)
+#define LIQUID_STANDARD_FILTERS_H
+
+// Returns the filter result, or Qundef when the arguments need to be handled by
+// calling the Ruby implementation of the filter instead.
+typedef VALUE (*native_filter_func_t)(VALUE context, int argc, const VALUE *argv);
+
+typedef struct native_filter {
+    const char *name;
+    native_filter_func_t func;
+    int min_argc, max_argc; // including the input argument
+} native_filter_t;
+
+void init_liquid_standard_filters();
+const native_filter_t *native_filter_for_strainer(VALUE strainer, VALUE filter_name);
+
+#endif
@@ -15,19 +15,24 @@ inline static const char *read_while_reverse(const char *start, const char *end,
     return end;
 }
 
-inline static int count_newlines(const char *start, const char *end)
+inline static int not_newline(int c)
 {
-    int count = 0;
-    while (start < end) {
-        if (*start == '\n') count++;
-        start++;
-    }
-    return count;
+    return c != '\n';
 }
 
-inline static int not_newline(int c)
+// Returns a pointer to the first occurrence of needle in [start, end), or NULL if
+// there is none, like memmem, which isn't portable
+inline static const char *find_substring(const char *start, const char *end, const char *needle, long needle_len)
 {
-    return c != '\n';
+    while (end - start >= needle_len) {
+        start = memchr(start, needle[0], end - start - needle_len + 1);
+        if (!start)
+            return NULL;
+        if (memcmp(start, needle, needle_len) == 0)
+            return start;
+        start++;
+    }
+    return NULL;
 }
 
 inline static bool is_word_char(char c)
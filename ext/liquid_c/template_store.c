@@ -0,0 +1,281 @@
+#include "liquid.h"
+#include "template_store.h"
+#include "block.h"
+#include "serialize.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ruby/io.h>
+#endif
+
+// A read-only file of precompiled block bodies that is mapped into memory, so that the
+// instructions and raw text of its templates live in clean pages that are shared by the
+// processes that map it, like forked workers, and only their constants are loaded per process.
+
+// Bump whenever the layout of the file changes, the format of the dumps is versioned separately
+#define TEMPLATE_STORE_FORMAT_VERSION 1
+
+static const char template_store_magic[4] = { 'L', 'Q', 'C', 'S' };
+
+// Identifies the byte order, since sizes are stored in the native byte order
+#define TEMPLATE_STORE_BYTE_ORDER_MARK 0x01020304
+
+// The magic, the format version, the byte order mark, sizeof(size_t) and the number of entries
+#define TEMPLATE_STORE_HEADER_SIZE (sizeof(template_store_magic) + 2 * sizeof(uint32_t) + 1 + sizeof(size_t))
+
+// Followed by the NUL terminated source and the dump of each entry
+typedef struct template_store_entry {
+    size_t source_offset;
+    size_t source_size; // without the terminating NUL
+    size_t dump_offset;
+    size_t dump_size;
+} template_store_entry_t;
+
+typedef struct template_store {
+    const uint8_t *mapping;
+    size_t size;
+    size_t num_entries;
+} template_store_t;
+
+static VALUE cLiquidCTemplateStore;
+static ID id_template_store;
+
+static void template_store_free(void *ptr)
+{
+    template_store_t *store = ptr;
+#ifdef HAVE_SYS_MMAN_H
+    if (store->mapping)
+        munmap((void *)store->mapping, store->size);
+#endif
+    xfree(store);
+}
+
+static size_t template_store_memsize(const void *ptr)
+{
+    return sizeof(template_store_t);
+}
+
+static const rb_data_type_t template_store_data_type = {
+    "liquid_template_store",
+    { NULL, template_store_free, template_store_memsize, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+#define TemplateStore_Get_Struct(obj, sval) TypedData_Get_Struct(obj, template_store_t, &template_store_data_type, sval)
+
+static VALUE template_store_allocate(VALUE klass)
+{
+    template_store_t *store;
+    VALUE obj = TypedData_Make_Struct(klass, template_store_t, &template_store_data_type, store);
+    store->mapping = NULL;
+    store->size = 0;
+    store->num_entries = 0;
+    return obj;
+}
+
+static void write_size(VALUE output, size_t size)
+{
+    rb_str_buf_cat(output, (const char *)&size, sizeof(size));
+}
+
+static const template_store_entry_t *template_store_entries(const template_store_t *store)
+{
+    return (const template_store_entry_t *)(store->mapping + TEMPLATE_STORE_HEADER_SIZE);
+}
+
+// Builds the contents of a template store file from an array of compiled Liquid::C::BlockBody
+// objects, where the block dumps the objects that aren't literals, like Liquid::C::BlockBody#dump.
+static VALUE template_store_build(VALUE klass, VALUE bodies)
+{
+    Check_Type(bodies, T_ARRAY);
+    long num_entries = RARRAY_LEN(bodies);
+    VALUE sources = rb_ary_new_capa(num_entries);
+    VALUE dumps = rb_ary_new_capa(num_entries);
+    for (long i = 0; i < num_entries; i++) {
+        VALUE body_obj = RARRAY_AREF(bodies, i);
+        block_body_t *body = block_body_parsed_struct(body_obj);
+        if (!body) {
+            rb_raise(rb_eArgError, "a compiled Liquid::C::BlockBody is needed for the template store, not %"PRIsVALUE,
+                    rb_obj_class(body_obj));
+        }
+        rb_ary_push(sources, body->source == Qnil ? rb_str_new(NULL, 0) : body->source);
+        rb_ary_push(dumps, serialize_block_body(body));
+    }
+
+    VALUE output = rb_str_buf_new(0);
+    rb_str_buf_cat(output, template_store_magic, sizeof(template_store_magic));
+    uint32_t header[2] = { TEMPLATE_STORE_FORMAT_VERSION, TEMPLATE_STORE_BYTE_ORDER_MARK };
+    rb_str_buf_cat(output, (const char *)header, sizeof(header));
+    rb_str_buf_cat(output, (const char []){ sizeof(size_t) }, 1);
+    write_size(output, num_entries);
+
+    size_t offset = TEMPLATE_STORE_HEADER_SIZE + num_entries * sizeof(template_store_entry_t);
+    for (long i = 0; i < num_entries; i++) {
+        template_store_entry_t entry;
+        entry.source_offset = offset;
+        entry.source_size = RSTRING_LEN(RARRAY_AREF(sources, i));
+        entry.dump_offset = entry.source_offset + entry.source_size + 1;
+        entry.dump_size = RSTRING_LEN(RARRAY_AREF(dumps, i));
+        offset = entry.dump_offset + entry.dump_size;
+        rb_str_buf_cat(output, (const char *)&entry, sizeof(entry));
+    }
+    for (long i = 0; i < num_entries; i++) {
+        VALUE source = RARRAY_AREF(sources, i);
+        VALUE dump = RARRAY_AREF(dumps, i);
+        // copied as bytes, since the sources aren't compatible with the encoding of the output
+        rb_str_buf_cat(output, RSTRING_PTR(source), RSTRING_LEN(source));
+        rb_str_buf_cat(output, "", 1);
+        rb_str_buf_cat(output, RSTRING_PTR(dump), RSTRING_LEN(dump));
+    }
+
+    RB_GC_GUARD(sources);
+    RB_GC_GUARD(dumps);
+    return output;
+}
+
+__attribute__((noreturn)) static void raise_invalid_file(VALUE path)
+{
+    rb_raise(rb_eArgError, "invalid Liquid::C::TemplateStore file: %"PRIsVALUE, path);
+}
+
+static bool valid_range(const template_store_t *store, size_t offset, size_t size)
+{
+    return offset <= store->size && size <= store->size - offset;
+}
+
+static void validate_template_store(template_store_t *store, VALUE path)
+{
+    if (store->size < TEMPLATE_STORE_HEADER_SIZE)
+        raise_invalid_file(path);
+    const uint8_t *cursor = store->mapping;
+    if (memcmp(cursor, template_store_magic, sizeof(template_store_magic)) != 0)
+        raise_invalid_file(path);
+    cursor += sizeof(template_store_magic);
+
+    uint32_t header[2];
+    memcpy(header, cursor, sizeof(header));
+    cursor += sizeof(header);
+    if (header[0] != TEMPLATE_STORE_FORMAT_VERSION || header[1] != TEMPLATE_STORE_BYTE_ORDER_MARK ||
+            *cursor++ != sizeof(size_t)) {
+        rb_raise(rb_eArgError, "incompatible Liquid::C::TemplateStore file format: %"PRIsVALUE, path);
+    }
+
+    size_t num_entries;
+    memcpy(&num_entries, cursor, sizeof(num_entries));
+    if (num_entries > (store->size - TEMPLATE_STORE_HEADER_SIZE) / sizeof(template_store_entry_t))
+        raise_invalid_file(path);
+
+    for (size_t i = 0; i < num_entries; i++) {
+        template_store_entry_t entry;
+        memcpy(&entry, template_store_entries(store) + i, sizeof(entry));
+        if (!valid_range(store, entry.source_offset, entry.source_size) ||
+                !valid_range(store, entry.source_offset + entry.source_size, 1) ||
+                store->mapping[entry.source_offset + entry.source_size] != '\0' ||
+                !valid_range(store, entry.dump_offset, entry.dump_size)) {
+            raise_invalid_file(path);
+        }
+    }
+    store->num_entries = num_entries;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+// Maps a file built with Liquid::C::TemplateStore.build, e.g. before forking workers so they
+// share its pages. Like for Liquid::C::BlockBody.load, the file must come from a trusted source.
+static VALUE template_store_open(VALUE klass, VALUE path)
+{
+    FilePathValue(path);
+    path = rb_str_new_frozen(path);
+
+    int fd = rb_cloexec_open(RSTRING_PTR(path), O_RDONLY, 0);
+    if (fd < 0)
+        rb_sys_fail_str(path);
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        int fstat_errno = errno;
+        close(fd);
+        errno = fstat_errno;
+        rb_sys_fail_str(path);
+    }
+    if ((size_t)file_stat.st_size < TEMPLATE_STORE_HEADER_SIZE) {
+        close(fd);
+        raise_invalid_file(path);
+    }
+
+    size_t size = file_stat.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int mmap_errno = errno;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        errno = mmap_errno;
+        rb_sys_fail_str(path);
+    }
+
+    VALUE self = rb_obj_alloc(klass);
+    template_store_t *store;
+    TemplateStore_Get_Struct(self, store);
+    store->mapping = mapping;
+    store->size = size;
+    validate_template_store(store, path);
+    return self;
+}
+#endif
+
+static VALUE template_store_size(VALUE self)
+{
+    template_store_t *store;
+    TemplateStore_Get_Struct(self, store);
+    return SIZET2NUM(store->num_entries);
+}
+
+// A frozen string over the mapping, which keeps the store alive for as long as it is referenced,
+// like by the source of a block body that was loaded from it, or by its mapped_dump.
+static VALUE mapped_string(VALUE self, const char *ptr, size_t size, rb_encoding *encoding)
+{
+    VALUE string = rb_enc_str_new_static(ptr, size, encoding);
+    rb_ivar_set(string, id_template_store, self);
+    return rb_obj_freeze(string);
+}
+
+// Loads the block body at the index, like Liquid::C::BlockBody.load, where the block loads
+// the objects that it dumped for Liquid::C::TemplateStore.build.
+static VALUE template_store_load(VALUE self, VALUE index)
+{
+    template_store_t *store;
+    TemplateStore_Get_Struct(self, store);
+    long i = NUM2LONG(index);
+    if (i < 0 || (size_t)i >= store->num_entries)
+        rb_raise(rb_eIndexError, "index %ld outside of the template store", i);
+
+    template_store_entry_t entry;
+    memcpy(&entry, template_store_entries(store) + i, sizeof(entry));
+    const char *mapping = (const char *)store->mapping;
+    VALUE source = mapped_string(self, mapping + entry.source_offset, entry.source_size, utf8_encoding);
+    VALUE dump = mapped_string(self, mapping + entry.dump_offset, entry.dump_size, rb_ascii8bit_encoding());
+    VALUE body = block_body_new_from_dump(dump, source, true);
+
+    RB_GC_GUARD(source);
+    RB_GC_GUARD(dump);
+    return body;
+}
+
+void init_liquid_template_store()
+{
+    id_template_store = rb_intern("__template_store");
+
+    cLiquidCTemplateStore = rb_define_class_under(mLiquidC, "TemplateStore", rb_cObject);
+    rb_global_variable(&cLiquidCTemplateStore);
+    rb_define_alloc_func(cLiquidCTemplateStore, template_store_allocate);
+    rb_undef_method(rb_singleton_class(cLiquidCTemplateStore), "new");
+    rb_define_singleton_method(cLiquidCTemplateStore, "build", template_store_build, 1);
+#ifdef HAVE_SYS_MMAN_H
+    rb_define_singleton_method(cLiquidCTemplateStore, "open", template_store_open, 1);
+#else
+    rb_define_singleton_method(cLiquidCTemplateStore, "open", rb_f_notimplement, -1);
+#endif
+    rb_define_method(cLiquidCTemplateStore, "size", template_store_size, 0);
+    rb_define_method(cLiquidCTemplateStore, "load", template_store_load, 1);
+}
@@ -0,0 +1,6 @@
+#if !defined(LIQUID_TEMPLATE_STORE_H)
+#define LIQUID_TEMPLATE_STORE_H
+
+void init_liquid_template_store();
+
+#endif
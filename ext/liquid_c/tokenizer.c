@@ -1,31 +1,34 @@
 #include "liquid.h"
 #include "tokenizer.h"
 #include "stringutil.h"
+#include "simd.h"
 
 VALUE cLiquidTokenizer;
 
 static void tokenizer_mark(void *ptr)
 {
     tokenizer_t *tokenizer = ptr;
-    rb_gc_mark(tokenizer->source);
+    rb_gc_mark(tokenizer->source); // pinned, since the cursor points into its bytes
 }
 
 static void tokenizer_free(void *ptr)
 {
     tokenizer_t *tokenizer = ptr;
+    c_buffer_free(&tokenizer->newline_offsets);
     xfree(tokenizer);
 }
 
 static size_t tokenizer_memsize(const void *ptr)
 {
-    return ptr ? sizeof(tokenizer_t) : 0;
+    const tokenizer_t *tokenizer = ptr;
+    return ptr ? sizeof(tokenizer_t) + c_buffer_capacity(&tokenizer->newline_offsets) : 0;
 }
 
 const rb_data_type_t tokenizer_data_type = {
     "liquid_tokenizer",
     { tokenizer_mark, tokenizer_free, tokenizer_memsize, },
 #if defined(RUBY_TYPED_FREE_IMMEDIATELY)
-    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
 #endif
 };
 
@@ -36,10 +39,54 @@ static VALUE tokenizer_allocate(VALUE klass)
 
     obj = TypedData_Make_Struct(klass, tokenizer_t, &tokenizer_data_type, tokenizer);
     tokenizer->source = Qnil;
+    tokenizer->newline_offsets = c_buffer_init();
     tokenizer->bug_compatible_whitespace_trimming = false;
     return obj;
 }
 
+static void build_newline_offsets(tokenizer_t *tokenizer)
+{
+    const char *start = tokenizer->cursor;
+    const char *end = tokenizer->cursor_end;
+
+    c_buffer_t *offsets = &tokenizer->newline_offsets;
+    c_buffer_free(offsets);
+    *offsets = c_buffer_init();
+
+    size_t count = count_byte(start, end, '\n');
+    if (count == 0)
+        return;
+
+    *offsets = c_buffer_allocate(count * sizeof(uint32_t));
+    uint32_t *offset_ptr = (uint32_t *)offsets->data;
+    const char *cursor = start;
+    while ((cursor = memchr(cursor, '\n', end - cursor))) {
+        *offset_ptr++ = (uint32_t)(cursor - start);
+        cursor++;
+    }
+    offsets->data_end = (uint8_t *)offset_ptr;
+}
+
+unsigned int tokenizer_line_number_at(const tokenizer_t *tokenizer, const char *position)
+{
+    if (tokenizer->start_line_number == 0)
+        return 0;
+
+    // binary search for the number of newlines before position
+    const uint32_t *offsets = (const uint32_t *)tokenizer->newline_offsets.data;
+    size_t low = 0, high = c_buffer_size(&tokenizer->newline_offsets) / sizeof(uint32_t);
+    uint32_t offset = (uint32_t)(position - RSTRING_PTR(tokenizer->source));
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (offsets[mid] < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return tokenizer->start_line_number + (unsigned int)low;
+}
+
 static VALUE tokenizer_initialize_method(VALUE self, VALUE source, VALUE start_line_number, VALUE for_liquid_tag)
 {
     tokenizer_t *tokenizer;
@@ -55,26 +102,27 @@ static VALUE tokenizer_initialize_method(VALUE self, VALUE source, VALUE start_l
 
     Tokenizer_Get_Struct(self, tokenizer);
     source = rb_str_dup_frozen(source);
-    tokenizer->source = source;
+    RB_OBJ_WRITE(self, &tokenizer->source, source);
     tokenizer->cursor = RSTRING_PTR(source);
     tokenizer->cursor_end = tokenizer->cursor + RSTRING_LEN(source);
     tokenizer->lstrip_flag = false;
-    // tokenizer->line_number keeps track of the current line number or it is 0
-    // to indicate that line numbers aren't being calculated
-    tokenizer->line_number = FIX2UINT(start_line_number);
+    tokenizer->start_line_number = FIX2UINT(start_line_number);
     tokenizer->for_liquid_tag = RTEST(for_liquid_tag);
+    // Line numbers are only looked up as needed (e.g. for tags and errors),
+    // so index the newlines once instead of counting them for every token
+    if (tokenizer->start_line_number)
+        build_newline_offsets(tokenizer);
     return Qnil;
 }
 
 // Internal function to setup an existing tokenizer from C for a liquid tag.
 // This overwrites the passed in tokenizer, so a copy of the struct should
 // be used to reset the tokenizer after parsing the liquid tag.
-void tokenizer_setup_for_liquid_tag(tokenizer_t *tokenizer, const char *cursor, const char *cursor_end, int line_number)
+void tokenizer_setup_for_liquid_tag(tokenizer_t *tokenizer, const char *cursor, const char *cursor_end)
 {
     tokenizer->cursor = cursor;
     tokenizer->cursor_end = cursor_end;
     tokenizer->lstrip_flag = false;
-    tokenizer->line_number = line_number;
     tokenizer->for_liquid_tag = true;
 }
 
@@ -101,84 +149,77 @@ static void tokenizer_next_for_liquid_tag(tokenizer_t *tokenizer, token_t *token
     }
 
     tokenizer->cursor = end_full;
-
-    if (tokenizer->line_number) {
-        tokenizer->line_number += count_newlines(token->str_full, end_full);
-    }
 }
 
 // Tokenizes contents of a full Liquid template
 static void tokenizer_next_for_template(tokenizer_t *tokenizer, token_t *token)
 {
     const char *cursor = tokenizer->cursor;
-    const char *last = tokenizer->cursor_end - 1;
+    const char *end = tokenizer->cursor_end;
+    const char *last = end - 1;
 
     token->str_full = cursor;
     token->type = TOKEN_RAW;
 
-    while (cursor < last) {
-        if (*cursor++ != '{')
-            continue;
+    // Raw text is usually the bulk of the source, so skip over it with a
+    // vectorized search for the start of the next tag or variable
+    const char *tag_start = find_byte_pair(cursor, end, '{', '%', '{');
+    if (!tag_start) {
+        cursor = end;
+        token->lstrip = tokenizer->lstrip_flag;
+        tokenizer->lstrip_flag = false;
+        goto found;
+    }
 
-        char c = *cursor++;
-        if (c != '%' && c != '{')
-            continue;
-        if (cursor <= last && *cursor == '-') {
-            cursor++;
-            token->rstrip = 1;
-        }
-        if (cursor - tokenizer->cursor > (ptrdiff_t)(2 + token->rstrip)) {
-            token->type = TOKEN_RAW;
-            cursor -= 2 + token->rstrip;
-            token->lstrip = tokenizer->lstrip_flag;
-            tokenizer->lstrip_flag = false;
+    char c = tag_start[1];
+    cursor = tag_start + 2;
+    if (cursor <= last && *cursor == '-') {
+        cursor++;
+        token->rstrip = 1;
+    }
+    if (tag_start > tokenizer->cursor) {
+        token->type = TOKEN_RAW;
+        cursor = tag_start;
+        token->lstrip = tokenizer->lstrip_flag;
+        tokenizer->lstrip_flag = false;
+        goto found;
+    }
+    tokenizer->lstrip_flag = false;
+    token->type = TOKEN_INVALID;
+    token->lstrip = token->rstrip;
+    token->rstrip = 0;
+    if (c == '%') {
+        const char *tag_end = find_byte_pair(cursor, end, '%', '}', '}');
+        if (tag_end) {
+            cursor = tag_end + 2;
+            token->type = TOKEN_TAG;
+            if (cursor[-3] == '-')
+                token->rstrip = tokenizer->lstrip_flag = true;
             goto found;
         }
+        // unterminated tag
+        cursor = tokenizer->cursor + 2;
         tokenizer->lstrip_flag = false;
-        token->type = TOKEN_INVALID;
-        token->lstrip = token->rstrip;
-        token->rstrip = 0;
-        if (c == '%') {
-            while (cursor < last) {
-                if (*cursor++ != '%')
-                    continue;
-                c = *cursor++;
-                while (c == '%' && cursor <= last)
-                    c = *cursor++;
-                if (c != '}')
-                    continue;
-                token->type = TOKEN_TAG;
-                if(cursor[-3] == '-')
-                    token->rstrip = tokenizer->lstrip_flag = true;
-                goto found;
-            }
-            // unterminated tag
-            cursor = tokenizer->cursor + 2;
-            tokenizer->lstrip_flag = false;
-            goto found;
-        } else {
-            while (cursor < last) {
-                if (*cursor++ != '}')
-                    continue;
-                if (*cursor++ != '}') {
-                    // variable incomplete end, used to end raw tags
-                    cursor--;
-                    goto found;
-                }
-                token->type = TOKEN_VARIABLE;
-                if(cursor[-3] == '-')
-                    token->rstrip = tokenizer->lstrip_flag = true;
+        goto found;
+    } else {
+        const char *variable_end = cursor < last ? memchr(cursor, '}', last - cursor) : NULL;
+        if (variable_end) {
+            cursor = variable_end + 1;
+            if (*cursor != '}') {
+                // variable incomplete end, used to end raw tags
                 goto found;
             }
-            // unterminated variable
-            cursor = tokenizer->cursor + 2;
-            tokenizer->lstrip_flag = false;
+            cursor++;
+            token->type = TOKEN_VARIABLE;
+            if (cursor[-3] == '-')
+                token->rstrip = tokenizer->lstrip_flag = true;
             goto found;
         }
+        // unterminated variable
+        cursor = tokenizer->cursor + 2;
+        tokenizer->lstrip_flag = false;
+        goto found;
     }
-    cursor = last + 1;
-    token->lstrip = tokenizer->lstrip_flag;
-    tokenizer->lstrip_flag = false;
 found:
     token->len_full = cursor - token->str_full;
 
@@ -191,10 +232,6 @@ found:
     }
 
     tokenizer->cursor += token->len_full;
-
-    if (tokenizer->line_number) {
-        tokenizer->line_number += count_newlines(token->str_full, token->str_full + token->len_full);
-    }
 }
 
 void tokenizer_next(tokenizer_t *tokenizer, token_t *token)
@@ -247,10 +284,11 @@ static VALUE tokenizer_line_number_method(VALUE self)
     tokenizer_t *tokenizer;
     Tokenizer_Get_Struct(self, tokenizer);
 
-    if (tokenizer->line_number == 0)
+    unsigned int line_number = tokenizer_line_number(tokenizer);
+    if (line_number == 0)
         return Qnil;
 
-    return UINT2NUM(tokenizer->line_number);
+    return UINT2NUM(line_number);
 }
 
 static VALUE tokenizer_for_liquid_tag_method(VALUE self)
@@ -1,6 +1,8 @@
 #if !defined(LIQUID_TOKENIZER_H)
 #define LIQUID_TOKENIZER_H
 
+#include "c_buffer.h"
+
 enum token_type {
     TOKENIZER_TOKEN_NONE = 0,
     TOKEN_INVALID,
@@ -22,7 +24,10 @@ typedef struct token {
 typedef struct tokenizer {
     VALUE source;
     const char *cursor, *cursor_end;
-    unsigned int line_number;
+    // 0 to indicate that line numbers aren't being calculated
+    unsigned int start_line_number;
+    // uint32_t source offsets of each newline, used to look up line numbers
+    c_buffer_t newline_offsets;
     bool lstrip_flag;
     bool for_liquid_tag;
 
@@ -37,7 +42,14 @@ extern const rb_data_type_t tokenizer_data_type;
 void init_liquid_tokenizer();
 void tokenizer_next(tokenizer_t *tokenizer, token_t *token);
 
-void tokenizer_setup_for_liquid_tag(tokenizer_t *tokenizer, const char *cursor, const char *cursor_end, int line_number);
+void tokenizer_setup_for_liquid_tag(tokenizer_t *tokenizer, const char *cursor, const char *cursor_end);
+unsigned int tokenizer_line_number_at(const tokenizer_t *tokenizer, const char *position);
+
+// Line number at the start of the next token, or 0 if line numbers are disabled
+inline static unsigned int tokenizer_line_number(const tokenizer_t *tokenizer)
+{
+    return tokenizer_line_number_at(tokenizer, tokenizer->cursor);
+}
 
 #endif
 
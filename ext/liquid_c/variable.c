@@ -2,26 +2,28 @@
 #include "variable.h"
 #include "parser.h"
 #include "expression.h"
+#include "stringutil.h"
 #include <stdio.h>
 
-static ID id_rescue_strict_parse_syntax_error;
+static ID id_rescue_strict_parse_syntax_error, id_set_line_number, id_lax_parse, id_error_mode;
 
-static VALUE try_variable_strict_parse(VALUE uncast_args)
-{
-    variable_parse_args_t *parse_args = (void *)uncast_args;
-    parser_t p;
-    init_parser(&p, parse_args->markup, parse_args->markup_end);
-    vm_assembler_t *code = parse_args->code;
+static VALUE sym_lax;
 
-    if (p.cur.type == TOKEN_EOS)
-        return Qnil;
+// Whether Liquid::Variable::JustTagAttributes allows dashes in keyword argument names
+static bool keyword_names_allow_dashes;
 
-    vm_assembler_add_render_variable_rescue(code, parse_args->line_number);
-
-    parse_and_compile_expression(&p, code);
+// Compiles the expression and filters, leaving the value on the stack, or sets the
+// parser's error if they don't strictly parse
+static void parse_and_compile_variable_value(parser_t *p, vm_assembler_t *code)
+{
+    parse_and_compile_expression(p, code);
+    if (parser_failed(p))
+        return;
 
-    while (parser_consume(&p, TOKEN_PIPE).type) {
-        lexer_token_t filter_name_token = parser_must_consume(&p, TOKEN_IDENTIFIER);
+    while (parser_consume(p, TOKEN_PIPE).type) {
+        lexer_token_t filter_name_token = parser_must_consume(p, TOKEN_IDENTIFIER);
+        if (parser_failed(p))
+            return;
         VALUE filter_name = token_to_rsym(filter_name_token);
 
         size_t arg_count = 0;
@@ -29,35 +31,39 @@ static VALUE try_variable_strict_parse(VALUE uncast_args)
         VALUE push_keywords_obj = Qnil;
         vm_assembler_t *push_keywords_code = NULL;
 
-        if (parser_consume(&p, TOKEN_COLON).type) {
+        if (parser_consume(p, TOKEN_COLON).type) {
             do {
-                if (p.cur.type == TOKEN_IDENTIFIER && p.next.type == TOKEN_COLON) {
-                    VALUE key = token_to_rstr(parser_consume_any(&p));
-                    parser_consume_any(&p);
+                if (p->cur.type == TOKEN_IDENTIFIER && p->next.type == TOKEN_COLON) {
+                    VALUE key = token_to_rstr(parser_consume_any(p));
+                    parser_consume_any(p);
 
                     keyword_arg_count++;
 
                     if (push_keywords_obj == Qnil) {
                         expression_t *push_keywords_expr;
-                        // use an object to automatically free on an exception
+                        // use an object to automatically free on an exception or syntax error
                         push_keywords_obj = expression_new(&push_keywords_expr);
                         rb_obj_hide(push_keywords_obj);
                         push_keywords_code = &push_keywords_expr->code;
                     }
 
                     vm_assembler_add_push_const(push_keywords_code, key);
-                    parse_and_compile_expression(&p, push_keywords_code);
+                    parse_and_compile_expression(p, push_keywords_code);
                 } else {
-                    parse_and_compile_expression(&p, code);
+                    parse_and_compile_expression(p, code);
                     arg_count++;
                 }
-            } while (parser_consume(&p, TOKEN_COMMA).type);
+                if (parser_failed(p))
+                    return;
+            } while (parser_consume(p, TOKEN_COMMA).type);
         }
 
         if (keyword_arg_count) {
             arg_count++;
-            if (keyword_arg_count > 255)
-                rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "Too many filter keyword arguments");
+            if (keyword_arg_count > 255) {
+                parser_set_error(p, PARSER_ERROR_TOO_MANY_FILTER_KEYWORD_ARGUMENTS, filter_name_token);
+                return;
+            }
 
             vm_assembler_concat(code, push_keywords_code);
             vm_assembler_add_hash_new(code, keyword_arg_count);
@@ -68,63 +74,373 @@ static VALUE try_variable_strict_parse(VALUE uncast_args)
             rb_gc_force_recycle(push_keywords_obj); // also acts as a RB_GC_GUARD(push_keywords_obj);
         }
         if (arg_count > 254) {
-            rb_enc_raise(utf8_encoding, cLiquidSyntaxError, "Too many filter arguments");
+            parser_set_error(p, PARSER_ERROR_TOO_MANY_FILTER_ARGUMENTS, filter_name_token);
+            return;
         }
         vm_assembler_add_filter(code, filter_name, arg_count);
     }
+}
 
-    vm_assembler_add_pop_write_variable(code);
+static bool try_variable_strict_parse(parser_t *p, variable_parse_args_t *parse_args)
+{
+    init_parser(p, parse_args->markup, parse_args->markup_end);
+    vm_assembler_t *code = parse_args->code;
 
-    parser_must_consume(&p, TOKEN_EOS);
+    if (p->cur.type == TOKEN_EOS)
+        return true;
+
+    vm_assembler_add_render_variable_rescue(code, parse_args->line_number);
+
+    parse_and_compile_variable_value(p, code);
+    if (parser_failed(p))
+        return false;
+
+    vm_assembler_add_pop_write_variable(code);
 
-    return Qnil;
+    parser_must_consume(p, TOKEN_EOS);
+    return !parser_failed(p);
 }
 
-typedef struct variable_strict_parse_rescue {
-    variable_parse_args_t *parse_args;
+// The size of the code before something was compiled into it, to undo a partial compile
+typedef struct code_checkpoint {
     size_t instructions_size;
     size_t constants_size;
+    size_t value_offsets_size;
+    size_t filter_caches_size;
     size_t stack_size;
-} variable_strict_parse_rescue_t;
+} code_checkpoint_t;
 
-static VALUE variable_strict_parse_rescue(VALUE uncast_args, VALUE exception)
+static code_checkpoint_t code_checkpoint(vm_assembler_t *code)
 {
-    variable_strict_parse_rescue_t *rescue_args = (void *)uncast_args;
-    variable_parse_args_t *parse_args = rescue_args->parse_args;
-    vm_assembler_t *code = parse_args->code;
+    code_checkpoint_t checkpoint = {
+        .instructions_size = c_buffer_size(&code->instructions),
+        .constants_size = c_buffer_size(&code->constants),
+        .value_offsets_size = c_buffer_size(&code->value_offsets),
+        .filter_caches_size = c_buffer_size(&code->filter_caches),
+        .stack_size = code->stack_size,
+    };
+    return checkpoint;
+}
+
+static void undo_partial_compile(vm_assembler_t *code, code_checkpoint_t checkpoint)
+{
+    code->instructions.data_end = code->instructions.data + checkpoint.instructions_size;
+    code->constants.data_end = code->constants.data + checkpoint.constants_size;
+    code->value_offsets.data_end = code->value_offsets.data + checkpoint.value_offsets_size;
+    code->filter_caches.data_end = code->filter_caches.data + checkpoint.filter_caches_size;
+    code->stack_size = checkpoint.stack_size;
+}
+
+// The lax parser follows the regular expressions used by Liquid::Variable#lax_parse,
+// including how they match malformed markup, so that variables which don't strictly
+// parse still compile to the same filters and expressions as the Liquid::Variable
+// that would otherwise be rendered instead.
+
+static int is_keyword_name_char(int c)
+{
+    return is_word_char(c) || (c == '-' && keyword_names_allow_dashes);
+}
+
+static int is_word_char_int(int c)
+{
+    return is_word_char(c);
+}
+
+// Returns the end of a run of the units that the last alternative of Liquid::QuotedFragment
+// repeats, which are quoted strings and characters other than whitespace, commas and pipes
+static const char *scan_fragment_units(const char *cur, const char *end)
+{
+    while (cur < end) {
+        char c = *cur;
+        if (c == '"' || c == '\'') {
+            const char *close_quote = memchr(cur + 1, c, end - cur - 1);
+            if (!close_quote)
+                break;
+            cur = close_quote + 1;
+        } else if (c == ',' || c == '|' || rb_isspace(c)) {
+            break;
+        } else {
+            cur++;
+        }
+    }
+    return cur;
+}
+
+// Returns the end of the Liquid::QuotedFragment match at start, or NULL if it doesn't match
+static const char *match_quoted_fragment(const char *start, const char *end)
+{
+    if (start < end && (*start == '"' || *start == '\'')) {
+        const char *close_quote = memchr(start + 1, *start, end - start - 1);
+        return close_quote ? close_quote + 1 : NULL;
+    }
+    const char *match_end = scan_fragment_units(start, end);
+    return match_end == start ? NULL : match_end;
+}
+
+// Returns the end of the Liquid::Variable::FilterParser match at start, which is a run of
+// whitespace, commas and quoted fragments, or start if it doesn't match
+static const char *match_filter(const char *start, const char *end)
+{
+    const char *cur = start;
+    while (cur < end) {
+        if (*cur == ',' || rb_isspace(*cur)) {
+            cur++;
+        } else {
+            const char *fragment_end = match_quoted_fragment(cur, end);
+            if (!fragment_end)
+                break;
+            cur = fragment_end;
+        }
+    }
+    return cur;
+}
+
+typedef struct lax_filter_arg {
+    const char *start, *end;
+    const char *name_end; // end of the keyword argument name, or NULL for a positional argument
+    const char *value_start;
+} lax_filter_arg_t;
+
+// Finds the next Liquid::Variable::FilterArgsRegex match from *cur, then matches the argument
+// against Liquid::Variable::JustTagAttributes to tell if it is a keyword argument.
+// Returns false if there are no more arguments.
+static bool next_filter_arg(const char **cur, const char *end, lax_filter_arg_t *arg)
+{
+    for (const char *separator = *cur; separator < end; separator++) {
+        if (*separator != ':' && *separator != ',')
+            continue;
+        const char *start = read_while(separator + 1, end, rb_isspace);
+        const char *arg_end = NULL;
+        const char *word_end = read_while(start, end, is_word_char_int);
+        if (word_end > start) {
+            const char *colon = read_while(word_end, end, rb_isspace);
+            if (colon < end && *colon == ':')
+                arg_end = match_quoted_fragment(read_while(colon + 1, end, rb_isspace), end);
+        }
+        if (!arg_end)
+            arg_end = match_quoted_fragment(start, end);
+        if (!arg_end)
+            continue;
+
+        arg->start = start;
+        arg->end = arg_end;
+        arg->name_end = NULL;
+        *cur = arg_end;
+
+        if (start < arg_end && is_word_char(*start)) {
+            const char *name_end = read_while(start + 1, arg_end, is_keyword_name_char);
+            const char *colon = read_while(name_end, arg_end, rb_isspace);
+            if (colon < arg_end && *colon == ':') {
+                const char *value_start = read_while(colon + 1, arg_end, rb_isspace);
+                if (value_start < arg_end && scan_fragment_units(value_start, arg_end) == arg_end) {
+                    arg->name_end = name_end;
+                    arg->value_start = value_start;
+                }
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool keyword_arg_name_eq(const lax_filter_arg_t *a, const lax_filter_arg_t *b)
+{
+    long len = a->name_end - a->start;
+    return b->name_end - b->start == len && memcmp(a->start, b->start, len) == 0;
+}
+
+// Compiles a fragment of the markup like Liquid::Expression.parse, which tries to strictly
+// parse it before using the lax Ruby parser. Returns false if the expression can only be
+// parsed into a Ruby object.
+static bool lax_compile_expression(vm_assembler_t *code, const char *start, const char *end)
+{
+    code_checkpoint_t checkpoint = code_checkpoint(code);
+    parser_t p;
+    init_parser(&p, start, end);
+    parse_and_compile_expression(&p, code);
+    parser_must_consume(&p, TOKEN_EOS);
+    if (!parser_failed(&p))
+        return true;
+    undo_partial_compile(code, checkpoint);
+
+    VALUE expression = expression_ruby_parse(rb_enc_str_new(start, end - start, utf8_encoding));
+    if (!expression_inlinable_p(expression))
+        return false;
+    expression_compile_inline(code, expression);
+    return true;
+}
+
+static bool lax_compile_filter(vm_assembler_t *code, const char *start, const char *end)
+{
+    // the first run of word characters, even if it is in an argument
+    const char *name = start;
+    while (name < end && !is_word_char(*name))
+        name++;
+    if (name == end)
+        return true; // ignored, like Liquid::Variable#lax_parse does
+    lexer_token_t name_token = { .val = name, .val_end = read_while(name, end, is_word_char_int) };
+
+    size_t arg_count = 0;
+    size_t keyword_arg_count = 0;
+    lax_filter_arg_t arg;
+    const char *cur = start;
+    while (next_filter_arg(&cur, end, &arg)) {
+        if (arg.name_end) {
+            keyword_arg_count++;
+        } else {
+            if (!lax_compile_expression(code, arg.start, arg.end))
+                return false;
+            arg_count++;
+        }
+    }
+
+    if (keyword_arg_count) {
+        // keyword arguments are collected into a hash, where each name keeps the
+        // position of its first argument and the value of its last one
+        keyword_arg_count = 0;
+        cur = start;
+        while (next_filter_arg(&cur, end, &arg)) {
+            if (!arg.name_end)
+                continue;
+
+            lax_filter_arg_t other;
+            const char *other_cur = start;
+            bool duplicate = false;
+            while (next_filter_arg(&other_cur, end, &other) && other.start < arg.start) {
+                if (other.name_end && keyword_arg_name_eq(&arg, &other)) {
+                    duplicate = true;
+                    break;
+                }
+            }
+            if (duplicate)
+                continue;
 
-    // undo partial strict parse
-    code->instructions.data_end = code->instructions.data + rescue_args->instructions_size;
-    code->constants.data_end = code->constants.data + rescue_args->constants_size;
-    code->stack_size = rescue_args->stack_size;
+            lax_filter_arg_t value_arg = arg;
+            other_cur = cur;
+            while (next_filter_arg(&other_cur, end, &other)) {
+                if (other.name_end && keyword_arg_name_eq(&arg, &other))
+                    value_arg = other;
+            }
 
-    if (rb_obj_is_kind_of(exception, cLiquidSyntaxError) == Qfalse)
-        rb_exc_raise(exception);
+            lexer_token_t key_token = { .val = arg.start, .val_end = arg.name_end };
+            vm_assembler_add_push_const(code, token_to_rstr(key_token));
+            if (!lax_compile_expression(code, value_arg.value_start, value_arg.end))
+                return false;
+            keyword_arg_count++;
+        }
+        if (keyword_arg_count > 255)
+            return false;
+        vm_assembler_add_hash_new(code, keyword_arg_count);
+        arg_count++;
+    }
+    if (arg_count > 254)
+        return false;
 
+    vm_assembler_add_filter(code, token_to_rsym(name_token), arg_count);
+    return true;
+}
+
+// Compiles the markup like Liquid::Variable#lax_parse, leaving the value on the stack.
+// Returns false if one of its expressions can't be compiled, which may leave partially
+// added code.
+static bool lax_compile_variable_value(vm_assembler_t *code, const char *markup, const char *end)
+{
+    const char *name = markup, *name_end = NULL;
+    for (; name < end; name++) {
+        name_end = match_quoted_fragment(name, end);
+        if (name_end)
+            break;
+    }
+    if (!name_end) {
+        vm_assembler_add_push_nil(code);
+        return true;
+    }
+    if (!lax_compile_expression(code, name, name_end))
+        return false;
+
+    const char *pipe = memchr(name_end, '|', end - name_end);
+    if (!pipe)
+        return true;
+
+    const char *cur = read_while(pipe + 1, end, rb_isspace);
+    while (cur < end) {
+        const char *filter_end = match_filter(cur, end);
+        if (filter_end == cur) {
+            cur++;
+            continue;
+        }
+        if (!lax_compile_filter(code, cur, filter_end))
+            return false;
+        cur = filter_end;
+    }
+    return true;
+}
+
+// Returns false if the variable didn't strictly parse, in which case it was
+// either compiled with the lax parser or added as a ruby node, and the
+// parse context's line number was updated
+bool internal_variable_parse(variable_parse_args_t *parse_args)
+{
+    vm_assembler_t *code = parse_args->code;
+    code_checkpoint_t checkpoint = code_checkpoint(code);
+    parser_t p;
+    if (try_variable_strict_parse(&p, parse_args))
+        return true;
+    undo_partial_compile(code, checkpoint);
+
+    VALUE parse_context = parse_args->parse_context;
+    if (parse_args->line_number != 0)
+        rb_funcall(parse_context, id_set_line_number, 1, UINT2NUM(parse_args->line_number));
+
+    // the syntax error is only reported if it isn't ignored in lax mode
     VALUE markup_obj = rb_enc_str_new(parse_args->markup, parse_args->markup_end - parse_args->markup, utf8_encoding);
-    VALUE variable_obj = rb_funcall(
-        cLiquidVariable, id_rescue_strict_parse_syntax_error, 3,
-        exception, markup_obj, parse_args->parse_context
-    );
+    VALUE exception = Qnil;
+    if (rb_funcall(parse_context, id_error_mode, 0) != sym_lax)
+        exception = parser_error_to_exception(&p.error);
+    rb_funcall(cLiquidVariable, id_rescue_strict_parse_syntax_error, 3, exception, markup_obj, parse_context);
 
+    vm_assembler_add_render_variable_rescue(code, parse_args->line_number);
+    if (lax_compile_variable_value(code, parse_args->markup, parse_args->markup_end)) {
+        vm_assembler_add_pop_write_variable(code);
+        return false;
+    }
+    undo_partial_compile(code, checkpoint);
+
+    VALUE variable_obj = rb_funcall(cLiquidVariable, id_lax_parse, 2, markup_obj, parse_context);
     vm_assembler_add_write_node(code, variable_obj);
-    return Qnil;
+    return false;
 }
 
-void internal_variable_parse(variable_parse_args_t *parse_args)
+// Compiles the markup of a Liquid::Variable into code that pushes its value, for tags
+// that use the value of a variable instead of rendering it. Returns false without
+// adding any code if it doesn't strictly parse, so the Liquid::Variable is used instead.
+bool internal_variable_compile_value(variable_parse_args_t *parse_args)
 {
     vm_assembler_t *code = parse_args->code;
-    variable_strict_parse_rescue_t rescue_args = {
-        .parse_args = parse_args,
-        .instructions_size = c_buffer_size(&code->instructions),
-        .constants_size = c_buffer_size(&code->constants),
-        .stack_size = code->stack_size,
-    };
-    rb_rescue(try_variable_strict_parse, (VALUE)parse_args, variable_strict_parse_rescue, (VALUE)&rescue_args);
+    code_checkpoint_t checkpoint = code_checkpoint(code);
+    parser_t p;
+    init_parser(&p, parse_args->markup, parse_args->markup_end);
+
+    parse_and_compile_variable_value(&p, code);
+    parser_must_consume(&p, TOKEN_EOS);
+
+    if (!parser_failed(&p))
+        return true;
+    undo_partial_compile(code, checkpoint);
+    return false;
 }
 
 void init_liquid_variable(void)
 {
     id_rescue_strict_parse_syntax_error = rb_intern("rescue_strict_parse_syntax_error");
-}
+    id_set_line_number = rb_intern("line_number=");
+    id_lax_parse = rb_intern("lax_parse");
+    id_error_mode = rb_intern("error_mode");
+
+    sym_lax = ID2SYM(rb_intern("lax"));
 
+    // newer versions of liquid allow dashes after the first character of keyword argument names
+    VALUE just_tag_attributes = rb_const_get(cLiquidVariable, rb_intern("JustTagAttributes"));
+    keyword_names_allow_dashes = RTEST(rb_funcall(just_tag_attributes, rb_intern("match?"), 1,
+                rb_str_new_literal("a-b:c")));
+}
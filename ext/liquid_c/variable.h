@@ -12,7 +12,8 @@ typedef struct variable_parse_args {
 } variable_parse_args_t;
 
 void init_liquid_variable(void);
-void internal_variable_parse(variable_parse_args_t *parse_args);
+bool internal_variable_parse(variable_parse_args_t *parse_args);
+bool internal_variable_compile_value(variable_parse_args_t *parse_args);
 
 #endif
 
@@ -1,11 +1,19 @@
 #include <stdint.h>
 #include <assert.h>
+#include <float.h>
+#include <math.h>
 
 #include "liquid.h"
 #include "vm.h"
 #include "resource_limits.h"
 #include "context.h"
 #include "variable_lookup.h"
+#include "standard_filters.h"
+#include "condition.h"
+#include "for.h"
+#include "assign.h"
+#include "partial.h"
+#include "number.h"
 
 ID id_render_node;
 ID id_ivar_interrupts;
@@ -16,10 +24,16 @@ ID id_filter_methods_hash;
 ID id_strict_filters;
 ID id_global_filter;
 
+static ID id_registers, id_push, id_pop, id_aref, id_to_a, id_increment, id_to_i, id_join, id_plus, id_minus;
+static VALUE sym_for, sym_for_stack, sym_cycle, sym_ifchanged;
+
 static VALUE cLiquidCVM;
 
 typedef struct vm {
     c_buffer_t stack;
+    c_buffer_t loops; // vm_loop_t of the inlined loops being rendered
+    c_buffer_t captures; // vm_capture_t of the inlined captures being rendered
+    VALUE capture_buffers; // output strings reused by the captures at each depth
     VALUE strainer;
     VALUE filter_methods;
     VALUE interrupts;
@@ -28,37 +42,65 @@ typedef struct vm {
     VALUE global_filter;
     bool strict_filters;
     bool invoking_filter;
+    VALUE self; // for the write barriers of the references above
 } vm_t;
 
 static void vm_mark(void *ptr)
 {
     vm_t *vm = ptr;
 
-    c_buffer_rb_gc_mark(&vm->stack);
-    rb_gc_mark(vm->strainer);
-    rb_gc_mark(vm->filter_methods);
-    rb_gc_mark(vm->interrupts);
-    rb_gc_mark(vm->resource_limits_obj);
-    rb_gc_mark(vm->global_filter);
+    c_buffer_rb_gc_mark_movable(&vm->stack);
+    rb_gc_mark_movable(vm->capture_buffers);
+    rb_gc_mark_movable(vm->strainer);
+    rb_gc_mark_movable(vm->filter_methods);
+    rb_gc_mark_movable(vm->interrupts);
+    rb_gc_mark_movable(vm->resource_limits_obj);
+    rb_gc_mark_movable(vm->global_filter);
 }
 
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void vm_compact_loops_and_captures(vm_t *vm);
+
+static void vm_compact(void *ptr)
+{
+    vm_t *vm = ptr;
+
+    c_buffer_rb_gc_update_references(&vm->stack);
+    vm->capture_buffers = rb_gc_location(vm->capture_buffers);
+    vm->strainer = rb_gc_location(vm->strainer);
+    vm->filter_methods = rb_gc_location(vm->filter_methods);
+    vm->interrupts = rb_gc_location(vm->interrupts);
+    vm->resource_limits_obj = rb_gc_location(vm->resource_limits_obj);
+    vm->global_filter = rb_gc_location(vm->global_filter);
+    vm->self = rb_gc_location(vm->self);
+    vm_compact_loops_and_captures(vm);
+}
+#endif
+
 static void vm_free(void *ptr)
 {
     vm_t *vm = ptr;
     c_buffer_free(&vm->stack);
+    c_buffer_free(&vm->loops);
+    c_buffer_free(&vm->captures);
     xfree(vm);
 }
 
 static size_t vm_memsize(const void *ptr)
 {
     const vm_t *vm = ptr;
-    return sizeof(vm_t) + c_buffer_capacity(&vm->stack);
+    return sizeof(vm_t) + c_buffer_capacity(&vm->stack) + c_buffer_capacity(&vm->loops) +
+        c_buffer_capacity(&vm->captures);
 }
 
 const rb_data_type_t vm_data_type = {
     "liquid_vm",
-    { vm_mark, vm_free, vm_memsize, },
-    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+    { vm_mark, vm_free, vm_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+        vm_compact,
+#endif
+    },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
 };
 
 static VALUE vm_internal_new(VALUE context)
@@ -66,21 +108,30 @@ static VALUE vm_internal_new(VALUE context)
     vm_t *vm;
     VALUE obj = TypedData_Make_Struct(cLiquidCVM, vm_t, &vm_data_type, vm);
     vm->stack = c_buffer_init();
-
-    vm->strainer = rb_funcall(context, id_strainer, 0);
+    vm->loops = c_buffer_init();
+    vm->captures = c_buffer_init();
+    vm->capture_buffers = Qnil;
+    vm->strainer = Qnil;
+    vm->filter_methods = Qnil;
+    vm->interrupts = Qnil;
+    vm->resource_limits_obj = Qnil;
+    vm->global_filter = Qnil;
+    vm->self = obj;
+
+    RB_OBJ_WRITE(obj, &vm->strainer, rb_funcall(context, id_strainer, 0));
     Check_Type(vm->strainer, T_OBJECT);
 
-    vm->filter_methods = rb_funcall(RBASIC_CLASS(vm->strainer), id_filter_methods_hash, 0);
+    RB_OBJ_WRITE(obj, &vm->filter_methods, rb_funcall(RBASIC_CLASS(vm->strainer), id_filter_methods_hash, 0));
     Check_Type(vm->filter_methods, T_HASH);
 
-    vm->interrupts = rb_ivar_get(context, id_ivar_interrupts);
+    RB_OBJ_WRITE(obj, &vm->interrupts, rb_ivar_get(context, id_ivar_interrupts));
     Check_Type(vm->interrupts, T_ARRAY);
 
-    vm->resource_limits_obj = rb_ivar_get(context, id_ivar_resource_limits);;
+    RB_OBJ_WRITE(obj, &vm->resource_limits_obj, rb_ivar_get(context, id_ivar_resource_limits));
     ResourceLimits_Get_Struct(vm->resource_limits_obj, vm->resource_limits);
 
     vm->strict_filters = RTEST(rb_funcall(context, id_strict_filters, 0));
-    vm->global_filter = rb_funcall(context, id_global_filter, 0);
+    RB_OBJ_WRITE(obj, &vm->global_filter, rb_funcall(context, id_global_filter, 0));
     vm->invoking_filter = false;
     return obj;
 }
@@ -105,23 +156,154 @@ bool liquid_vm_filtering(VALUE context)
     return vm->invoking_filter;
 }
 
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Large enough for any int64_t, including the sign
+#define INT64_FORMAT_MAX_LEN 20
+
+// Writes the decimal digits backwards from buf_end, two at a time, and returns
+// a pointer to the first one.
+static char *format_uint64(char *buf_end, uint64_t number)
+{
+    char *cur = buf_end;
+    while (number >= 100) {
+        const char *pair = digit_pairs + (number % 100) * 2;
+        number /= 100;
+        *--cur = pair[1];
+        *--cur = pair[0];
+    }
+    if (number >= 10) {
+        const char *pair = digit_pairs + number * 2;
+        *--cur = pair[1];
+        *--cur = pair[0];
+    } else {
+        *--cur = (char)('0' + number);
+    }
+    return cur;
+}
+
 static void write_fixnum(VALUE output, VALUE fixnum)
 {
-    long long number = RB_NUM2LL(fixnum);
-    int write_length = snprintf(NULL, 0, "%lld", number);
-    long old_size = RSTRING_LEN(output);
-    long new_size = old_size + write_length;
-    long capacity = rb_str_capacity(output);
+    char buf[INT64_FORMAT_MAX_LEN];
+    char *buf_end = buf + sizeof(buf);
+    long number = FIX2LONG(fixnum);
+
+    char *start = format_uint64(buf_end, number < 0 ? -(unsigned long)number : (unsigned long)number);
+    if (number < 0)
+        *--start = '-';
+    rb_str_cat(output, start, buf_end - start);
+}
+
+// Keeps the mantissa small enough that at most one decimal with the same number
+// of fraction digits converts back to the float, so the decimal with the fewest
+// fraction digits that does is also what Float#to_s's shortest round-trip
+// formatting produces.
+#define MAX_SHORT_FLOAT_MANTISSA (1LL << 50)
+#define MAX_SHORT_FLOAT_FRACTION_DIGITS 17
+// Float#to_s switches to scientific notation outside of this range of decimal
+// point positions relative to the first digit.
+#define FLOAT_DECIMAL_POINT_MIN -3
+#define FLOAT_DECIMAL_POINT_MAX DBL_DIG
+// Sign, digits, decimal point and the padding or exponent around them
+#define FLOAT_FORMAT_MAX_LEN 48
+
+// Formats the float the same way as Float#to_s into buf, returning the length,
+// or returns 0 if it doesn't have a short enough decimal representation.
+static int format_float(char *buf, double value)
+{
+    char *cur = buf;
+
+    if (isnan(value))
+        return sprintf(buf, "NaN");
+    if (signbit(value))
+        *cur++ = '-';
+    if (isinf(value))
+        return (int)(cur - buf) + sprintf(cur, "Infinity");
+
+    uint64_t mantissa = 0;
+    int fraction_digits = 0;
+    if (value != 0) {
+        for (;; fraction_digits++) {
+            if (fraction_digits > MAX_SHORT_FLOAT_FRACTION_DIGITS)
+                return 0;
+            double scaled = round(fabs(value) * exact_powers_of_ten[fraction_digits]);
+            if (scaled >= MAX_SHORT_FLOAT_MANTISSA)
+                return 0;
+            if (scaled / exact_powers_of_ten[fraction_digits] == fabs(value)) {
+                mantissa = (uint64_t)scaled;
+                break;
+            }
+        }
+    }
 
-    if (new_size > capacity) {
-        do {
-            capacity *= 2;
-        } while (new_size > capacity);
-        rb_str_resize(output, capacity);
+    char digits_buf[INT64_FORMAT_MAX_LEN];
+    char *digits_end = digits_buf + sizeof(digits_buf);
+    char *digits = format_uint64(digits_end, mantissa);
+    int decimal_point = (int)(digits_end - digits) - fraction_digits;
+    if (mantissa == 0)
+        decimal_point = 1;
+    while (digits_end - digits > 1 && digits_end[-1] == '0')
+        digits_end--;
+    int num_digits = (int)(digits_end - digits);
+
+    if (decimal_point > 0 && decimal_point <= FLOAT_DECIMAL_POINT_MAX) {
+        if (decimal_point < num_digits) {
+            // 12.34
+            memcpy(cur, digits, decimal_point);
+            cur += decimal_point;
+            *cur++ = '.';
+            memcpy(cur, digits + decimal_point, num_digits - decimal_point);
+            cur += num_digits - decimal_point;
+        } else {
+            // 1200.0
+            memcpy(cur, digits, num_digits);
+            cur += num_digits;
+            memset(cur, '0', decimal_point - num_digits);
+            cur += decimal_point - num_digits;
+            *cur++ = '.';
+            *cur++ = '0';
+        }
+    } else if (decimal_point <= 0 && decimal_point >= FLOAT_DECIMAL_POINT_MIN) {
+        // 0.0012
+        *cur++ = '0';
+        *cur++ = '.';
+        memset(cur, '0', -decimal_point);
+        cur += -decimal_point;
+        memcpy(cur, digits, num_digits);
+        cur += num_digits;
+    } else {
+        // 1.2e+16
+        *cur++ = digits[0];
+        *cur++ = '.';
+        if (num_digits > 1) {
+            memcpy(cur, digits + 1, num_digits - 1);
+            cur += num_digits - 1;
+        } else {
+            *cur++ = '0';
+        }
+        cur += sprintf(cur, "e%+03d", decimal_point - 1);
     }
-    rb_str_set_len(output, new_size);
+    return (int)(cur - buf);
+}
 
-    snprintf(RSTRING_PTR(output) + old_size, write_length + 1, "%lld", number);
+static bool write_float(VALUE output, VALUE flt)
+{
+    char buf[FLOAT_FORMAT_MAX_LEN];
+    int length = format_float(buf, RFLOAT_VALUE(flt));
+    if (length == 0)
+        return false;
+    rb_str_cat(output, buf, length);
+    return true;
 }
 
 static VALUE obj_to_s(VALUE obj)
@@ -138,6 +320,10 @@ static VALUE obj_to_s(VALUE obj)
 static void write_obj(VALUE output, VALUE obj)
 {
     switch (TYPE(obj)) {
+        case T_FLOAT:
+            if (write_float(output, obj))
+                break;
+            // fallthrough
         default:
             obj = obj_to_s(obj);
             // fallthrough
@@ -147,6 +333,12 @@ static void write_obj(VALUE output, VALUE obj)
         case T_FIXNUM:
             write_fixnum(output, obj);
             break;
+        case T_TRUE:
+            rb_str_cat(output, "true", 4);
+            break;
+        case T_FALSE:
+            rb_str_cat(output, "false", 5);
+            break;
         case T_ARRAY:
             for (long i = 0; i < RARRAY_LEN(obj); i++)
             {
@@ -172,6 +364,7 @@ static inline void vm_stack_push(vm_t *vm, VALUE value)
     assert(stack_ptr < (VALUE *)vm->stack.capacity_end);
     *stack_ptr++ = value;
     vm->stack.data_end = (uint8_t *)stack_ptr;
+    RB_OBJ_WRITTEN(vm->self, Qundef, value);
 }
 
 static inline VALUE vm_stack_pop(vm_t *vm)
@@ -197,32 +390,66 @@ static inline void vm_stack_reserve_for_write(vm_t *vm, size_t num_values)
     c_buffer_reserve_for_write(&vm->stack, num_values * sizeof(VALUE));
 }
 
-static VALUE vm_invoke_filter(vm_t *vm, VALUE filter_name, int num_args, VALUE *args)
+static inline VALUE filter_result_to_liquid(VALUE result)
 {
-    bool not_invokable = rb_hash_lookup(vm->filter_methods, filter_name) != Qtrue;
-    if (RB_UNLIKELY(not_invokable)) {
-        if (vm->strict_filters) {
-            VALUE error_class = rb_const_get(mLiquid, rb_intern("UndefinedFilter"));
-            rb_raise(error_class, "undefined filter %"PRIsVALUE, rb_sym2str(filter_name));
+    // Scalar types stored directly in the VALUE and these basic types
+    // all have a #to_liquid that returns self
+    if (RB_SPECIAL_CONST_P(result))
+        return result;
+
+    VALUE klass = RBASIC(result)->klass;
+    if (klass == rb_cString || klass == rb_cInteger || klass == rb_cFloat)
+        return result;
+
+    return rb_funcall(result, id_to_liquid, 0);
+}
+
+// The OP_FILTER instruction's inline cache holds the strainer class that the filter
+// was last found to be invokable on, so the filter methods hash and whether the filter
+// has a native implementation only need to be checked again for a different strainer.
+static VALUE vm_invoke_filter(vm_t *vm, VALUE context, VALUE filter_name, filter_cache_t *cache, VALUE code_owner,
+        int num_args, VALUE *args)
+{
+    VALUE strainer_class = RBASIC_CLASS(vm->strainer);
+    if (RB_UNLIKELY(cache->strainer_class != strainer_class)) {
+        bool not_invokable = rb_hash_lookup(vm->filter_methods, filter_name) != Qtrue;
+        if (RB_UNLIKELY(not_invokable)) {
+            if (vm->strict_filters) {
+                VALUE error_class = rb_const_get(mLiquid, rb_intern("UndefinedFilter"));
+                rb_raise(error_class, "undefined filter %"PRIsVALUE, rb_sym2str(filter_name));
+            }
+            return args[0];
         }
-        return args[0];
+        cache->native_filter = native_filter_for_strainer(vm->strainer, filter_name);
+        RB_OBJ_WRITE(code_owner, &cache->strainer_class, strainer_class);
     }
 
     vm->invoking_filter = true;
-    VALUE result = rb_funcallv(vm->strainer, RB_SYM2ID(filter_name), num_args, args);
+    VALUE result = Qundef;
+    const native_filter_t *native_filter = cache->native_filter;
+    if (native_filter && num_args >= native_filter->min_argc && num_args <= native_filter->max_argc)
+        result = native_filter->func(context, num_args, args);
+    if (result == Qundef)
+        result = rb_funcallv(vm->strainer, RB_SYM2ID(filter_name), num_args, args);
     vm->invoking_filter = false;
-    return rb_funcall(result, id_to_liquid, 0);
+    return filter_result_to_liquid(result);
 }
 
 typedef struct vm_render_until_error_args {
     vm_t *vm;
     const uint8_t *ip; // use for initial address and to save an address for rescuing
     const size_t *const_ptr;
+    VALUE code_owner; // the object that holds the code, for the write barriers of its filter caches
     VALUE context;
 
     /* rendering fields */
     VALUE output;
     const uint8_t *node_line_number;
+    const uint8_t *tag_resume_ip; // where to resume rendering if an inlined tag raises, or NULL
+    const size_t *tag_resume_const_ptr;
+    bool tag_blank;
+    size_t loop_base; // number of inlined loops started outside of this render
+    size_t capture_base; // number of inlined captures started outside of this render
 } vm_render_until_error_args_t;
 
 static VALUE raise_invalid_integer(VALUE unused_arg, VALUE exc)
@@ -250,6 +477,439 @@ static VALUE range_value_to_integer(VALUE value)
     }
 }
 
+// Equivalent to Liquid::Utils.to_integer
+static VALUE to_integer(VALUE value)
+{
+    if (RB_INTEGER_TYPE_P(value))
+        return value;
+    value = obj_to_s(value);
+    return rb_rescue2(try_string_to_integer, value, raise_invalid_integer, Qnil, rb_eArgError, (VALUE)0);
+}
+
+static VALUE integer_plus(VALUE left, VALUE right)
+{
+    if (RB_FIXNUM_P(left) && RB_FIXNUM_P(right))
+        return LONG2NUM(FIX2LONG(left) + FIX2LONG(right));
+    return rb_funcall(left, '+', 1, right);
+}
+
+// Converts an Integer to the closest long, which is close enough for indexes
+static long integer_to_long_clamped(VALUE value)
+{
+    if (RB_FIXNUM_P(value))
+        return FIX2LONG(value);
+    return rb_big2dbl(value) < 0 ? LONG_MIN : LONG_MAX;
+}
+
+// Computes the [start, stop) indexes of the items of a collection of the given size
+// that Liquid::Utils.slice_collection returns.
+static void slice_bounds(long size, VALUE from, VALUE to, long *start_ptr, long *stop_ptr)
+{
+    long start = integer_to_long_clamped(from);
+    if (start < 0)
+        start = 0;
+    else if (start > size)
+        start = size;
+
+    long stop = to == Qnil ? size : integer_to_long_clamped(to);
+    if (stop > size)
+        stop = size;
+    else if (stop < start)
+        stop = start;
+
+    *start_ptr = start;
+    *stop_ptr = stop;
+}
+
+// Equivalent to the segment that Liquid::For gets from Liquid::Utils.slice_collection
+// before reversing it, which only has a fast path for arrays since slicing other
+// collections depends on them.
+static VALUE slice_collection(VALUE collection, VALUE from, VALUE to)
+{
+    if (rb_obj_is_kind_of(collection, rb_cRange))
+        collection = rb_funcall(collection, id_to_a, 0);
+
+    if (!RB_SPECIAL_CONST_P(collection) && RBASIC_CLASS(collection) == rb_cArray) {
+        long start, stop;
+        slice_bounds(RARRAY_LEN(collection), from, to, &start, &stop);
+        return rb_ary_subseq(collection, start, stop - start);
+    }
+    return rb_Array(for_slice_collection(collection, from, to));
+}
+
+// State of an inlined for loop. Its Ruby objects are in the FOR_LOOP_NUM_STACK_VALUES
+// values at the top of the stack while the loop is started, and it can be left with
+// break or continue by jumping to its OP_FOR_NEXT instruction.
+typedef struct vm_loop {
+    size_t stack_byte_size; // including the loop's stack values
+    VALUE variable_name;
+    long index; // number of iterations started
+    long length;
+    long range_begin; // first item, if the segment isn't an array
+    bool reversed;
+    const uint8_t *next_ip;
+    const size_t *next_const_ptr;
+} vm_loop_t;
+
+enum vm_loop_stack_value {
+    LOOP_SEGMENT, // array of items, or nil for an integer range
+    LOOP_SCOPE,
+    LOOP_FORLOOP, // Liquid::ForloopDrop, or nil if the body doesn't use it
+    LOOP_FOR_STACK, // for_stack register the forloop object was pushed on, or nil
+};
+
+static inline size_t vm_loop_depth(vm_t *vm)
+{
+    return c_buffer_size(&vm->loops) / sizeof(vm_loop_t);
+}
+
+static inline vm_loop_t *vm_current_loop(vm_t *vm)
+{
+    assert(vm_loop_depth(vm) > 0);
+    return (vm_loop_t *)vm->loops.data_end - 1;
+}
+
+static inline VALUE *vm_loop_stack_values(vm_t *vm, vm_loop_t *loop)
+{
+    return (VALUE *)(vm->stack.data + loop->stack_byte_size) - FOR_LOOP_NUM_STACK_VALUES;
+}
+
+static VALUE registers_fetch_or_set(VALUE registers, VALUE key, VALUE default_value)
+{
+    VALUE value = rb_funcall(registers, id_aref, 1, key);
+    if (RTEST(value))
+        return value;
+    rb_funcall(registers, id_aset, 2, key, default_value);
+    return default_value;
+}
+
+static VALUE context_push_scope(VALUE uncast_args)
+{
+    VALUE *args = (VALUE *)uncast_args;
+    return rb_funcall(args[0], id_push, 1, args[1]);
+}
+
+// Pops the offset, collection and limit values from the stack to start the loop over
+// the segment of the collection, the way Liquid::For#render_to_output_buffer does, but
+// without creating a Liquid::ForloopDrop unless the FOR_LOOP_FORLOOP flag is set.
+// Returns false without starting the loop if the segment is empty.
+static bool vm_start_loop(vm_t *vm, VALUE context, uint8_t flags, VALUE variable_name, VALUE loop_name,
+        const uint8_t *next_ip, const size_t *next_const_ptr)
+{
+    VALUE limit_value = vm_stack_pop(vm);
+    VALUE collection = Qnil, range_begin = Qnil, range_end = Qnil;
+    if (flags & FOR_LOOP_INT_RANGE) {
+        range_end = vm_stack_pop(vm);
+        range_begin = vm_stack_pop(vm);
+    } else {
+        collection = vm_stack_pop(vm);
+    }
+    VALUE from_value = vm_stack_pop(vm);
+
+    // convert the values in the order Liquid::For evaluates them
+    VALUE registers = rb_funcall(context, id_registers, 0);
+    VALUE offsets = registers_fetch_or_set(registers, sym_for, rb_hash_new());
+    VALUE from = from_value == Qnil ? INT2FIX(0) : to_integer(from_value);
+    if (flags & FOR_LOOP_INT_RANGE) {
+        range_end = range_value_to_integer(range_end);
+        range_begin = range_value_to_integer(range_begin);
+    }
+    VALUE to = limit_value == Qnil ? Qnil : integer_plus(to_integer(limit_value), from);
+
+    vm_loop_t loop = {
+        .variable_name = variable_name,
+        .reversed = flags & FOR_LOOP_REVERSED,
+        .next_ip = next_ip,
+        .next_const_ptr = next_const_ptr,
+    };
+    VALUE segment = Qnil;
+    if (RB_FIXNUM_P(range_begin) && RB_FIXNUM_P(range_end)) {
+        long first = FIX2LONG(range_begin), last = FIX2LONG(range_end);
+        long size = last < first ? 0 : last - first < LONG_MAX ? last - first + 1 : LONG_MAX;
+        long start, stop;
+        slice_bounds(size, from, to, &start, &stop);
+        loop.range_begin = first + start;
+        loop.length = stop - start;
+    } else {
+        if (flags & FOR_LOOP_INT_RANGE)
+            collection = rb_range_new(range_begin, range_end, false);
+        segment = slice_collection(collection, from, to);
+        loop.length = RARRAY_LEN(segment);
+    }
+    rb_funcall(offsets, id_aset, 2, loop_name, integer_plus(from, LONG2NUM(loop.length)));
+
+    if (loop.length == 0)
+        return false;
+
+    VALUE for_stack = registers_fetch_or_set(registers, sym_for_stack, rb_ary_new());
+    VALUE forloop = Qnil;
+    if (flags & FOR_LOOP_FORLOOP) {
+        Check_Type(for_stack, T_ARRAY);
+        VALUE forloop_args[3] = { loop_name, LONG2NUM(loop.length), rb_ary_entry(for_stack, -1) };
+        forloop = rb_class_new_instance(3, forloop_args, cLiquidForloopDrop);
+    }
+
+    // Liquid::Context#stack pops the scope even if pushing it raises from the nesting being too deep
+    VALUE scope = rb_hash_new();
+    VALUE push_args[2] = { context, scope };
+    int state = 0;
+    rb_protect(context_push_scope, (VALUE)push_args, &state);
+    if (state) {
+        rb_funcall(context, id_pop, 0);
+        rb_jump_tag(state);
+    }
+
+    if (forloop != Qnil) {
+        rb_ary_push(for_stack, forloop);
+        rb_hash_aset(scope, forloop_variable_name, forloop);
+    } else {
+        for_stack = Qnil; // not pushed on
+    }
+
+    vm_stack_push(vm, segment);
+    vm_stack_push(vm, scope);
+    vm_stack_push(vm, forloop);
+    vm_stack_push(vm, for_stack);
+    loop.stack_byte_size = c_buffer_size(&vm->stack);
+    c_buffer_write(&vm->loops, &loop, sizeof(loop));
+    return true;
+}
+
+// Assigns the loop variable to the next item of the innermost loop. Returns false if
+// the loop is done instead.
+static bool vm_loop_next(vm_t *vm)
+{
+    vm_loop_t *loop = vm_current_loop(vm);
+    VALUE *loop_values = vm_loop_stack_values(vm, loop);
+
+    if (loop->index > 0 && loop_values[LOOP_FORLOOP] != Qnil) {
+        rb_funcall(loop_values[LOOP_FORLOOP], id_increment, 0);
+        loop = vm_current_loop(vm);
+        loop_values = vm_loop_stack_values(vm, loop);
+    }
+    if (loop->index >= loop->length)
+        return false;
+
+    long i = loop->reversed ? loop->length - 1 - loop->index : loop->index;
+    VALUE segment = loop_values[LOOP_SEGMENT];
+    VALUE item = segment == Qnil ? LONG2FIX(loop->range_begin + i) : rb_ary_entry(segment, i);
+    loop->index++;
+    rb_hash_aset(loop_values[LOOP_SCOPE], loop->variable_name, item);
+    return true;
+}
+
+// Ends the innermost loop, the way Liquid::For#render_segment does after looping
+static void vm_end_loop(vm_t *vm, VALUE context)
+{
+    vm_loop_t *loop = vm_current_loop(vm);
+    VALUE *loop_values = vm_loop_stack_values(vm, loop);
+    VALUE for_stack = loop_values[LOOP_FOR_STACK];
+
+    vm->stack.data_end = (uint8_t *)loop_values;
+    vm->loops.data_end -= sizeof(vm_loop_t);
+
+    if (for_stack != Qnil)
+        rb_ary_pop(for_stack);
+    rb_funcall(context, id_pop, 0);
+}
+
+// State of an inlined capture. The output it replaced is the value at the top of the
+// stack while the capture is started.
+typedef struct vm_capture {
+    size_t stack_byte_size; // including the replaced output
+    size_t loop_depth; // number of inlined loops started when the capture started
+    long old_capture_length;
+    VALUE variable_name; // or nil for an inlined Liquid::Ifchanged tag
+} vm_capture_t;
+
+static inline size_t vm_capture_depth(vm_t *vm)
+{
+    return c_buffer_size(&vm->captures) / sizeof(vm_capture_t);
+}
+
+static inline vm_capture_t *vm_current_capture(vm_t *vm)
+{
+    assert(vm_capture_depth(vm) > 0);
+    return (vm_capture_t *)vm->captures.data_end - 1;
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+// The variable names are constants of the code being rendered, which keeps them alive
+static void vm_compact_loops_and_captures(vm_t *vm)
+{
+    vm_loop_t *loops_end = (vm_loop_t *)vm->loops.data_end;
+    for (vm_loop_t *loop = (vm_loop_t *)vm->loops.data; loop < loops_end; loop++) {
+        loop->variable_name = rb_gc_location(loop->variable_name);
+    }
+    vm_capture_t *captures_end = (vm_capture_t *)vm->captures.data_end;
+    for (vm_capture_t *capture = (vm_capture_t *)vm->captures.data; capture < captures_end; capture++) {
+        capture->variable_name = rb_gc_location(capture->variable_name);
+    }
+}
+#endif
+
+// Returns the empty capture buffer for the next capture, which is only reused by captures
+// at the same depth, since their output is copied when they end.
+static VALUE vm_capture_buffer(vm_t *vm)
+{
+    long depth = (long)vm_capture_depth(vm);
+    if (vm->capture_buffers == Qnil)
+        RB_OBJ_WRITE(vm->self, &vm->capture_buffers, rb_ary_new());
+
+    VALUE buffer = rb_ary_entry(vm->capture_buffers, depth);
+    if (buffer == Qnil) {
+        buffer = rb_enc_str_new(NULL, 0, utf8_encoding);
+        rb_ary_store(vm->capture_buffers, depth, buffer);
+    } else {
+        rb_str_set_len(buffer, 0);
+        if (RB_ENCODING_GET_INLINED(buffer) != utf8_encoding_index)
+            rb_enc_associate_index(buffer, utf8_encoding_index);
+    }
+    return buffer;
+}
+
+// Renders into a capture buffer the way Liquid::Capture#render_to_output_buffer does,
+// with the resource limits counting the captured output towards the assign score,
+// or without a variable name the way Liquid::Ifchanged renders its body.
+static void vm_start_capture(vm_t *vm, vm_render_until_error_args_t *args, VALUE variable_name)
+{
+    VALUE buffer = vm_capture_buffer(vm);
+    vm_stack_push(vm, args->output);
+
+    vm_capture_t capture = {
+        .stack_byte_size = c_buffer_size(&vm->stack),
+        .loop_depth = vm_loop_depth(vm),
+        .old_capture_length = vm->resource_limits->last_capture_length,
+        .variable_name = variable_name,
+    };
+    c_buffer_write(&vm->captures, &capture, sizeof(capture));
+
+    if (variable_name != Qnil)
+        vm->resource_limits->last_capture_length = 0;
+    args->output = buffer;
+}
+
+static VALUE str_copy(VALUE str)
+{
+    VALUE copy = rb_str_new(RSTRING_PTR(str), RSTRING_LEN(str));
+    rb_enc_copy(copy, str);
+    return copy;
+}
+
+// Ends the innermost capture, restoring the output it replaced. The captured output is
+// assigned, or written if it changed for an ifchanged tag, unless the capture is ended by
+// an exception.
+static void vm_end_capture(vm_t *vm, vm_render_until_error_args_t *args, bool complete)
+{
+    vm_capture_t capture = *vm_current_capture(vm);
+    VALUE buffer = args->output;
+    VALUE *output_ptr = (VALUE *)(vm->stack.data + capture.stack_byte_size) - 1;
+
+    args->output = *output_ptr;
+    vm->stack.data_end = (uint8_t *)output_ptr;
+    vm->captures.data_end -= sizeof(vm_capture_t);
+    if (capture.variable_name == Qnil) {
+        if (!complete)
+            return;
+        VALUE registers = rb_funcall(args->context, id_registers, 0);
+        VALUE last_output = rb_funcall(registers, id_aref, 1, sym_ifchanged);
+        if (RTEST(rb_str_equal(buffer, last_output)))
+            return;
+        VALUE changed_output = str_copy(buffer);
+        rb_str_set_len(buffer, 0);
+        rb_funcall(registers, id_aset, 2, sym_ifchanged, changed_output);
+        rb_str_append(args->output, changed_output);
+        return;
+    }
+
+    vm->resource_limits->last_capture_length = capture.old_capture_length;
+    if (complete) {
+        VALUE captured = str_copy(buffer);
+        rb_str_set_len(buffer, 0);
+        context_set_last_scope_variable(args->context, capture.variable_name, captured);
+    }
+}
+
+static VALUE hash_aref(VALUE hash, VALUE key)
+{
+    if (RB_LIKELY(RB_TYPE_P(hash, T_HASH)))
+        return rb_hash_aref(hash, key);
+    return rb_funcall(hash, id_aref, 1, key);
+}
+
+static void hash_aset(VALUE hash, VALUE key, VALUE value)
+{
+    if (RB_LIKELY(RB_TYPE_P(hash, T_HASH))) {
+        rb_hash_aset(hash, key, value);
+    } else {
+        rb_funcall(hash, id_aset, 2, key, value);
+    }
+}
+
+// Equivalent to Liquid::Increment and Liquid::Decrement, returning the value they render
+static VALUE vm_update_counter(VALUE context, VALUE variable_name, bool increment)
+{
+    VALUE environment = context_first_environment(context);
+    VALUE value = hash_aref(environment, variable_name);
+    if (!RTEST(value))
+        value = RB_INT2FIX(0);
+
+    VALUE new_value;
+    if (RB_FIXNUM_P(value)) {
+        new_value = RB_LONG2NUM(RB_FIX2LONG(value) + (increment ? 1 : -1));
+    } else {
+        new_value = rb_funcall(value, increment ? id_plus : id_minus, 1, RB_INT2FIX(1));
+    }
+    hash_aset(environment, variable_name, new_value);
+    return increment ? value : new_value;
+}
+
+// Equivalent to Liquid::Cycle#render_to_output_buffer, which keeps the index of the
+// next value of each cycle group in a register
+static void vm_render_cycle(VALUE context, VALUE output, VALUE group_name, VALUE values)
+{
+    VALUE registers = rb_funcall(context, id_registers, 0);
+    VALUE iterations = registers_fetch_or_set(registers, sym_cycle, rb_hash_new());
+    VALUE iteration_value = hash_aref(iterations, group_name);
+    long iteration = RB_FIXNUM_P(iteration_value) ? RB_FIX2LONG(iteration_value) : NUM2LONG(rb_funcall(iteration_value, id_to_i, 0));
+
+    VALUE value = context_evaluate(context, rb_ary_entry(values, iteration));
+    if (rb_obj_is_kind_of(value, rb_cArray)) {
+        value = rb_funcall(value, id_join, 0);
+    } else if (!RB_TYPE_P(value, T_STRING)) {
+        value = rb_funcall(value, id_to_s, 0);
+    }
+    rb_str_concat(output, value);
+
+    iteration++;
+    if (iteration >= RARRAY_LEN(values))
+        iteration = 0;
+    hash_aset(iterations, group_name, RB_LONG2NUM(iteration));
+}
+
+// Ends the captures started by the render within the innermost started loop, or all of
+// them if it hasn't started any, like an interrupt stops rendering their bodies.
+static void vm_end_interrupted_captures(vm_t *vm, vm_render_until_error_args_t *args)
+{
+    size_t loop_depth = vm_loop_depth(vm);
+    while (vm_capture_depth(vm) > args->capture_base && vm_current_capture(vm)->loop_depth >= loop_depth)
+        vm_end_capture(vm, args, true);
+}
+
+// Jumps to the OP_FOR_NEXT instruction of the innermost loop, which ends the loop
+// for a break.
+static inline void vm_loop_interrupt(vm_t *vm, vm_render_until_error_args_t *args, bool break_loop,
+        const uint8_t **ip_ptr, const size_t **const_ptr_ptr)
+{
+    vm_end_interrupted_captures(vm, args);
+    vm_loop_t *loop = vm_current_loop(vm);
+    if (break_loop)
+        loop->index = loop->length;
+    vm->stack.data_end = vm->stack.data + loop->stack_byte_size;
+    *ip_ptr = loop->next_ip;
+    *const_ptr_ptr = loop->next_const_ptr;
+}
+
 #ifdef HAVE_RB_HASH_BULK_INSERT
 #define hash_bulk_insert rb_hash_bulk_insert
 #else
@@ -261,6 +921,29 @@ static void hash_bulk_insert(long argc, const VALUE *argv, VALUE hash)
 }
 #endif
 
+// GCC and clang support labels as values, which lets each instruction jump
+// directly to the next instruction's handler instead of going through the
+// single shared indirect branch of a switch statement, so each branch site gets
+// its own history in the CPU's branch predictor.
+#if defined(__GNUC__) && !defined(LIQUID_VM_SWITCH_DISPATCH)
+#define VM_DIRECT_THREADED 1
+#endif
+
+#ifdef VM_DIRECT_THREADED
+#define VM_TARGET(op) target_##op:
+#ifdef NDEBUG
+#define VM_NEXT() goto *dispatch_table[*ip++]
+#else
+#define VM_NEXT() do { \
+    if (*ip >= OP_END || !dispatch_table[*ip]) rb_bug("invalid opcode: %u", *ip); \
+    goto *dispatch_table[*ip++]; \
+} while (0)
+#endif
+#else
+#define VM_TARGET(op) case op:
+#define VM_NEXT() goto dispatch
+#endif
+
 // Actually returns a bool resume_rendering value
 static VALUE vm_render_until_error(VALUE uncast_args)
 {
@@ -271,131 +954,373 @@ static VALUE vm_render_until_error(VALUE uncast_args)
     VALUE output = args->output;
     args->ip = NULL; // used by vm_render_rescue, NULL to indicate that it isn't in a rescue block
 
-    while (true) {
-        switch (*ip++) {
-            case OP_LEAVE:
-                return false;
+#ifdef VM_DIRECT_THREADED
+    static const void *const dispatch_table[OP_END] = {
+        [OP_LEAVE] = &&target_OP_LEAVE,
+        [OP_WRITE_RAW] = &&target_OP_WRITE_RAW,
+        [OP_WRITE_NODE] = &&target_OP_WRITE_NODE,
+        [OP_POP_WRITE_VARIABLE] = &&target_OP_POP_WRITE_VARIABLE,
+        [OP_PUSH_CONST] = &&target_OP_PUSH_CONST,
+        [OP_PUSH_NIL] = &&target_OP_PUSH_NIL,
+        [OP_PUSH_TRUE] = &&target_OP_PUSH_TRUE,
+        [OP_PUSH_FALSE] = &&target_OP_PUSH_FALSE,
+        [OP_PUSH_INT8] = &&target_OP_PUSH_INT8,
+        [OP_PUSH_INT16] = &&target_OP_PUSH_INT16,
+        [OP_FIND_STATIC_VAR] = &&target_OP_FIND_STATIC_VAR,
+        [OP_FIND_VAR] = &&target_OP_FIND_VAR,
+        [OP_LOOKUP_CONST_KEY] = &&target_OP_LOOKUP_CONST_KEY,
+        [OP_LOOKUP_KEY] = &&target_OP_LOOKUP_KEY,
+        [OP_LOOKUP_COMMAND] = &&target_OP_LOOKUP_COMMAND,
+        [OP_NEW_INT_RANGE] = &&target_OP_NEW_INT_RANGE,
+        [OP_HASH_NEW] = &&target_OP_HASH_NEW,
+        [OP_FILTER] = &&target_OP_FILTER,
+        [OP_RENDER_VARIABLE_RESCUE] = &&target_OP_RENDER_VARIABLE_RESCUE,
+        [OP_FIND_PATH] = &&target_OP_FIND_PATH,
+        [OP_JUMP] = &&target_OP_JUMP,
+        [OP_JUMP_IF] = &&target_OP_JUMP_IF,
+        [OP_JUMP_UNLESS] = &&target_OP_JUMP_UNLESS,
+        [OP_COMPARE] = &&target_OP_COMPARE,
+        [OP_EVAL_CONDITION] = &&target_OP_EVAL_CONDITION,
+        [OP_RENDER_TAG_RESCUE] = &&target_OP_RENDER_TAG_RESCUE,
+        [OP_RENDER_TAG_BODY] = &&target_OP_RENDER_TAG_BODY,
+        [OP_RENDER_TAG_END] = &&target_OP_RENDER_TAG_END,
+        [OP_FOR_INIT] = &&target_OP_FOR_INIT,
+        [OP_FOR_NEXT] = &&target_OP_FOR_NEXT,
+        [OP_FOR_END] = &&target_OP_FOR_END,
+        [OP_BREAK] = &&target_OP_BREAK,
+        [OP_CONTINUE] = &&target_OP_CONTINUE,
+        [OP_ASSIGN] = &&target_OP_ASSIGN,
+        [OP_CAPTURE_BEGIN] = &&target_OP_CAPTURE_BEGIN,
+        [OP_CAPTURE_END] = &&target_OP_CAPTURE_END,
+        [OP_CASE_JUMP] = &&target_OP_CASE_JUMP,
+        [OP_INCREMENT] = &&target_OP_INCREMENT,
+        [OP_DECREMENT] = &&target_OP_DECREMENT,
+        [OP_CYCLE] = &&target_OP_CYCLE,
+        [OP_RENDER_PARTIAL] = &&target_OP_RENDER_PARTIAL,
+    };
 
-            case OP_PUSH_CONST:
-                vm_stack_push(vm, (VALUE)*const_ptr++);
-                break;
-            case OP_PUSH_NIL:
-                vm_stack_push(vm, Qnil);
-                break;
-            case OP_PUSH_TRUE:
-                vm_stack_push(vm, Qtrue);
-                break;
-            case OP_PUSH_FALSE:
-                vm_stack_push(vm, Qfalse);
-                break;
-            case OP_PUSH_INT8:
-            {
-                int num = *(int8_t *)ip++; // signed
-                vm_stack_push(vm, RB_INT2FIX(num));
-                break;
-            }
-            case OP_PUSH_INT16:
-            {
-                int num = *(int8_t *)ip++; // big endian encoding, so first byte has sign
-                num = (num << 8) | *ip++;
-                vm_stack_push(vm, RB_INT2FIX(num));
-                break;
-            }
-            case OP_FIND_STATIC_VAR:
-                vm_stack_push(vm, (VALUE)*const_ptr++);
-                /* fallthrough */
-            case OP_FIND_VAR:
-            {
-                VALUE key = vm_stack_pop(vm);
-                VALUE value = context_find_variable(args->context, key, Qtrue);
-                vm_stack_push(vm, value);
-                break;
-            }
-            case OP_LOOKUP_CONST_KEY:
-            case OP_LOOKUP_COMMAND:
-                vm_stack_push(vm, (VALUE)*const_ptr++);
-                /* fallthrough */
-            case OP_LOOKUP_KEY:
-            {
-                bool is_command = ip[-1] == OP_LOOKUP_COMMAND;
-                VALUE key = vm_stack_pop(vm);
-                VALUE object = vm_stack_pop(vm);
-                VALUE result = variable_lookup_key(args->context, object, key, is_command);
-                vm_stack_push(vm, result);
-                break;
+    VM_NEXT();
+#else
+dispatch:
+    switch (*ip++)
+#endif
+    {
+        VM_TARGET(OP_LEAVE)
+            return false;
+
+        VM_TARGET(OP_PUSH_CONST)
+            vm_stack_push(vm, (VALUE)*const_ptr++);
+            VM_NEXT();
+        VM_TARGET(OP_PUSH_NIL)
+            vm_stack_push(vm, Qnil);
+            VM_NEXT();
+        VM_TARGET(OP_PUSH_TRUE)
+            vm_stack_push(vm, Qtrue);
+            VM_NEXT();
+        VM_TARGET(OP_PUSH_FALSE)
+            vm_stack_push(vm, Qfalse);
+            VM_NEXT();
+        VM_TARGET(OP_PUSH_INT8)
+        {
+            int num = *(int8_t *)ip++; // signed
+            vm_stack_push(vm, RB_INT2FIX(num));
+            VM_NEXT();
+        }
+        VM_TARGET(OP_PUSH_INT16)
+        {
+            int num = *(int8_t *)ip++; // big endian encoding, so first byte has sign
+            num = (num << 8) | *ip++;
+            vm_stack_push(vm, RB_INT2FIX(num));
+            VM_NEXT();
+        }
+        VM_TARGET(OP_FIND_STATIC_VAR)
+            vm_stack_push(vm, (VALUE)*const_ptr++);
+            /* fallthrough */
+        VM_TARGET(OP_FIND_VAR)
+        {
+            VALUE key = vm_stack_pop(vm);
+            VALUE value = context_find_variable(args->context, key, Qtrue);
+            vm_stack_push(vm, value);
+            VM_NEXT();
+        }
+        VM_TARGET(OP_FIND_PATH)
+        {
+            VALUE object = context_find_variable(args->context, (VALUE)*const_ptr++, Qtrue);
+            size_t num_lookups = *ip++;
+            for (size_t i = 0; i < num_lookups; i++) {
+                bool is_command = *ip++;
+                object = variable_lookup_key(args->context, object, (VALUE)*const_ptr++, is_command);
             }
+            vm_stack_push(vm, object);
+            VM_NEXT();
+        }
+        VM_TARGET(OP_LOOKUP_CONST_KEY)
+        VM_TARGET(OP_LOOKUP_COMMAND)
+            vm_stack_push(vm, (VALUE)*const_ptr++);
+            /* fallthrough */
+        VM_TARGET(OP_LOOKUP_KEY)
+        {
+            bool is_command = ip[-1] == OP_LOOKUP_COMMAND;
+            VALUE key = vm_stack_pop(vm);
+            VALUE object = vm_stack_pop(vm);
+            VALUE result = variable_lookup_key(args->context, object, key, is_command);
+            vm_stack_push(vm, result);
+            VM_NEXT();
+        }
 
-            case OP_NEW_INT_RANGE:
-            {
-                VALUE end = range_value_to_integer(vm_stack_pop(vm));
-                VALUE begin = range_value_to_integer(vm_stack_pop(vm));
-                bool exclude_end = false;
-                vm_stack_push(vm, rb_range_new(begin, end, exclude_end));
-                break;
-            }
-            case OP_HASH_NEW:
-            {
-                size_t hash_size = *ip++;
-                size_t num_keys_and_values = hash_size * 2;
-                VALUE hash = rb_hash_new();
-                VALUE *args_ptr = vm_stack_pop_n_use_in_place(vm, num_keys_and_values);
-                hash_bulk_insert(num_keys_and_values, args_ptr, hash);
-                vm_stack_push(vm, hash);
-                break;
+        VM_TARGET(OP_NEW_INT_RANGE)
+        {
+            VALUE end = range_value_to_integer(vm_stack_pop(vm));
+            VALUE begin = range_value_to_integer(vm_stack_pop(vm));
+            bool exclude_end = false;
+            vm_stack_push(vm, rb_range_new(begin, end, exclude_end));
+            VM_NEXT();
+        }
+        VM_TARGET(OP_HASH_NEW)
+        {
+            size_t hash_size = *ip++;
+            size_t num_keys_and_values = hash_size * 2;
+            VALUE hash = rb_hash_new();
+            VALUE *args_ptr = vm_stack_pop_n_use_in_place(vm, num_keys_and_values);
+            hash_bulk_insert(num_keys_and_values, args_ptr, hash);
+            vm_stack_push(vm, hash);
+            VM_NEXT();
+        }
+        VM_TARGET(OP_FILTER)
+        {
+            VALUE filter_name = (VALUE)*const_ptr++;
+            filter_cache_t *cache = (filter_cache_t *)const_ptr; // the only mutable constants
+            const_ptr += FILTER_CACHE_NUM_CONSTANTS;
+            uint8_t num_args = *ip++; // includes input argument
+            VALUE *args_ptr = vm_stack_pop_n_use_in_place(vm, num_args);
+            VALUE result = vm_invoke_filter(vm, args->context, filter_name, cache, args->code_owner, num_args, args_ptr);
+            vm_stack_push(vm, result);
+            VM_NEXT();
+        }
+
+        VM_TARGET(OP_JUMP)
+            vm_read_jump_target(&ip, &const_ptr);
+            VM_NEXT();
+        VM_TARGET(OP_JUMP_IF)
+        VM_TARGET(OP_JUMP_UNLESS)
+        {
+            bool jump_if = ip[-1] == OP_JUMP_IF;
+            if (condition_truthy(vm_stack_pop(vm)) == jump_if) {
+                vm_read_jump_target(&ip, &const_ptr);
+            } else {
+                const_ptr += JUMP_NUM_CONSTANTS;
             }
-            case OP_FILTER:
-            {
-                VALUE filter_name = (VALUE)*const_ptr++;
-                uint8_t num_args = *ip++; // includes input argument
-                VALUE *args_ptr = vm_stack_pop_n_use_in_place(vm, num_args);
-                VALUE result = vm_invoke_filter(vm, filter_name, num_args, args_ptr);
-                vm_stack_push(vm, result);
-                break;
+            VM_NEXT();
+        }
+        VM_TARGET(OP_CASE_JUMP)
+        {
+            VALUE when_indexes = (VALUE)const_ptr[0];
+            size_t num_whens = const_ptr[1];
+            const_ptr += 2;
+            long from = RB_FIX2LONG(vm_stack_pop(vm));
+            long index = condition_when_index(when_indexes, vm_stack_pop(vm), from);
+            if (index >= 0) {
+                const_ptr += index * JUMP_NUM_CONSTANTS;
+                vm_read_jump_target(&ip, &const_ptr);
+            } else if (from == 0) {
+                // an else body only renders when no when matched
+                const_ptr += num_whens * JUMP_NUM_CONSTANTS;
+                vm_read_jump_target(&ip, &const_ptr);
+            } else {
+                const_ptr += (num_whens + 1) * JUMP_NUM_CONSTANTS;
             }
+            VM_NEXT();
+        }
+        VM_TARGET(OP_COMPARE)
+        {
+            enum comparison_operator op = *ip++;
+            VALUE right = vm_stack_pop(vm);
+            VALUE left = vm_stack_pop(vm);
+            vm_stack_push(vm, condition_compare(op, left, right));
+            VM_NEXT();
+        }
+        VM_TARGET(OP_EVAL_CONDITION)
+        {
+            VALUE condition = (VALUE)*const_ptr++;
+            vm_stack_push(vm, rb_funcall(condition, id_evaluate, 1, args->context));
+            VM_NEXT();
+        }
 
-            // Rendering instructions
+        // Rendering instructions
 
-            case OP_WRITE_RAW:
-            {
-                const char *text = (const char *)*const_ptr++;
-                size_t size = *const_ptr++;
-                rb_str_cat(output, text, size);
-                resource_limits_increment_write_score(vm->resource_limits, output);
-                break;
+        VM_TARGET(OP_WRITE_RAW)
+        {
+            const char *text = (const char *)*const_ptr++;
+            size_t size = *const_ptr++;
+            rb_str_cat(output, text, size);
+            resource_limits_increment_write_score(vm->resource_limits, output);
+            VM_NEXT();
+        }
+        VM_TARGET(OP_BREAK)
+        VM_TARGET(OP_CONTINUE)
+            if (vm_loop_depth(vm) > args->loop_base) {
+                bool break_loop = ip[-1] == OP_BREAK;
+                vm_loop_interrupt(vm, args, break_loop, &ip, &const_ptr);
+                output = args->output; // restored if the interrupt ended captures
+                VM_NEXT();
             }
-            case OP_WRITE_NODE:
-                rb_funcall(cLiquidBlockBody, id_render_node, 3, args->context, output, (VALUE)*const_ptr++);
-                if (RARRAY_LEN(vm->interrupts)) {
+            // render the tag to interrupt the loop that is rendering this block body
+            /* fallthrough */
+        VM_TARGET(OP_WRITE_NODE)
+            rb_funcall(cLiquidBlockBody, id_render_node, 3, args->context, output, (VALUE)*const_ptr++);
+            if (RARRAY_LEN(vm->interrupts)) {
+                if (vm_loop_depth(vm) == args->loop_base) {
+                    vm_end_interrupted_captures(vm, args);
                     return false;
                 }
-                resource_limits_increment_write_score(vm->resource_limits, output);
-                break;
-            case OP_RENDER_VARIABLE_RESCUE:
-                // Save state used by vm_render_rescue to rescue from a variable rendering exception
-                args->node_line_number = ip;
-                // vm_render_rescue will iterate from this instruction to the instruction
-                // following OP_POP_WRITE_VARIABLE to resume rendering from
-                ip += 3;
-                args->ip = ip;
-                args->const_ptr = const_ptr;
-                break;
-            case OP_POP_WRITE_VARIABLE:
-            {
-                VALUE var_result = vm_stack_pop(vm);
-                if (vm->global_filter != Qnil)
-                    var_result = rb_funcall(vm->global_filter, id_call, 1, var_result);
-                write_obj(output, var_result);
-                args->ip = NULL; // mark the end of a rescue block, used by vm_render_rescue
-                resource_limits_increment_write_score(vm->resource_limits, output);
-                break;
+                // handled like Liquid::For does after rendering its body
+                VALUE interrupt = rb_ary_pop(vm->interrupts);
+                bool break_loop = RTEST(rb_obj_is_kind_of(interrupt, cLiquidBreakInterrupt));
+                vm_loop_interrupt(vm, args, break_loop, &ip, &const_ptr);
+                output = args->output; // restored if the interrupt ended captures
+                VM_NEXT();
             }
-
-            default:
-                rb_bug("invalid opcode: %u", ip[-1]);
+            resource_limits_increment_write_score(vm->resource_limits, output);
+            VM_NEXT();
+        VM_TARGET(OP_RENDER_VARIABLE_RESCUE)
+            // Save state used by vm_render_rescue to rescue from a variable rendering exception
+            args->node_line_number = ip;
+            // vm_render_rescue will iterate from this instruction to the instruction
+            // following OP_POP_WRITE_VARIABLE to resume rendering from
+            ip += 3;
+            args->ip = ip;
+            args->const_ptr = const_ptr;
+            VM_NEXT();
+        VM_TARGET(OP_RENDER_TAG_RESCUE)
+            // Save state used by vm_render_rescue to rescue from an exception raised
+            // before rendering one of the tag's bodies, like Liquid::BlockBody.render_node
+            args->node_line_number = ip;
+            args->tag_blank = ip[3];
+            ip += 4;
+            const_ptr++; // tag, only used for the nodelist
+            args->tag_resume_ip = ip;
+            args->tag_resume_const_ptr = const_ptr;
+            vm_read_jump_target(&args->tag_resume_ip, &args->tag_resume_const_ptr);
+            const_ptr += JUMP_NUM_CONSTANTS;
+            VM_NEXT();
+        VM_TARGET(OP_RENDER_TAG_BODY)
+            // exceptions from rendering the body are rescued by the body's nodes
+            args->tag_resume_ip = NULL;
+            resource_limits_increment_render_score(vm->resource_limits, (long)*const_ptr++);
+            VM_NEXT();
+        VM_TARGET(OP_RENDER_TAG_END)
+            resource_limits_increment_write_score(vm->resource_limits, output);
+            VM_NEXT();
+        VM_TARGET(OP_FOR_INIT)
+        {
+            uint8_t flags = *ip++;
+            VALUE variable_name = (VALUE)const_ptr[0];
+            VALUE loop_name = (VALUE)const_ptr[1];
+            const_ptr += 2;
+            const uint8_t *next_ip = ip;
+            const size_t *next_const_ptr = const_ptr + JUMP_NUM_CONSTANTS;
+            if (vm_start_loop(vm, args->context, flags, variable_name, loop_name, next_ip, next_const_ptr)) {
+                // exceptions from rendering the body are rescued by the body's nodes
+                args->tag_resume_ip = NULL;
+                ip = next_ip;
+                const_ptr = next_const_ptr;
+            } else {
+                vm_read_jump_target(&ip, &const_ptr);
+            }
+            VM_NEXT();
+        }
+        VM_TARGET(OP_FOR_NEXT)
+        {
+            long render_score = (long)*const_ptr++;
+            if (vm_loop_next(vm)) {
+                resource_limits_increment_render_score(vm->resource_limits, render_score);
+                const_ptr += JUMP_NUM_CONSTANTS;
+            } else {
+                vm_read_jump_target(&ip, &const_ptr);
+            }
+            VM_NEXT();
+        }
+        VM_TARGET(OP_FOR_END)
+            vm_end_loop(vm, args->context);
+            VM_NEXT();
+        VM_TARGET(OP_ASSIGN)
+        {
+            VALUE variable_name = (VALUE)*const_ptr++;
+            VALUE value = vm_stack_pop(vm);
+            if (vm->global_filter != Qnil)
+                value = rb_funcall(vm->global_filter, id_call, 1, value);
+            context_set_last_scope_variable(args->context, variable_name, value);
+            resource_limits_increment_assign_score(vm->resource_limits, assign_score_of(value));
+            args->tag_resume_ip = NULL;
+            VM_NEXT();
+        }
+        VM_TARGET(OP_CAPTURE_BEGIN)
+            vm_start_capture(vm, args, (VALUE)*const_ptr++);
+            output = args->output;
+            VM_NEXT();
+        VM_TARGET(OP_CAPTURE_END)
+            vm_end_capture(vm, args, true);
+            output = args->output;
+            VM_NEXT();
+        VM_TARGET(OP_INCREMENT)
+        VM_TARGET(OP_DECREMENT)
+        {
+            VALUE variable_name = (VALUE)*const_ptr++;
+            write_obj(output, vm_update_counter(args->context, variable_name, ip[-1] == OP_INCREMENT));
+            args->tag_resume_ip = NULL;
+            VM_NEXT();
+        }
+        VM_TARGET(OP_CYCLE)
+        {
+            VALUE values = (VALUE)*const_ptr++;
+            vm_render_cycle(args->context, output, vm_stack_pop(vm), values);
+            args->tag_resume_ip = NULL;
+            VM_NEXT();
         }
+        VM_TARGET(OP_RENDER_PARTIAL)
+        {
+            size_t num_attributes = *ip++;
+            const VALUE *partial_constants = (const VALUE *)const_ptr;
+            const_ptr += RENDER_PARTIAL_NUM_CONSTANTS + num_attributes;
+            // the values stay on the stack while rendering the partial, so they stay marked
+            size_t num_values = 1 + num_attributes;
+            const VALUE *values = (const VALUE *)vm->stack.data_end - num_values;
+            partial_render(args->context, output, partial_constants[0], partial_constants[1], partial_constants[2],
+                    num_attributes, partial_constants + RENDER_PARTIAL_NUM_CONSTANTS, values);
+            vm_stack_pop_n_use_in_place(vm, num_values);
+            // exceptions from rendering the partial's body are rescued by its nodes
+            args->tag_resume_ip = NULL;
+            VM_NEXT();
+        }
+        VM_TARGET(OP_POP_WRITE_VARIABLE)
+        {
+            VALUE var_result = vm_stack_pop(vm);
+            if (vm->global_filter != Qnil) {
+                if (!args->ip) {
+                    // vm_assembler_optimize removes the OP_RENDER_VARIABLE_RESCUE instruction of
+                    // a literal without a line number, so rescue the global filter from here
+                    args->node_line_number = NULL;
+                    args->ip = ip - 1;
+                    args->const_ptr = const_ptr;
+                }
+                var_result = rb_funcall(vm->global_filter, id_call, 1, var_result);
+            }
+            write_obj(output, var_result);
+            args->ip = NULL; // mark the end of a rescue block, used by vm_render_rescue
+            resource_limits_increment_write_score(vm->resource_limits, output);
+            VM_NEXT();
+        }
+
+#ifndef VM_DIRECT_THREADED
+        default:
+            rb_bug("invalid opcode: %u", ip[-1]);
+#endif
     }
 }
 
+#undef VM_TARGET
+#undef VM_NEXT
+
 // Evaluate instructions that avoid using rendering instructions and leave with the result on
 // the top of the stack
 VALUE liquid_vm_evaluate(VALUE context, vm_assembler_t *code)
@@ -409,8 +1334,11 @@ VALUE liquid_vm_evaluate(VALUE context, vm_assembler_t *code)
     vm_render_until_error_args_t args = {
         .vm = vm,
         .const_ptr = (const size_t *)code->constants.data,
+        .code_owner = code->owner,
         .ip = code->instructions.data,
         .context = context,
+        .loop_base = vm_loop_depth(vm),
+        .capture_base = vm_capture_depth(vm),
     };
     vm_render_until_error((VALUE)&args);
     VALUE ret = vm_stack_pop(vm);
@@ -431,13 +1359,48 @@ void liquid_vm_next_instruction(const uint8_t **ip_ptr, const size_t **const_ptr
         case OP_FIND_VAR:
         case OP_LOOKUP_KEY:
         case OP_NEW_INT_RANGE:
+        case OP_RENDER_TAG_END:
+        case OP_FOR_END:
+        case OP_CAPTURE_END:
             break;
 
         case OP_HASH_NEW:
         case OP_PUSH_INT8:
+        case OP_COMPARE:
             ip++;
             break;
 
+        case OP_JUMP:
+        case OP_JUMP_IF:
+        case OP_JUMP_UNLESS:
+            (*const_ptr_ptr) += JUMP_NUM_CONSTANTS;
+            break;
+
+        case OP_RENDER_TAG_RESCUE:
+            ip += 4;
+            (*const_ptr_ptr) += 1 + JUMP_NUM_CONSTANTS;
+            break;
+
+        case OP_FOR_INIT:
+            ip++;
+            (*const_ptr_ptr) += 2 + JUMP_NUM_CONSTANTS;
+            break;
+
+        case OP_FOR_NEXT:
+            (*const_ptr_ptr) += 1 + JUMP_NUM_CONSTANTS;
+            break;
+
+        case OP_RENDER_PARTIAL:
+            (*const_ptr_ptr) += RENDER_PARTIAL_NUM_CONSTANTS + *ip++;
+            break;
+
+        case OP_CASE_JUMP:
+        {
+            size_t num_whens = (*const_ptr_ptr)[1];
+            (*const_ptr_ptr) += 2 + (num_whens + 1) * JUMP_NUM_CONSTANTS;
+            break;
+        }
+
         case OP_PUSH_INT16:
             ip += 2;
             break;
@@ -447,6 +1410,15 @@ void liquid_vm_next_instruction(const uint8_t **ip_ptr, const size_t **const_ptr
         case OP_FIND_STATIC_VAR:
         case OP_LOOKUP_CONST_KEY:
         case OP_LOOKUP_COMMAND:
+        case OP_EVAL_CONDITION:
+        case OP_RENDER_TAG_BODY:
+        case OP_BREAK:
+        case OP_CONTINUE:
+        case OP_ASSIGN:
+        case OP_CAPTURE_BEGIN:
+        case OP_INCREMENT:
+        case OP_DECREMENT:
+        case OP_CYCLE:
             (*const_ptr_ptr)++;
             break;
 
@@ -456,13 +1428,21 @@ void liquid_vm_next_instruction(const uint8_t **ip_ptr, const size_t **const_ptr
 
         case OP_FILTER:
             ip++;
-            (*const_ptr_ptr)++;
+            (*const_ptr_ptr) += 1 + FILTER_CACHE_NUM_CONSTANTS;
             break;
 
         case OP_WRITE_RAW:
             (*const_ptr_ptr) += 2;
             break;
 
+        case OP_FIND_PATH:
+        {
+            size_t num_lookups = *ip++;
+            ip += num_lookups;
+            (*const_ptr_ptr) += 1 + num_lookups;
+            break;
+        }
+
         default:
             rb_bug("invalid opcode: %u", ip[-1]);
     }
@@ -479,14 +1459,39 @@ static inline unsigned int decode_node_line_number(const uint8_t *node_line_numb
     return (node_line_number[0] << 16) | (node_line_number[1] << 8) | node_line_number[2];
 }
 
+// Ends the inlined captures and loops started by the render, like the ensure clauses in
+// Liquid::C::ResourceLimits#with_capture and Liquid::For#render_segment, when rendering
+// exits with an exception that isn't rescued or with a throw.
+static void vm_end_render_frames(vm_render_rescue_args_t *args)
+{
+    vm_render_until_error_args_t *render_args = args->render_args;
+    vm_t *vm = render_args->vm;
+    while (vm_capture_depth(vm) > render_args->capture_base)
+        vm_end_capture(vm, render_args, false);
+    while (vm_loop_depth(vm) > render_args->loop_base)
+        vm_end_loop(vm, render_args->context);
+    vm->stack.data_end = vm->stack.data + args->old_stack_byte_size;
+    vm->invoking_filter = false;
+}
+
 // Actually returns a bool resume_rendering value
 static VALUE vm_render_rescue(VALUE uncast_args, VALUE exception)
 {
     vm_render_rescue_args_t *args = (void *)uncast_args;
-    VALUE blank_tag = Qfalse; // tags are still rendered using Liquid::BlockBody.render_node
+    VALUE blank_tag = Qfalse; // other tags are rendered using Liquid::BlockBody.render_node
     vm_render_until_error_args_t *render_args = args->render_args;
     vm_t *vm = render_args->vm;
 
+    // the stack values of the loops and captures that rendering resumes in are kept
+    size_t resume_stack_byte_size = args->old_stack_byte_size;
+    if (vm_loop_depth(vm) > render_args->loop_base)
+        resume_stack_byte_size = vm_current_loop(vm)->stack_byte_size;
+    if (vm_capture_depth(vm) > render_args->capture_base) {
+        size_t capture_stack_byte_size = vm_current_capture(vm)->stack_byte_size;
+        if (capture_stack_byte_size > resume_stack_byte_size)
+            resume_stack_byte_size = capture_stack_byte_size;
+    }
+
     const uint8_t *ip = render_args->ip;
     if (ip) {
         // rescue for variable render, where ip is at the start of the render and we need to
@@ -498,7 +1503,18 @@ static VALUE vm_render_rescue(VALUE uncast_args, VALUE exception)
         } while (last_op != OP_POP_WRITE_VARIABLE);
         render_args->ip = ip;
         // remove temporary stack values from variable evaluation
-        vm->stack.data_end = vm->stack.data + args->old_stack_byte_size;
+        vm->stack.data_end = vm->stack.data + resume_stack_byte_size;
+    } else if (render_args->tag_resume_ip) {
+        // rescue for an inlined tag, which resumes rendering after the end of the tag
+        render_args->ip = render_args->tag_resume_ip;
+        render_args->const_ptr = render_args->tag_resume_const_ptr;
+        render_args->tag_resume_ip = NULL;
+        blank_tag = render_args->tag_blank ? Qtrue : Qfalse;
+        // remove temporary stack values from condition evaluation
+        vm->stack.data_end = vm->stack.data + resume_stack_byte_size;
+    } else {
+        // raised outside of any node, like a resource limit error from starting a loop iteration
+        rb_exc_raise(exception);
     }
 
     if (vm->invoking_filter) {
@@ -517,11 +1533,19 @@ static VALUE vm_render_rescue(VALUE uncast_args, VALUE exception)
         }
     }
 
-    rb_funcall(cLiquidBlockBody, rb_intern("c_rescue_render_node"), 5,
-        render_args->context, render_args->output, line_number, exception, blank_tag);
+    VALUE rescue_args[5] = { render_args->context, render_args->output, line_number, exception, blank_tag };
+    rb_funcallv(cLiquidBlockBody, rb_intern("c_rescue_render_node"), 5, rescue_args);
     return true;
 }
 
+static VALUE vm_render_until_done(VALUE uncast_args)
+{
+    vm_render_rescue_args_t *args = (void *)uncast_args;
+    while (rb_rescue(vm_render_until_error, (VALUE)args->render_args, vm_render_rescue, (VALUE)args)) {
+    }
+    return Qnil;
+}
+
 void liquid_vm_render(block_body_t *body, VALUE context, VALUE output)
 {
     vm_t *vm = vm_from_context(context);
@@ -532,16 +1556,25 @@ void liquid_vm_render(block_body_t *body, VALUE context, VALUE output)
     vm_render_until_error_args_t render_args = {
         .vm = vm,
         .const_ptr = (const size_t *)body->code.constants.data,
+        .code_owner = body->code.owner,
         .ip = body->code.instructions.data,
         .context = context,
         .output = output,
+        .loop_base = vm_loop_depth(vm),
+        .capture_base = vm_capture_depth(vm),
     };
     vm_render_rescue_args_t rescue_args = {
         .render_args = &render_args,
         .old_stack_byte_size = c_buffer_size(&vm->stack),
     };
 
-    while (rb_rescue(vm_render_until_error, (VALUE)&render_args, vm_render_rescue, (VALUE)&rescue_args)) {
+    // rb_rescue only rescues a StandardError, so the frames are ended here for the
+    // other exceptions, like a Timeout::Error, and for throws
+    int state = 0;
+    rb_protect(vm_render_until_done, (VALUE)&rescue_args, &state);
+    if (state) {
+        vm_end_render_frames(&rescue_args);
+        rb_jump_tag(state);
     }
     assert(rescue_args.old_stack_byte_size == c_buffer_size(&vm->stack));
 }
@@ -557,6 +1590,21 @@ void init_liquid_vm()
     id_filter_methods_hash = rb_intern("filter_methods_hash");
     id_strict_filters = rb_intern("strict_filters");
     id_global_filter = rb_intern("global_filter");
+    id_registers = rb_intern("registers");
+    id_push = rb_intern("push");
+    id_pop = rb_intern("pop");
+    id_aref = rb_intern("[]");
+    id_to_a = rb_intern("to_a");
+    id_increment = rb_intern("increment!");
+    id_to_i = rb_intern("to_i");
+    id_join = rb_intern("join");
+    id_plus = rb_intern("+");
+    id_minus = rb_intern("-");
+
+    sym_for = ID2SYM(rb_intern("for"));
+    sym_for_stack = ID2SYM(rb_intern("for_stack"));
+    sym_cycle = ID2SYM(rb_intern("cycle"));
+    sym_ifchanged = ID2SYM(rb_intern("ifchanged"));
 
     cLiquidCVM = rb_define_class_under(mLiquidC, "VM", rb_cObject);
     rb_undef_alloc_func(cLiquidCVM);
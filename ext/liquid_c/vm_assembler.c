@@ -1,26 +1,81 @@
 #include "liquid.h"
 #include "vm_assembler.h"
+#include "vm.h"
 
-void vm_assembler_init(vm_assembler_t *code)
+void vm_assembler_init(vm_assembler_t *code, VALUE owner)
 {
     code->instructions = c_buffer_allocate(8);
     code->constants = c_buffer_allocate(8 * sizeof(VALUE));
+    code->value_offsets = c_buffer_init();
+    code->filter_caches = c_buffer_init();
     code->max_stack_size = 0;
     code->stack_size = 0;
+    code->mapped_instructions = false;
+    code->owner = owner;
 }
 
 void vm_assembler_free(vm_assembler_t *code)
 {
-    c_buffer_free(&code->instructions);
+    if (!code->mapped_instructions)
+        c_buffer_free(&code->instructions);
     c_buffer_free(&code->constants);
+    c_buffer_free(&code->value_offsets);
+    c_buffer_free(&code->filter_caches);
+}
+
+// Copies instructions that are used in place from a mapped template store into an owned
+// buffer, so they can be changed.
+void vm_assembler_copy_mapped_instructions(vm_assembler_t *code)
+{
+    assert(code->mapped_instructions);
+    c_buffer_t mapped = code->instructions;
+    code->instructions = c_buffer_allocate(c_buffer_size(&mapped));
+    c_buffer_concat(&code->instructions, &mapped);
+    code->mapped_instructions = false;
 }
 
 void vm_assembler_gc_mark(vm_assembler_t *code)
 {
-    size_t *const_ptr = (size_t *)code->constants.data;
+    const size_t *value_offsets_end = (const size_t *)code->value_offsets.data_end;
+    for (const size_t *value_offset = (const size_t *)code->value_offsets.data; value_offset < value_offsets_end; value_offset++) {
+        rb_gc_mark_movable(*(VALUE *)(code->constants.data + *value_offset));
+    }
+    const size_t *filter_caches_end = (const size_t *)code->filter_caches.data_end;
+    for (const size_t *cache_offset = (const size_t *)code->filter_caches.data; cache_offset < filter_caches_end; cache_offset++) {
+        rb_gc_mark_movable(((filter_cache_t *)(code->constants.data + *cache_offset))->strainer_class);
+    }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+void vm_assembler_compact(vm_assembler_t *code)
+{
+    code->owner = rb_gc_location(code->owner);
+    const size_t *value_offsets_end = (const size_t *)code->value_offsets.data_end;
+    for (const size_t *value_offset = (const size_t *)code->value_offsets.data; value_offset < value_offsets_end; value_offset++) {
+        VALUE *value = (VALUE *)(code->constants.data + *value_offset);
+        *value = rb_gc_location(*value);
+    }
+    const size_t *filter_caches_end = (const size_t *)code->filter_caches.data_end;
+    for (const size_t *cache_offset = (const size_t *)code->filter_caches.data; cache_offset < filter_caches_end; cache_offset++) {
+        filter_cache_t *cache = (filter_cache_t *)(code->constants.data + *cache_offset);
+        cache->strainer_class = rb_gc_location(cache->strainer_class);
+    }
+}
+#endif
+
+static void collect_value(vm_assembler_t *code, const size_t **const_ptr_ptr)
+{
+    size_t value_offset = (const uint8_t *)*const_ptr_ptr - code->constants.data;
+    c_buffer_write(&code->value_offsets, &value_offset, sizeof(size_t));
+    RB_OBJ_WRITTEN(code->owner, Qundef, (VALUE)*(*const_ptr_ptr)++);
+}
+
+// Records the ruby value and filter cache offsets of code whose constants were
+// copied directly, by decoding its instructions.
+static void collect_values(vm_assembler_t *code)
+{
+    const size_t *const_ptr = (const size_t *)code->constants.data;
     const uint8_t *ip = code->instructions.data;
-    // Don't rely on a terminating OP_LEAVE instruction
-    // since this could be called in the middle of parsing
     const uint8_t *end_ip = code->instructions.data_end;
     while (ip < end_ip) {
         switch (*ip++) {
@@ -32,13 +87,60 @@ void vm_assembler_gc_mark(vm_assembler_t *code)
             case OP_FIND_VAR:
             case OP_LOOKUP_KEY:
             case OP_NEW_INT_RANGE:
+            case OP_RENDER_TAG_END:
+            case OP_FOR_END:
+            case OP_CAPTURE_END:
                 break;
 
             case OP_HASH_NEW:
             case OP_PUSH_INT8:
+            case OP_COMPARE:
                 ip++;
                 break;
 
+            case OP_JUMP:
+            case OP_JUMP_IF:
+            case OP_JUMP_UNLESS:
+                const_ptr += JUMP_NUM_CONSTANTS;
+                break;
+
+            case OP_RENDER_TAG_BODY:
+                const_ptr++;
+                break;
+
+            case OP_FOR_INIT:
+                ip++;
+                collect_value(code, &const_ptr);
+                collect_value(code, &const_ptr);
+                const_ptr += JUMP_NUM_CONSTANTS;
+                break;
+
+            case OP_FOR_NEXT:
+                const_ptr += 1 + JUMP_NUM_CONSTANTS;
+                break;
+
+            case OP_CASE_JUMP:
+            {
+                collect_value(code, &const_ptr);
+                size_t num_whens = *const_ptr++;
+                const_ptr += (num_whens + 1) * JUMP_NUM_CONSTANTS;
+                break;
+            }
+
+            case OP_RENDER_TAG_RESCUE:
+                ip += 4;
+                collect_value(code, &const_ptr);
+                const_ptr += JUMP_NUM_CONSTANTS;
+                break;
+
+            case OP_RENDER_PARTIAL:
+            {
+                size_t num_constants = RENDER_PARTIAL_NUM_CONSTANTS + *ip++;
+                for (size_t i = 0; i < num_constants; i++)
+                    collect_value(code, &const_ptr);
+                break;
+            }
+
             case OP_PUSH_INT16:
                 ip += 2;
                 break;
@@ -56,13 +158,36 @@ void vm_assembler_gc_mark(vm_assembler_t *code)
             case OP_FIND_STATIC_VAR:
             case OP_LOOKUP_CONST_KEY:
             case OP_LOOKUP_COMMAND:
-                rb_gc_mark(*const_ptr++);
+            case OP_EVAL_CONDITION:
+            case OP_BREAK:
+            case OP_CONTINUE:
+            case OP_ASSIGN:
+            case OP_CAPTURE_BEGIN:
+            case OP_INCREMENT:
+            case OP_DECREMENT:
+            case OP_CYCLE:
+                collect_value(code, &const_ptr);
                 break;
 
             case OP_FILTER:
+            {
                 ip++;
-                rb_gc_mark(*const_ptr++);
+                collect_value(code, &const_ptr);
+                size_t cache_offset = (const uint8_t *)const_ptr - code->constants.data;
+                c_buffer_write(&code->filter_caches, &cache_offset, sizeof(size_t));
+                RB_OBJ_WRITTEN(code->owner, Qundef, ((const filter_cache_t *)const_ptr)->strainer_class);
+                const_ptr += FILTER_CACHE_NUM_CONSTANTS;
+                break;
+            }
+
+            case OP_FIND_PATH:
+            {
+                size_t num_lookups = *ip++;
+                ip += num_lookups;
+                for (size_t i = 0; i <= num_lookups; i++)
+                    collect_value(code, &const_ptr);
                 break;
+            }
 
             default:
                 rb_bug("invalid opcode: %u", ip[-1]);
@@ -79,8 +204,8 @@ void vm_assembler_add_write_raw(vm_assembler_t *code, const char *string, size_t
 
 void vm_assembler_add_write_node(vm_assembler_t *code, VALUE node)
 {
-    vm_assembler_write_opcode(code, OP_WRITE_NODE);
     vm_assembler_write_ruby_constant(code, node);
+    vm_assembler_write_opcode(code, OP_WRITE_NODE);
 }
 
 void vm_assembler_add_push_fixnum(vm_assembler_t *code, VALUE num)
@@ -116,3 +241,319 @@ void vm_assembler_add_push_literal(vm_assembler_t *code, VALUE literal)
         break;
     }
 }
+
+// Replaces the OP_FIND_STATIC_VAR instruction at the path_start offset and the
+// OP_LOOKUP_CONST_KEY and OP_LOOKUP_COMMAND instructions that follow it with an
+// equivalent OP_FIND_PATH instruction. The instruction operands are the number
+// of lookups followed by an is_command flag for each lookup, while the root
+// name and lookup keys stay in place in the constants.
+void vm_assembler_fuse_find_path(vm_assembler_t *code, size_t path_start)
+{
+    size_t num_lookups = c_buffer_size(&code->instructions) - path_start - 1;
+    if (num_lookups == 0)
+        return;
+    assert(num_lookups <= VM_FIND_PATH_MAX_LOOKUPS);
+
+    c_buffer_reserve_for_write(&code->instructions, 1);
+    uint8_t *instructions = code->instructions.data + path_start;
+    assert(instructions[0] == OP_FIND_STATIC_VAR);
+
+    // Shift the lookups over by one byte, back to front, to make room for the operands
+    for (size_t i = num_lookups; i > 0; i--) {
+        uint8_t op = instructions[i];
+        assert(op == OP_LOOKUP_CONST_KEY || op == OP_LOOKUP_COMMAND);
+        instructions[i + 1] = op == OP_LOOKUP_COMMAND;
+    }
+    instructions[0] = OP_FIND_PATH;
+    instructions[1] = num_lookups;
+    code->instructions.data_end++;
+}
+
+// Appends the code of src without its terminating OP_LEAVE instruction. The
+// code doesn't need relocating, since jumps are relative to the instruction.
+void vm_assembler_concat_code(vm_assembler_t *dest, vm_assembler_t *src)
+{
+    vm_assembler_concat(dest, src);
+    vm_assembler_remove_leave(dest);
+}
+
+// Adds the constants for a jump target ahead of the instruction, like the other constants,
+// so the instruction bytes written after it must be instruction_size in total.
+static void vm_assembler_add_jump_target(vm_assembler_t *code, vm_assembler_jump_list_t *jumps, size_t instruction_size)
+{
+    size_t instructions_end = c_buffer_size(&code->instructions) + instruction_size;
+    size_t target[JUMP_NUM_CONSTANTS] = { instructions_end, jumps->head };
+    jumps->head = c_buffer_size(&code->constants) + 1;
+    c_buffer_write(&code->constants, &target, sizeof(target));
+}
+
+// Adds a jump to the list of jumps for a target that is later set with vm_assembler_patch_jumps
+void vm_assembler_add_jump(vm_assembler_t *code, enum opcode op, vm_assembler_jump_list_t *jumps)
+{
+    assert(op == OP_JUMP || op == OP_JUMP_IF || op == OP_JUMP_UNLESS);
+    if (op != OP_JUMP)
+        code->stack_size--;
+    vm_assembler_add_jump_target(code, jumps, 1);
+    vm_assembler_write_opcode(code, op);
+}
+
+// The jump target is where rendering resumes from after an exception is rescued
+void vm_assembler_add_render_tag_rescue(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank, vm_assembler_jump_list_t *jumps)
+{
+    uint8_t instructions[5] = { OP_RENDER_TAG_RESCUE, line_number >> 16, line_number >> 8, line_number, blank };
+    vm_assembler_write_ruby_constant(code, tag);
+    vm_assembler_add_jump_target(code, jumps, sizeof(instructions));
+    c_buffer_write(&code->instructions, &instructions, sizeof(instructions));
+}
+
+// Sets the target of the jumps to the next instruction to be added
+void vm_assembler_patch_jumps(vm_assembler_t *code, vm_assembler_jump_list_t *jumps)
+{
+    size_t instructions_size = c_buffer_size(&code->instructions);
+    size_t constants_size = c_buffer_size(&code->constants);
+
+    size_t next = jumps->head;
+    while (next) {
+        size_t target_offset = next - 1;
+        size_t *target = (size_t *)(code->constants.data + target_offset);
+        size_t constants_from = target_offset + sizeof(size_t) * JUMP_NUM_CONSTANTS;
+        next = target[1];
+        target[0] = instructions_size - target[0];
+        target[1] = (constants_size - constants_from) / sizeof(size_t);
+    }
+    jumps->head = 0;
+}
+
+// Adds an OP_JUMP to the label, which is computed right away since it is behind the jump
+void vm_assembler_add_jump_to_label(vm_assembler_t *code, vm_assembler_label_t label)
+{
+    size_t instructions_from = c_buffer_size(&code->instructions) + 1;
+    size_t constants_from = c_buffer_size(&code->constants) + sizeof(size_t) * JUMP_NUM_CONSTANTS;
+    ptrdiff_t constants_delta = (ptrdiff_t)(label.constants_offset - constants_from);
+    size_t target[JUMP_NUM_CONSTANTS] = {
+        label.instructions_offset - instructions_from,
+        (size_t)(constants_delta / (ptrdiff_t)sizeof(size_t)),
+    };
+    c_buffer_write(&code->constants, &target, sizeof(target));
+    vm_assembler_write_opcode(code, OP_JUMP);
+}
+
+// The variable name must be frozen, so assigning it in the loop's scope doesn't copy it.
+// The stack values that the loop keeps are added to the stack size, so they must be
+// removed with vm_assembler_add_for_end before adding the code for an empty segment.
+void vm_assembler_add_for_init(vm_assembler_t *code, uint8_t flags, VALUE variable_name, VALUE loop_name,
+        vm_assembler_jump_list_t *else_jumps)
+{
+    assert(OBJ_FROZEN(variable_name));
+    code->stack_size -= (flags & FOR_LOOP_INT_RANGE) ? 4 : 3;
+    uint8_t instructions[2] = { OP_FOR_INIT, flags };
+    vm_assembler_write_ruby_constant(code, variable_name);
+    vm_assembler_write_ruby_constant(code, loop_name);
+    vm_assembler_add_jump_target(code, else_jumps, sizeof(instructions));
+    c_buffer_write(&code->instructions, &instructions, sizeof(instructions));
+    vm_assembler_increment_stack_size(code, FOR_LOOP_NUM_STACK_VALUES);
+    // only marked through the code once the instruction is written
+    RB_GC_GUARD(variable_name);
+}
+
+// The render score is for each iteration of the loop
+void vm_assembler_add_for_next(vm_assembler_t *code, size_t render_score, vm_assembler_jump_list_t *exit_jumps)
+{
+    c_buffer_write(&code->constants, &render_score, sizeof(size_t));
+    vm_assembler_add_jump_target(code, exit_jumps, 1);
+    vm_assembler_write_opcode(code, OP_FOR_NEXT);
+}
+
+// The when_indexes hash maps each when value to the index of its body, which OP_CASE_JUMP
+// jumps to with the jump in when_jumps at that index. When no when value matches, it jumps
+// to the target of miss_jumps if it started from the first when, or falls through otherwise.
+void vm_assembler_add_case_jump(vm_assembler_t *code, VALUE when_indexes, size_t num_whens,
+        vm_assembler_jump_list_t *when_jumps, vm_assembler_jump_list_t *miss_jumps)
+{
+    assert(OBJ_FROZEN(when_indexes));
+    code->stack_size -= 2;
+    vm_assembler_write_ruby_constant(code, when_indexes);
+    c_buffer_write(&code->constants, &num_whens, sizeof(size_t));
+    for (size_t i = 0; i < num_whens; i++)
+        vm_assembler_add_jump_target(code, &when_jumps[i], 1);
+    vm_assembler_add_jump_target(code, miss_jumps, 1);
+    vm_assembler_write_opcode(code, OP_CASE_JUMP);
+    RB_GC_GUARD(when_indexes); // only marked through the code once the opcode is written
+}
+
+// The template name, the name of the variable the partial gets the tag's variable
+// as and the attribute keys must be frozen. The instruction pops the variable's value
+// followed by the value of each attribute.
+void vm_assembler_add_render_partial(vm_assembler_t *code, VALUE tag, VALUE template_name, VALUE variable_name,
+        VALUE attribute_keys)
+{
+    assert(OBJ_FROZEN(template_name) && OBJ_FROZEN(variable_name));
+    long num_attributes = RARRAY_LEN(attribute_keys);
+    assert(num_attributes <= UINT8_MAX);
+    code->stack_size -= 1 + num_attributes;
+    vm_assembler_write_ruby_constant(code, tag);
+    vm_assembler_write_ruby_constant(code, template_name);
+    vm_assembler_write_ruby_constant(code, variable_name);
+    for (long i = 0; i < num_attributes; i++) {
+        VALUE key = RARRAY_AREF(attribute_keys, i);
+        assert(OBJ_FROZEN(key));
+        vm_assembler_write_ruby_constant(code, key);
+    }
+    uint8_t instructions[2] = { OP_RENDER_PARTIAL, num_attributes };
+    c_buffer_write(&code->instructions, &instructions, sizeof(instructions));
+    RB_GC_GUARD(template_name); // only marked through the code once the opcode is written
+    RB_GC_GUARD(variable_name);
+    RB_GC_GUARD(attribute_keys);
+}
+
+// Returns the number of jump targets of the instruction at ip and sets *targets_ptr to the
+// first of them, since the targets of an instruction are adjacent in its constants
+size_t vm_assembler_jump_targets(const uint8_t *ip, const size_t *const_ptr, const size_t **targets_ptr)
+{
+    switch (*ip) {
+        case OP_JUMP:
+        case OP_JUMP_IF:
+        case OP_JUMP_UNLESS:
+            *targets_ptr = const_ptr;
+            return 1;
+        case OP_RENDER_TAG_RESCUE:
+        case OP_FOR_NEXT:
+            *targets_ptr = const_ptr + 1;
+            return 1;
+        case OP_FOR_INIT:
+            *targets_ptr = const_ptr + 2;
+            return 1;
+        case OP_CASE_JUMP:
+            *targets_ptr = const_ptr + 2;
+            return const_ptr[1] + 1;
+        default:
+            return 0;
+    }
+}
+
+static bool is_push_literal(uint8_t op)
+{
+    switch (op) {
+        case OP_PUSH_CONST:
+        case OP_PUSH_NIL:
+        case OP_PUSH_TRUE:
+        case OP_PUSH_FALSE:
+        case OP_PUSH_INT8:
+        case OP_PUSH_INT16:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns true if the instruction at ip can be removed
+static bool removable_instruction(const uint8_t *ip, const size_t *const_ptr)
+{
+    switch (*ip) {
+        case OP_WRITE_RAW:
+            return const_ptr[1] == 0;
+        case OP_RENDER_VARIABLE_RESCUE:
+        {
+            // writing a literal can only raise from the global filter, which OP_POP_WRITE_VARIABLE
+            // rescues itself, so only the line number would be lost without this instruction
+            if (ip[1] || ip[2] || ip[3] || !is_push_literal(ip[4]))
+                return false;
+            const uint8_t *next_ip = ip + 4;
+            liquid_vm_next_instruction(&next_ip, &const_ptr);
+            return *next_ip == OP_POP_WRITE_VARIABLE;
+        }
+        default:
+            return false;
+    }
+}
+
+// Removes the instructions of finished code that don't affect rendering: OP_WRITE_RAW instructions
+// for empty strings, like those left by Liquid::C::BlockBody#remove_blank_strings, and the
+// OP_RENDER_VARIABLE_RESCUE instructions of literal variables without a line number. The jumps
+// over removed instructions are relocated. None of the removed instructions use the stack, so
+// max_stack_size stays the same.
+void vm_assembler_optimize(vm_assembler_t *code)
+{
+    const uint8_t *start_ip = code->instructions.data;
+    const uint8_t *end_ip = code->instructions.data_end;
+    const size_t *start_const_ptr = (const size_t *)code->constants.data;
+    size_t instructions_size = end_ip - start_ip;
+    assert(instructions_size > 0 && end_ip[-1] == OP_LEAVE);
+
+    // avoid copying the code when there is nothing to remove, like for already optimized code
+    bool removable = false;
+    const uint8_t *ip = start_ip;
+    const size_t *const_ptr = start_const_ptr;
+    while (ip < end_ip && !removable) {
+        removable = removable_instruction(ip, const_ptr);
+        liquid_vm_next_instruction(&ip, &const_ptr);
+    }
+    if (!removable)
+        return;
+
+    // map the offsets of the instructions to where they or the next kept instruction are
+    // copied, with the constants offset counted in constants instead of bytes
+    size_t *instruction_offsets = ALLOC_N(size_t, instructions_size + 1);
+    size_t *constant_offsets = ALLOC_N(size_t, instructions_size + 1);
+    c_buffer_t instructions = c_buffer_allocate(instructions_size);
+    c_buffer_t constants = c_buffer_allocate(c_buffer_size(&code->constants));
+    // allocated up front, so that the GC can't run and move the values of the copied constants
+    // before they are collected, since the removed instructions have no values
+    c_buffer_t value_offsets = c_buffer_allocate(c_buffer_size(&code->value_offsets));
+    c_buffer_t filter_caches = c_buffer_allocate(c_buffer_size(&code->filter_caches));
+    ip = start_ip;
+    const_ptr = start_const_ptr;
+    while (ip < end_ip) {
+        size_t offset = ip - start_ip;
+        instruction_offsets[offset] = c_buffer_size(&instructions);
+        constant_offsets[offset] = c_buffer_size(&constants) / sizeof(size_t);
+
+        const uint8_t *next_ip = ip;
+        const size_t *next_const_ptr = const_ptr;
+        liquid_vm_next_instruction(&next_ip, &next_const_ptr);
+        if (!removable_instruction(ip, const_ptr)) {
+            c_buffer_write(&constants, (void *)const_ptr, (next_const_ptr - const_ptr) * sizeof(size_t));
+            c_buffer_write(&instructions, (void *)ip, next_ip - ip);
+        }
+        ip = next_ip;
+        const_ptr = next_const_ptr;
+    }
+    instruction_offsets[instructions_size] = c_buffer_size(&instructions);
+    constant_offsets[instructions_size] = c_buffer_size(&constants) / sizeof(size_t);
+
+    // relocate the jumps, which are never removed themselves
+    ip = start_ip;
+    const_ptr = start_const_ptr;
+    while (ip < end_ip) {
+        size_t offset = ip - start_ip;
+        const size_t *targets;
+        size_t num_targets = vm_assembler_jump_targets(ip, const_ptr, &targets);
+        const uint8_t *instruction_start = ip;
+        const size_t *instruction_constants = const_ptr;
+        liquid_vm_next_instruction(&ip, &const_ptr);
+
+        size_t new_instruction_end = instruction_offsets[offset] + (ip - instruction_start);
+        for (size_t i = 0; i < num_targets; i++) {
+            const size_t *target = targets + i * JUMP_NUM_CONSTANTS;
+            size_t target_offset = ip - start_ip + (ptrdiff_t)target[0];
+            size_t new_target_index = constant_offsets[offset] + (target - instruction_constants);
+            size_t *new_target = (size_t *)constants.data + new_target_index;
+            new_target[0] = instruction_offsets[target_offset] - new_instruction_end;
+            new_target[1] = constant_offsets[target_offset] - (new_target_index + JUMP_NUM_CONSTANTS);
+        }
+    }
+
+    xfree(instruction_offsets);
+    xfree(constant_offsets);
+    // the values of the copied constants are collected before the code is replaced,
+    // so they stay marked through the old constants meanwhile
+    vm_assembler_t optimized = *code;
+    optimized.instructions = instructions;
+    optimized.constants = constants;
+    optimized.value_offsets = value_offsets;
+    optimized.filter_caches = filter_caches;
+    optimized.mapped_instructions = false;
+    collect_values(&optimized);
+    vm_assembler_free(code);
+    *code = optimized;
+}
@@ -25,27 +25,128 @@ enum opcode {
     OP_HASH_NEW, // rb_hash_new & rb_hash_bulk_insert
     OP_FILTER,
     OP_RENDER_VARIABLE_RESCUE, // setup state to rescue variable rendering
+    OP_FIND_PATH, // OP_FIND_STATIC_VAR followed by a number of static key or command lookups
+    OP_JUMP,
+    OP_JUMP_IF, // pop a value and jump if it is truthy
+    OP_JUMP_UNLESS, // pop a value and jump if it is falsy
+    OP_COMPARE, // pop 2 values and push the result of the comparison operator
+    OP_EVAL_CONDITION, // push the result of evaluating a Liquid::Condition
+    OP_RENDER_TAG_RESCUE, // setup state to rescue rendering an inlined tag
+    OP_RENDER_TAG_BODY, // end of the rescued part of an inlined tag, before rendering one of its bodies
+    OP_RENDER_TAG_END, // end of an inlined tag, where rendering resumes from if it raises
+    OP_FOR_INIT, // pop the offset, collection and limit, then start a loop over the segment or jump if it is empty
+    OP_FOR_NEXT, // assign the next item of the innermost loop, or jump once the loop is done
+    OP_FOR_END, // end the innermost loop
+    OP_BREAK, // exit the innermost loop, or render the tag if the loop isn't inlined
+    OP_CONTINUE, // skip to the next item of the innermost loop, or render the tag if the loop isn't inlined
+    OP_ASSIGN, // pop a value and assign it to a variable in the outermost scope
+    OP_CAPTURE_BEGIN, // push the output and render into a capture buffer instead
+    OP_CAPTURE_END, // assign the captured output to a variable and restore the output
+    OP_CASE_JUMP, // pop a when index and a value, then jump to the first matching when body from that index
+    OP_INCREMENT, // render and increment a counter in the first environment
+    OP_DECREMENT, // decrement and render a counter in the first environment
+    OP_CYCLE, // pop the cycle group name, then render its next value
+    OP_RENDER_PARTIAL, // pop the variable and attribute values of a render tag, then render its partial
+
+    OP_END // number of opcodes, not a valid instruction
 };
 
+// Inline cache stored in the constants of an OP_FILTER instruction after the filter name
+typedef struct filter_cache {
+    VALUE strainer_class; // the strainer class the cache was filled for, or Qnil
+    const struct native_filter *native_filter; // NULL if the filter method must be called
+} filter_cache_t;
+
+#define FILTER_CACHE_NUM_CONSTANTS (sizeof(filter_cache_t) / sizeof(size_t))
+
+enum comparison_operator {
+    COMPARE_EQUAL,
+    COMPARE_NOT_EQUAL,
+    COMPARE_LESS,
+    COMPARE_GREATER,
+    COMPARE_LESS_EQUAL,
+    COMPARE_GREATER_EQUAL,
+    COMPARE_CONTAINS,
+};
+
+// Operand of OP_FOR_INIT
+enum for_loop_flags {
+    FOR_LOOP_REVERSED = 1,
+    FOR_LOOP_INT_RANGE = 2, // the collection is a range from two values instead of one
+    FOR_LOOP_FORLOOP = 4, // the body may use the forloop variable
+};
+
+// Values that OP_FOR_INIT pushes to keep on the stack until OP_FOR_END
+#define FOR_LOOP_NUM_STACK_VALUES 4
+
+// Jump targets are stored as a pair of constants with the offsets from the end of the
+// instruction to the target instruction and to its constants, so the code can be copied
+// into other code without relocating them.
+#define JUMP_NUM_CONSTANTS 2
+
+// Jumps to the same target that isn't known yet. They are linked together through
+// their target constants, which hold the offset of the end of the instruction and the
+// list link until the jumps get patched by vm_assembler_patch_jumps.
+typedef struct vm_assembler_jump_list {
+    size_t head; // offset of the last added jump target in the constants plus one, or 0 if empty
+} vm_assembler_jump_list_t;
+
+#define VM_ASSEMBLER_JUMP_LIST_INIT { 0 }
+
+// Position of an instruction that was already added, for jumping backwards to it
+typedef struct vm_assembler_label {
+    size_t instructions_offset;
+    size_t constants_offset;
+} vm_assembler_label_t;
+
 typedef struct vm_assembler {
     c_buffer_t instructions;
     c_buffer_t constants;
+    // Offsets of the ruby values in the constants, which are mixed with untyped operands like raw
+    // slices and jump targets, so they can be marked and moved without decoding the instructions
+    c_buffer_t value_offsets;
+    c_buffer_t filter_caches; // offsets of the filter caches in the constants, which are filled when rendering
     size_t max_stack_size;
     size_t stack_size;
+    bool mapped_instructions; // the instructions are in a mapped template store instead of owned
+    VALUE owner; // the object that holds the code, for the write barriers of its values
 } vm_assembler_t;
 
 void init_liquid_vm_assembler();
-void vm_assembler_init(vm_assembler_t *code);
+void vm_assembler_init(vm_assembler_t *code, VALUE owner);
 void vm_assembler_free(vm_assembler_t *code);
 void vm_assembler_gc_mark(vm_assembler_t *code);
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+void vm_assembler_compact(vm_assembler_t *code);
+#endif
 void vm_assembler_add_write_raw(vm_assembler_t *code, const char *string, size_t size);
 void vm_assembler_add_write_node(vm_assembler_t *code, VALUE node);
 void vm_assembler_add_push_fixnum(vm_assembler_t *code, VALUE num);
 void vm_assembler_add_push_literal(vm_assembler_t *code, VALUE literal);
+void vm_assembler_fuse_find_path(vm_assembler_t *code, size_t path_start);
+void vm_assembler_concat_code(vm_assembler_t *dest, vm_assembler_t *src);
+void vm_assembler_add_jump(vm_assembler_t *code, enum opcode op, vm_assembler_jump_list_t *jumps);
+void vm_assembler_add_render_tag_rescue(vm_assembler_t *code, VALUE tag, unsigned int line_number, bool blank, vm_assembler_jump_list_t *jumps);
+void vm_assembler_patch_jumps(vm_assembler_t *code, vm_assembler_jump_list_t *jumps);
+void vm_assembler_add_jump_to_label(vm_assembler_t *code, vm_assembler_label_t label);
+void vm_assembler_add_for_init(vm_assembler_t *code, uint8_t flags, VALUE variable_name, VALUE loop_name,
+        vm_assembler_jump_list_t *else_jumps);
+void vm_assembler_add_for_next(vm_assembler_t *code, size_t render_score, vm_assembler_jump_list_t *exit_jumps);
+void vm_assembler_add_case_jump(vm_assembler_t *code, VALUE when_indexes, size_t num_whens,
+        vm_assembler_jump_list_t *when_jumps, vm_assembler_jump_list_t *miss_jumps);
+void vm_assembler_add_render_partial(vm_assembler_t *code, VALUE tag, VALUE template_name, VALUE variable_name,
+        VALUE attribute_keys);
+size_t vm_assembler_jump_targets(const uint8_t *ip, const size_t *const_ptr, const size_t **targets_ptr);
+void vm_assembler_optimize(vm_assembler_t *code);
+void vm_assembler_copy_mapped_instructions(vm_assembler_t *code);
 
 static inline size_t vm_assembler_alloc_memsize(const vm_assembler_t *code)
 {
-    return c_buffer_capacity(&code->instructions) + c_buffer_capacity(&code->constants);
+    size_t memsize = c_buffer_capacity(&code->constants) + c_buffer_capacity(&code->value_offsets) +
+        c_buffer_capacity(&code->filter_caches);
+    if (!code->mapped_instructions)
+        memsize += c_buffer_capacity(&code->instructions);
+    return memsize;
 }
 
 static inline void vm_assembler_write_opcode(vm_assembler_t *code, enum opcode op)
@@ -55,7 +156,18 @@ static inline void vm_assembler_write_opcode(vm_assembler_t *code, enum opcode o
 
 static inline void vm_assembler_write_ruby_constant(vm_assembler_t *code, VALUE constant)
 {
+    size_t value_offset = c_buffer_size(&code->constants);
     c_buffer_write(&code->constants, &constant, sizeof(VALUE));
+    c_buffer_write(&code->value_offsets, &value_offset, sizeof(size_t));
+    RB_OBJ_WRITTEN(code->owner, Qundef, constant);
+}
+
+static inline void vm_assembler_write_filter_cache(vm_assembler_t *code)
+{
+    filter_cache_t cache = { .strainer_class = Qnil, .native_filter = NULL };
+    size_t cache_offset = c_buffer_size(&code->constants);
+    c_buffer_write(&code->constants, &cache, sizeof(cache));
+    c_buffer_write(&code->filter_caches, &cache_offset, sizeof(size_t));
 }
 
 static inline void vm_assembler_increment_stack_size(vm_assembler_t *code, size_t amount)
@@ -73,8 +185,21 @@ static inline void vm_assembler_reserve_stack_size(vm_assembler_t *code, size_t
 
 static inline void vm_assembler_concat(vm_assembler_t *dest, vm_assembler_t *src)
 {
-    c_buffer_concat(&dest->instructions, &src->instructions);
+    size_t constants_offset = c_buffer_size(&dest->constants);
     c_buffer_concat(&dest->constants, &src->constants);
+    c_buffer_concat(&dest->instructions, &src->instructions);
+    // after the constants, so the values and filter caches are never marked outside of them
+    const size_t *src_value_offsets_end = (const size_t *)src->value_offsets.data_end;
+    for (const size_t *value_offset = (const size_t *)src->value_offsets.data; value_offset < src_value_offsets_end; value_offset++) {
+        size_t dest_value_offset = constants_offset + *value_offset;
+        c_buffer_write(&dest->value_offsets, &dest_value_offset, sizeof(size_t));
+        RB_OBJ_WRITTEN(dest->owner, Qundef, *(VALUE *)(dest->constants.data + dest_value_offset));
+    }
+    const size_t *src_filter_caches_end = (const size_t *)src->filter_caches.data_end;
+    for (const size_t *cache_offset = (const size_t *)src->filter_caches.data; cache_offset < src_filter_caches_end; cache_offset++) {
+        size_t dest_cache_offset = constants_offset + *cache_offset;
+        c_buffer_write(&dest->filter_caches, &dest_cache_offset, sizeof(size_t));
+    }
 
     size_t max_src_stack_size = dest->stack_size + src->max_stack_size;
     if (max_src_stack_size > dest->max_stack_size)
@@ -91,6 +216,8 @@ static inline void vm_assembler_add_leave(vm_assembler_t *code)
 
 static inline void vm_assembler_remove_leave(vm_assembler_t *code)
 {
+    if (code->mapped_instructions)
+        vm_assembler_copy_mapped_instructions(code); // to extend them
     code->instructions.data_end--;
     assert(*code->instructions.data_end == OP_LEAVE);
 }
@@ -182,6 +309,9 @@ static inline void vm_assembler_add_lookup_command(vm_assembler_t *code, VALUE c
     vm_assembler_write_opcode(code, OP_LOOKUP_COMMAND);
 }
 
+// Maximum number of lookups that vm_assembler_fuse_find_path can fuse into one instruction
+#define VM_FIND_PATH_MAX_LOOKUPS UINT8_MAX
+
 static inline void vm_assembler_add_new_int_range(vm_assembler_t *code)
 {
     code->stack_size--; // pop 2, push 1
@@ -192,10 +322,116 @@ static inline void vm_assembler_add_filter(vm_assembler_t *code, VALUE filter_na
 {
     code->stack_size -= arg_count; // pop arg_count + 1, push 1
     vm_assembler_write_ruby_constant(code, filter_name);
+    vm_assembler_write_filter_cache(code);
     uint8_t instructions[2] = { OP_FILTER, arg_count + 1 /* include input */ };
     c_buffer_write(&code->instructions, &instructions, 2);
 }
 
+static inline void vm_assembler_add_compare(vm_assembler_t *code, enum comparison_operator op)
+{
+    code->stack_size--; // pop 2, push 1
+    uint8_t instructions[2] = { OP_COMPARE, op };
+    c_buffer_write(&code->instructions, &instructions, 2);
+}
+
+static inline void vm_assembler_add_eval_condition(vm_assembler_t *code, VALUE condition)
+{
+    vm_assembler_increment_stack_size(code, 1);
+    vm_assembler_write_ruby_constant(code, condition);
+    vm_assembler_write_opcode(code, OP_EVAL_CONDITION);
+}
+
+static inline void vm_assembler_add_render_tag_body(vm_assembler_t *code, size_t render_score)
+{
+    c_buffer_write(&code->constants, &render_score, sizeof(size_t));
+    vm_assembler_write_opcode(code, OP_RENDER_TAG_BODY);
+}
+
+static inline void vm_assembler_add_render_tag_end(vm_assembler_t *code)
+{
+    vm_assembler_write_opcode(code, OP_RENDER_TAG_END);
+}
+
+static inline vm_assembler_label_t vm_assembler_label(vm_assembler_t *code)
+{
+    vm_assembler_label_t label = { c_buffer_size(&code->instructions), c_buffer_size(&code->constants) };
+    return label;
+}
+
+static inline void vm_assembler_add_for_end(vm_assembler_t *code)
+{
+    code->stack_size -= FOR_LOOP_NUM_STACK_VALUES;
+    vm_assembler_write_opcode(code, OP_FOR_END);
+}
+
+// Adds an OP_BREAK or OP_CONTINUE instruction for the Liquid::Break or Liquid::Continue tag
+static inline void vm_assembler_add_loop_interrupt(vm_assembler_t *code, enum opcode op, VALUE tag)
+{
+    assert(op == OP_BREAK || op == OP_CONTINUE);
+    vm_assembler_write_ruby_constant(code, tag);
+    vm_assembler_write_opcode(code, op);
+}
+
+// The variable name must be frozen, so assigning it in a scope doesn't copy it
+static inline void vm_assembler_add_assign(vm_assembler_t *code, VALUE variable_name)
+{
+    assert(OBJ_FROZEN(variable_name));
+    code->stack_size--;
+    vm_assembler_write_ruby_constant(code, variable_name);
+    vm_assembler_write_opcode(code, OP_ASSIGN);
+    RB_GC_GUARD(variable_name); // only marked through the code once the opcode is written
+}
+
+// The variable name must be frozen, like for vm_assembler_add_assign, or nil to render
+// the body like Liquid::Ifchanged does, which only writes it if it changed
+static inline void vm_assembler_add_capture_begin(vm_assembler_t *code, VALUE variable_name)
+{
+    assert(OBJ_FROZEN(variable_name));
+    vm_assembler_write_ruby_constant(code, variable_name);
+    vm_assembler_write_opcode(code, OP_CAPTURE_BEGIN);
+    RB_GC_GUARD(variable_name);
+    vm_assembler_increment_stack_size(code, 1);
+}
+
+static inline void vm_assembler_add_capture_end(vm_assembler_t *code)
+{
+    code->stack_size--;
+    vm_assembler_write_opcode(code, OP_CAPTURE_END);
+}
+
+// Adds an OP_INCREMENT or OP_DECREMENT instruction for the counter's frozen variable name
+static inline void vm_assembler_add_counter(vm_assembler_t *code, enum opcode op, VALUE variable_name)
+{
+    assert(op == OP_INCREMENT || op == OP_DECREMENT);
+    assert(OBJ_FROZEN(variable_name));
+    vm_assembler_write_ruby_constant(code, variable_name);
+    vm_assembler_write_opcode(code, op);
+    RB_GC_GUARD(variable_name);
+}
+
+// The values are the frozen array of the expressions to evaluate in turn
+static inline void vm_assembler_add_cycle(vm_assembler_t *code, VALUE values)
+{
+    assert(OBJ_FROZEN(values));
+    code->stack_size--;
+    vm_assembler_write_ruby_constant(code, values);
+    vm_assembler_write_opcode(code, OP_CYCLE);
+    RB_GC_GUARD(values);
+}
+
+// Number of constants of an OP_RENDER_PARTIAL instruction before its attribute keys
+#define RENDER_PARTIAL_NUM_CONSTANTS 3
+
+// Reads the jump target at const_ptr that is relative to the end of an instruction
+static inline void vm_read_jump_target(const uint8_t **ip_ptr, const size_t **const_ptr_ptr)
+{
+    const size_t *const_ptr = *const_ptr_ptr;
+    ptrdiff_t instructions_delta = (ptrdiff_t)const_ptr[0];
+    ptrdiff_t constants_delta = (ptrdiff_t)const_ptr[1];
+    *ip_ptr += instructions_delta;
+    *const_ptr_ptr = const_ptr + JUMP_NUM_CONSTANTS + constants_delta;
+}
+
 static inline void vm_assembler_add_render_variable_rescue(vm_assembler_t *code, size_t node_line_number)
 {
     uint8_t instructions[4] = { OP_RENDER_VARIABLE_RESCUE, node_line_number >> 16, node_line_number >> 8, node_line_number };
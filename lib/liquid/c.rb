@@ -96,18 +96,19 @@ Liquid::Variable.class_eval do
 
     private
 
-    # helper method for C code
+    # helper method for C code, which doesn't create the error in lax mode
     def rescue_strict_parse_syntax_error(error, markup, parse_context)
-      error.line_number = parse_context.line_number
-      error.markup_context = "in \"{{#{markup}}}\""
-      case parse_context.error_mode
-      when :strict
-        raise
-      when :warn
-        parse_context.warnings << error
+      if error
+        error.line_number = parse_context.line_number
+        error.markup_context = "in \"{{#{markup}}}\""
+        case parse_context.error_mode
+        when :strict
+          raise error
+        when :warn
+          parse_context.warnings << error
+        end
       end
       call_variable_fallback_stats_callback(parse_context)
-      lax_parse(markup, parse_context) # Avoid redundant strict parse
     end
 
     def lax_parse(markup, parse_context)
@@ -156,12 +157,10 @@ Liquid::Expression.class_eval do
       return nil unless markup
 
       if Liquid::C.enabled
-        begin
-          return Liquid::C::Expression.strict_parse(markup)
-        rescue Liquid::SyntaxError
-        end
+        Liquid::C::Expression.lax_parse(markup)
+      else
+        ruby_parse(markup)
       end
-      ruby_parse(markup)
     end
   end
 end
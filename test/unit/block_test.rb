@@ -23,4 +23,302 @@ class BlockTest < MiniTest::Test
     template = Liquid::Template.parse("ü{{ unicode_char }}")
     assert_equal("üñ", template.render!({ 'unicode_char' => 'ñ' }, output: output))
   end
+
+  def test_if_tag_compiled_inline
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% if a == 1 %}one{% elsif a > 1 and b %}{{ a }}{% else %}none{% endif %}|{% unless a or b %}neither{% endunless %}
+    LIQUID
+    assert_equal([Liquid::If, String, Liquid::Unless], template.root.nodelist.map(&:class))
+    assert_equal("none|neither", template.render!({}))
+    assert_equal("one|", template.render!({ 'a' => 1 }))
+    assert_equal("none|", template.render!({ 'a' => 3 }))
+    assert_equal("3|", template.render!({ 'a' => 3, 'b' => true }))
+  end
+
+  def test_if_tag_contains
+    template = Liquid::Template.parse("{% if a contains 'b' %}yes{% else %}no{% endif %}")
+    assert_equal("yes", template.render!({ 'a' => 'abc' }))
+    assert_equal("yes", template.render!({ 'a' => ['b'] }))
+    assert_equal("no", template.render!({ 'a' => nil }))
+  end
+
+  def test_if_tag_condition_error
+    template = Liquid::Template.parse("a{% if x > 1 %}b{% endif %}c{% if x > 1 %}{% endif %}")
+    assert_equal("aLiquid error: comparison of String with 1 failedc", template.render({ 'x' => 'str' }))
+  end
+
+  def test_break_inside_if_tag
+    template = Liquid::Template.parse("{% for i in (1..3) %}{{ i }}{% if i == 2 %}{% break %}{% endif %}{% endfor %}")
+    assert_equal("12", template.render!({}))
+  end
+
+  def test_case_tag_compiled_inline
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% case a %}{% when 'x', 'y' %}xy{% when 1 %}one{% else %}other{% endcase %}|{% case a %}{% when b %}b{% when 1 %}1{% endcase %}
+    LIQUID
+    assert_equal([Liquid::Case, String, Liquid::Case], template.root.nodelist.map(&:class))
+    assert_equal("xy|", template.render!({ 'a' => 'y' }))
+    assert_equal("one|1", template.render!({ 'a' => 1 }))
+    assert_equal("one|1", template.render!({ 'a' => 1.0 }))
+    assert_equal("one|b1", template.render!({ 'a' => 1, 'b' => 1 }))
+    assert_equal("other|b", template.render!({}))
+  end
+
+  def test_case_tag_renders_each_matching_when
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% case a %}{% when 1 %}{% assign a = 2 %}one{% when 2 %}two{% else %}none{% endcase %}|{% case a %}{% when b, 2 %}{{ a }}{% endcase %}
+    LIQUID
+    assert_equal("onetwo|22", template.render!({ 'a' => 1, 'b' => 2 }))
+  end
+
+  def test_case_tag_duplicate_when_values
+    template = Liquid::Template.parse("{% case a %}{% else %}[{% when 1, 1 %}x{% when 1 %}y{% else %}]{% endcase %}")
+    assert_equal("[xxy", template.render!({ 'a' => 1 }))
+    assert_equal("[]", template.render!({ 'a' => 2 }))
+  end
+
+  def test_for_tag_compiled_inline
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% for x in a reversed limit: 2 offset: 1 %}{{ forloop.index }}{{ x }}{% if forloop.last %}.{% endif %}{% else %}empty{% endfor %}
+    LIQUID
+    assert_equal([Liquid::For], template.root.nodelist.map(&:class))
+    assert_equal("1322.", template.render!({ 'a' => [1, 2, 3, 4] }))
+    assert_equal("empty", template.render!({ 'a' => [1] }))
+    assert_equal("empty", template.render!({}))
+  end
+
+  def test_for_tag_range
+    template = Liquid::Template.parse("{% for i in (a..b) %}{{ i }}{% endfor %}|{% for i in (1..3) reversed %}{{ i }}{% endfor %}")
+    assert_equal("234|321", template.render!({ 'a' => 2, 'b' => 4 }))
+    assert_equal("|321", template.render!({ 'a' => 2, 'b' => 1 }))
+  end
+
+  def test_for_tag_break_and_continue
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% for i in (1..3) %}{% for j in (1..3) %}{% if j == 2 %}{% continue %}{% endif %}{{ j }}{% break %}{% endfor %}{% if i == 2 %}{% break %}{% endif %}{{ i }}{% endfor %}
+    LIQUID
+    assert_equal("111", template.render!({}))
+  end
+
+  def test_for_tag_parentloop
+    template = Liquid::Template.parse("{% for i in (1..2) %}{% for j in (1..2) %}{{ forloop.parentloop.index }}{{ j }}{% endfor %}{% endfor %}")
+    assert_equal("11122122", template.render!({}))
+  end
+
+  def test_for_tag_error_inside_loop
+    template = Liquid::Template.parse("{% for i in (1..2) %}{{ i }}{% if i > x %}b{% endif %}{% endfor %}{{ i }}end")
+    assert_equal("1Liquid error: comparison of Integer with String failed2Liquid error: comparison of Integer with String failedend", template.render({ 'x' => 'str' }))
+  end
+
+  def test_for_tag_and_capture_interrupted_by_non_standard_error
+    interrupt = Class.new(Exception)
+    raising = true
+    template = Liquid::Template.parse("{% for i in (1..2) %}{% capture c %}<{{ x }}>{% endcapture %}{{ c }}{{ forloop.index }}{% endfor %}")
+    context = Liquid::Context.new({ 'x' => -> { raise interrupt if raising; 'x' } })
+    assert_raises(interrupt) { template.render!(context) }
+    assert_equal(1, context.scopes.size)
+
+    raising = false
+    assert_equal("<x>1<x>2", template.render!(context))
+    assert_equal(1, context.scopes.size)
+  end
+
+  def test_assign_and_capture_compiled_inline
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% assign x = a | upcase %}{% capture y %}<{{ x }}>{% endcapture %}{{ y }}{{ y.size }}
+    LIQUID
+    assert_equal([Liquid::Assign, Liquid::Capture, Liquid::C::VariablePlaceholder, Liquid::C::VariablePlaceholder],
+      template.root.nodelist.map(&:class))
+    assert_equal("<AB>4", template.render!({ 'a' => 'ab' }))
+  end
+
+  def test_assign_falls_back_for_lax_markup
+    template = Liquid::Template.parse("{% assign x = a b %}{{ x }}", error_mode: :lax)
+    assert_equal("1", template.render!({ 'a' => 1 }))
+  end
+
+  def test_nested_capture
+    template = Liquid::Template.parse("{% capture x %}a{% capture y %}b{% endcapture %}{{ y }}c{% endcapture %}{{ x }}|{{ y }}")
+    assert_equal("abc|b", template.render!({}))
+  end
+
+  def test_capture_interrupted_by_break
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% for i in (1..3) %}{% capture x %}{{ i }}{% if i == 2 %}{% break %}{% endif %}-{% endcapture %}{{ x }}{% endfor %}|{{ x }}
+    LIQUID
+    assert_equal("1-|2", template.render!({}))
+  end
+
+  def test_counter_tags_compiled_inline
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% for i in (1..3) %}{% cycle 'a', 'b' %}{% cycle 'g': 1, 2 %}{% increment x %}{% decrement y %}|{% endfor %}{{ x }}{{ y }}
+    LIQUID
+    assert_equal([Liquid::For, Liquid::C::VariablePlaceholder, Liquid::C::VariablePlaceholder],
+      template.root.nodelist.map(&:class))
+    context = Liquid::Context.new
+    assert_equal("a10-1|b21-2|a12-3|3-3", template.render!(context))
+    assert_equal({ '["a", "b"]' => 1, 'g' => 1 }, context.registers[:cycle])
+  end
+
+  def test_counter_tags_share_state_with_ruby
+    template = Liquid::Template.parse("{% increment x %}{% cycle 'a', 'b' %}")
+    context = Liquid::Context.new({ 'x' => 5 })
+    context.registers[:cycle] = { '["a", "b"]' => 1 }
+    assert_equal("5b", template.render!(context))
+    assert_equal(6, context.environments.first['x'])
+  end
+
+  def test_cycle_over_forloop_values
+    source = "{% for i in (1..2) %}{% for j in a %}{% cycle forloop.index, forloop.parentloop.index, 'x' %}{% endfor %}|{% endfor %}"
+    expected = Liquid::Template.parse(source, disable_liquid_c_nodes: true).render!({ 'a' => [1, 2] })
+    assert_equal("11|x2|", expected)
+    assert_equal(expected, Liquid::Template.parse(source).render!({ 'a' => [1, 2] }))
+  end
+
+  def test_ifchanged_compiled_inline
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% for i in (1..6) %}{% ifchanged %}<{{ i | divided_by: 2 }}>{% if i == 5 %}{% break %}{% endif %}{% endifchanged %}{% endfor %}
+    LIQUID
+    context = Liquid::Context.new
+    assert_equal("<0><1><2>", template.render!(context))
+    assert_equal("<2>", context.registers[:ifchanged])
+  end
+
+  PartialFileSystem = Struct.new(:partials) do
+    def read_template_file(template_path)
+      partials.fetch(template_path)
+    end
+  end
+
+  def test_render_tag_compiled_inline
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% for i in (1..2) %}{% render 'card', title: i, label: 'x' %}{% endfor %}{% render 'card' with 'a' as title %}
+    LIQUID
+    file_system = PartialFileSystem.new('card' => '[{{ title }}{{ label }}{{ i }}]')
+    assert_equal("[1x][2x][a]", template.render!({}, registers: { file_system: file_system }))
+  end
+
+  def test_render_tag_inside_for_tag_sees_parentloop
+    source = "{% for i in (1..2) %}{% render 'loop' %}{% endfor %}"
+    registers = { file_system: PartialFileSystem.new('loop' => '{% for j in (1..1) %}{{ forloop.parentloop.index }}{% endfor %}') }
+    expected = Liquid::Template.parse(source, disable_liquid_c_nodes: true).render!({}, registers: registers.dup)
+    assert_equal("12", expected)
+    assert_equal(expected, Liquid::Template.parse(source).render!({}, registers: registers.dup))
+  end
+
+  def test_render_tag_isolates_partial_context
+    template = Liquid::Template.parse("{% assign x = 1 %}{% render 'product/card', y: x %}{{ x }}{{ z }}")
+    file_system = PartialFileSystem.new('product/card' => '{{ x }}|{{ y }}|{{ card }}{% assign z = 2 %}|')
+    assert_equal("|1||1", template.render!({}, registers: { file_system: file_system }))
+  end
+
+  def test_render_tag_disables_include_in_partial
+    template = Liquid::Template.parse("{% render 'outer' %}")
+    file_system = PartialFileSystem.new('outer' => "a{% include 'inner' %}b", 'inner' => 'c')
+    assert_match(/\Aa.*include usage is not allowed.*b\z/, template.render({}, registers: { file_system: file_system }))
+  end
+
+  def test_comment_and_raw_compiled_inline
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      a{% comment %}{{ x }}{% comment %}{% raw %}{% endcomment %}{% endraw %}{% endcomment %}{% endcomment %}b{% raw %}{{ y }}{% endraw %}c
+    LIQUID
+    assert_equal(["a", "b", "{{ y }}", "c"], template.root.nodelist)
+    assert_equal("ab{{ y }}c", template.render!({ 'x' => 1 }))
+  end
+
+  def test_comment_body_syntax_errors
+    assert_raises(Liquid::SyntaxError) do
+      Liquid::Template.parse("{% comment %}{% if %}{% endif %}{% endcomment %}", error_mode: :strict)
+    end
+    assert_raises(Liquid::SyntaxError) do
+      Liquid::Template.parse("{% comment %}{% raw %}{% endcomment %}")
+    end
+  end
+
+  def test_comment_nesting_too_deep
+    nested = ->(depth) { "{% comment %}" * depth + "{% endcomment %}" * depth }
+    assert_equal("ab", Liquid::Template.parse("a#{nested.(Liquid::Block::MAX_DEPTH)}b").render!)
+    assert_raises(Liquid::StackLevelError) do
+      Liquid::Template.parse(nested.(Liquid::Block::MAX_DEPTH + 1))
+    end
+  end
+
+  def test_blank_strings_removed_from_compiled_code
+    template = Liquid::Template.parse(<<~LIQUID.chomp)
+      {% for i in (1..2) %} {% if i == 1 %} {% assign x = i %} {% endif %} {% endfor %}|{% case a %} {% when 1 %} {% else %} {% endcase %}
+    LIQUID
+    assert_equal([Liquid::For, String, Liquid::Case], template.root.nodelist.map(&:class))
+    assert_equal("|", template.render!({ 'a' => 1 }))
+  end
+
+  def test_global_filter_error_in_literal_variable
+    template = Liquid::Template.parse("a{{ 'x' }}b{{ 1 }}c")
+    global_filter = ->(value) { value == 'x' ? raise(Liquid::ArgumentError, "bad") : value }
+    assert_equal("aLiquid error: badb1c", template.render({}, global_filter: global_filter))
+  end
+
+  def test_dump_and_load
+    source = "a{% for i in (1..2) %}{{ i | plus: x }}{% if i == 1 %},{% endif %}{% endfor %}{{ 'b' }}"
+    body = Liquid::Template.parse(source).root.instance_variable_get(:@body)
+    tags = []
+    data = body.dump { |tag| tags << tag; (tags.size - 1).to_s }
+    assert_equal([Liquid::For, Liquid::If], tags.map(&:class))
+
+    loaded = Liquid::C::BlockBody.load(data, source) { |index| tags.fetch(Integer(index)) }
+    assert_equal([String, Liquid::For, Liquid::C::VariablePlaceholder], loaded.nodelist.map(&:class))
+    assert_equal("a2,3b", loaded.render_to_output_buffer(Liquid::Context.new({ 'x' => 1 }), +''))
+  end
+
+  def test_load_invalid_dump
+    source = "{{ a }}"
+    data = Liquid::Template.parse(source).root.instance_variable_get(:@body).dump
+    assert_raises(ArgumentError) { Liquid::C::BlockBody.load(data[0..-2], source) }
+    assert_raises(ArgumentError) { Liquid::C::BlockBody.load(data, "{{ b }}x") }
+  end
+
+  def test_load_dump_with_invalid_code
+    source = "{% if a %}x{% endif %}"
+    tag = nil
+    data = Liquid::Template.parse(source).root.instance_variable_get(:@body).dump { |obj| tag = obj; "" }
+    load = ->(dump) { Liquid::C::BlockBody.load(dump, source) { tag } }
+    corrupt = lambda do |from, to|
+      assert_includes(data, from)
+      data.sub(from, to)
+    end
+    assert_equal("x", load.(data).render_to_output_buffer(Liquid::Context.new({ 'a' => true }), +''))
+
+    # the jump over the body of the if tag, relative to the instruction and its constants
+    jump = [3, 5].pack("J2")
+    assert_raises(ArgumentError) { load.(corrupt.(jump, [2, 5].pack("J2"))) }
+    assert_raises(ArgumentError) { load.(corrupt.(jump, [3, 4].pack("J2"))) }
+    assert_raises(ArgumentError) { load.(corrupt.(jump, [-1, 5].pack("J2"))) }
+
+    # the max_stack_size followed by the size of the instructions
+    assert_raises(ArgumentError) { load.(corrupt.([1, 13].pack("J2"), [0, 13].pack("J2"))) }
+  end
+
+  def test_assign_and_capture_assign_score
+    template = Liquid::Template.parse("{% assign x = a %}{% capture y %}{{ a }}{{ a }}{% endcapture %}")
+    template.render!({ 'a' => ['abc', 'de'] })
+    assert_equal(1 + 3 + 2 + 10, template.resource_limits.assign_score)
+  end
+
+  def test_parse_into_old_block_body
+    body = Liquid::C::BlockBody.new
+    tokenizer = Liquid::C::Tokenizer.new(+"{% for i in (1..2) %}{{ 'abc' | append: i }}{{ x.y }}{% endfor %}", 1, false)
+    4.times { GC.start } # promote to the old generation
+    body.parse(tokenizer, Liquid::ParseContext.new) { |unknown_tag, _markup| assert_nil(unknown_tag) }
+    4.times { GC.start(full_mark: false) }
+    GC.verify_internal_consistency
+    assert_equal("abc1zabc2z", body.render_to_output_buffer(Liquid::Context.new({ 'x' => { 'y' => 'z' } }), +''))
+  end
+
+  def test_render_after_compaction
+    skip("GC compaction isn't supported") unless GC.respond_to?(:verify_compaction_references)
+    template = Liquid::Template.parse("{% for i in (1..2) %}{{ 'x' | append: i }}{% capture c %}{{ a.b }}{% endcapture %}{{ c }}{% endfor %}")
+    assert_equal("x1Bx2B", template.render!({ 'a' => { 'b' => 'B' } }))
+    # move the objects that the compiled code references
+    GC.verify_compaction_references(toward: :empty, **(RUBY_VERSION >= "3.2" ? { expand_heap: true } : { double_heap: true }))
+    assert_equal("x1Bx2B", template.render!({ 'a' => { 'b' => 'B' } }))
+  end
 end
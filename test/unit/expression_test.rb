@@ -51,6 +51,36 @@ class ExpressionTest < MiniTest::Test
     assert_equal -1.5, compile_and_eval('-1.5')
   end
 
+  def test_float_rounding
+    assert_equal 0.1, Liquid::C::Expression.strict_parse('0.1')
+    assert_equal 0.30000000000000004, Liquid::C::Expression.strict_parse('0.30000000000000004')
+    assert_equal 9007199254740992.0, Liquid::C::Expression.strict_parse('9007199254740993.0')
+    assert_equal -0.5, Liquid::C::Expression.strict_parse('-.5')
+
+    negative_zero = Liquid::C::Expression.strict_parse('-0.0')
+    assert_equal 0.0, negative_zero
+    assert_predicate 1 / negative_zero, :negative?
+  end
+
+  def test_number_in_frozen_source
+    source = '12345.5 '.freeze
+    assert_equal 12345.5, Liquid::C::Expression.strict_parse(source)
+    assert_equal '12345.5 ', source
+  end
+
+  def test_strict_parse_syntax_error
+    exc = assert_raises(Liquid::SyntaxError) { Liquid::C::Expression.strict_parse('x @') }
+    assert_match(/Unexpected character @/, exc.message)
+    exc = assert_raises(Liquid::SyntaxError) { Liquid::C::Expression.strict_parse('x y') }
+    assert_match(/\[:id\] is not a valid expression/, exc.message)
+  end
+
+  def test_lax_parse
+    assert_equal 42, Liquid::C::Expression.lax_parse('42')
+    assert_instance_of(Liquid::C::Expression, Liquid::C::Expression.lax_parse('x.y'))
+    assert_instance_of(Liquid::VariableLookup, Liquid::C::Expression.lax_parse('x y'))
+  end
+
   def test_string
     assert_equal "hello", Liquid::C::Expression.strict_parse('"hello"')
     assert_equal "world", compile_and_eval("'world'")
@@ -106,6 +136,19 @@ class ExpressionTest < MiniTest::Test
     assert_equal 'c', context.evaluate(Liquid::C::Expression.strict_parse('ary.last'))
   end
 
+  def test_lookup_static_path
+    context = Liquid::Context.new({"product" => { "variants" => [{ "price" => 5 }, { "price" => 7 }] }, "key" => "variants"})
+    assert_equal 5, context.evaluate(Liquid::C::Expression.strict_parse('product.variants.first.price'))
+    assert_equal 7, context.evaluate(Liquid::C::Expression.strict_parse('product[key].last.price'))
+    assert_equal 2, context.evaluate(Liquid::C::Expression.strict_parse('product.variants.size'))
+
+    node = { "value" => 42 }
+    node["next"] = node
+    context = Liquid::Context.new({"node" => node})
+    path = "node#{'.next' * 300}.value"
+    assert_equal 42, context.evaluate(Liquid::C::Expression.strict_parse(path))
+  end
+
   def test_lookup_missing_key
     context = Liquid::Context.new({ 'obj' => {} })
     expr = Liquid::C::Expression.strict_parse('obj.missing')
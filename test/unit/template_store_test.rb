@@ -0,0 +1,56 @@
+require 'test_helper'
+require 'tempfile'
+
+class TemplateStoreTest < MiniTest::Test
+  def test_build_open_and_load
+    sources = ["a{% for i in (1..2) %}{{ i | plus: x }}{% if i == 1 %},{% endif %}{% endfor %}b", "{{ 'ç' }}d"]
+    bodies = sources.map { |source| Liquid::Template.parse(source).root.instance_variable_get(:@body) }
+    tags = []
+    data = Liquid::C::TemplateStore.build(bodies) { |tag| tags << tag; (tags.size - 1).to_s }
+
+    with_store_file(data) do |path|
+      store = Liquid::C::TemplateStore.open(path)
+      assert_equal(2, store.size)
+
+      loaded = store.load(0) { |index| tags.fetch(Integer(index)) }
+      assert_equal("a2,3b", loaded.render_to_output_buffer(Liquid::Context.new({ 'x' => 1 }), +''))
+      assert_equal("çd", store.load(1).render_to_output_buffer(Liquid::Context.new, +''))
+      assert_raises(IndexError) { store.load(2) }
+    end
+  end
+
+  def test_loaded_body_keeps_store_mapped
+    body = Liquid::Template.parse("a{% if x %}{{ x }}{% endif %}b").root.instance_variable_get(:@body)
+    data = Liquid::C::TemplateStore.build([body])
+
+    loaded = with_store_file(data) do |path|
+      Liquid::C::TemplateStore.open(path).load(0)
+    end
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+    assert_equal("a1b", loaded.render_to_output_buffer(Liquid::Context.new({ 'x' => 1 }), +''))
+  end
+
+  def test_open_invalid_file
+    with_store_file("LQCS") do |path|
+      assert_raises(ArgumentError) { Liquid::C::TemplateStore.open(path) }
+    end
+    data = Liquid::C::TemplateStore.build([Liquid::Template.parse("a").root.instance_variable_get(:@body)])
+    with_store_file(data[0..-2]) do |path|
+      assert_raises(ArgumentError) { Liquid::C::TemplateStore.open(path) }
+    end
+    assert_raises(Errno::ENOENT) { Liquid::C::TemplateStore.open("/nonexistent/liquid_c_template_store") }
+  end
+
+  private
+
+  def with_store_file(data)
+    file = Tempfile.new('template_store')
+    file.binmode
+    file.write(data)
+    file.close
+    yield file.path
+  ensure
+    file.unlink
+  end
+end
@@ -28,6 +28,19 @@ class TokenizerTest < Minitest::Test
     assert_equal [' ', '  comment  ', ' '], tokenize(' {%  comment  %} ', trimmed: true)
   end
 
+  def test_tokenize_delimiters_across_long_raw_text
+    # exercise delimiter scanning at every offset of a vectorized block
+    (1..70).each do |raw_len|
+      raw = 'x' * raw_len
+      assert_equal [raw, '{{ a }}', raw], tokenize("#{raw}{{ a }}#{raw}")
+      assert_equal [raw, '{%- a -%}', raw], tokenize("#{raw}{%- a -%}#{raw}")
+      assert_equal [raw, '{{%- a %}', "%}#{raw}"], tokenize("#{raw}{{%- a %}%}#{raw}")
+      assert_equal ["{% #{raw} %%}"], tokenize("{% #{raw} %%}")
+      assert_equal ['{%', " #{raw}"], tokenize("{% #{raw}")
+      assert_equal ['{{', " #{raw}}"], tokenize("{{ #{raw}}")
+    end
+  end
+
   def test_tokenize_for_liquid_tag
     source = "\nfunk\n\n  so | brother   \n"
 
@@ -37,6 +50,18 @@ class TokenizerTest < Minitest::Test
     assert_equal ["funk", "so | brother"], tokenize(source, for_liquid_tag: true, trimmed: true)
   end
 
+  def test_line_numbers
+    source = "a\n{{ b }}\n\n{% c %}\nd"
+    tokenizer = Liquid::C::Tokenizer.new(source, 3, false)
+    line_numbers = [tokenizer.line_number]
+    line_numbers << tokenizer.line_number while tokenizer.shift
+    assert_equal [3, 4, 4, 6, 6, 7], line_numbers
+
+    tokenizer = Liquid::C::Tokenizer.new(source, 0, false)
+    tokenizer.shift
+    assert_nil tokenizer.line_number
+  end
+
   def test_utf8_encoded_source
     source = 'auswählen'
     assert_equal Encoding::UTF_8, source.encoding
@@ -111,6 +111,24 @@ class VariableTest < Minitest::Test
     assert_equal 1, variable_fallbacks
   end
 
+  def test_lax_variable_compiled
+    context = { 'name' => 'Bob', 'abc' => 'xyz' }
+    render_opts = { filters: [InspectCallFilters] }
+
+    template = Liquid::Template.parse("{{ name extra | filter1: abc key: 'x' | filter2 }}", error_mode: :warn)
+    assert_equal [Liquid::C::VariablePlaceholder], template.root.nodelist.map(&:class)
+    assert_equal 1, template.warnings.size
+    filter1_output = '{ filter: :filter1, input: "Bob", args: ["xyz", "x"] }'
+    assert_equal "{ filter: :filter2, input: #{filter1_output.inspect}, args: [] }", template.render!(context, render_opts)
+
+    template = Liquid::Template.parse("{{ name | filter1: a: abc, b: 1, a: 'x' extra }}", error_mode: :lax)
+    assert_equal [Liquid::C::VariablePlaceholder], template.root.nodelist.map(&:class)
+    assert_equal '{ filter: :filter1, input: "Bob", args: [{"a"=>"x", "b"=>1}] }', template.render!(context, render_opts)
+
+    template = Liquid::Template.parse('{{@!#}}', error_mode: :lax)
+    assert_equal [Liquid::Variable], template.root.nodelist.map(&:class)
+  end
+
   def test_write_string
     output = Liquid::Template.parse("{{ str }}").render({ 'str' => 'foo' })
     assert_equal "foo", output
@@ -119,6 +137,21 @@ class VariableTest < Minitest::Test
   def test_write_fixnum
     output = Liquid::Template.parse("{{ num }}").render({ 'num' => 123456 })
     assert_equal "123456", output
+
+    output = Liquid::Template.parse("{{ min }} {{ max }}").render({ 'min' => -2**62, 'max' => 2**62 - 1 })
+    assert_equal "#{-2**62} #{2**62 - 1}", output
+  end
+
+  def test_write_float
+    floats = [0.0, -0.0, 19.99, 1200.0, 0.00012, 0.00001, 123456789012345.0, 1e15, 0.1 + 0.2, 1 / 3.0, Float::INFINITY, Float::NAN]
+    output = Liquid::Template.parse("{{ floats | join: ' ' }}|{% for f in floats %}{{ f }} {% endfor %}").render({ 'floats' => floats })
+    expected = floats.join(' ')
+    assert_equal "#{expected}|#{expected} ", output
+  end
+
+  def test_write_boolean
+    output = Liquid::Template.parse("{{ t }} {{ f }}").render({ 't' => true, 'f' => false })
+    assert_equal "true false", output
   end
 
   def test_write_array
@@ -204,6 +237,69 @@ class VariableTest < Minitest::Test
     assert_equal 'false', template.render({ 'value' => false, 'false_allowed' => true })
   end
 
+  module ShoutFilter
+    def shout(input)
+      "#{input.upcase}!"
+    end
+  end
+
+  def test_filter_rendered_with_different_strainers
+    template = Liquid::Template.parse("{{ var | shout }}")
+
+    assert_equal 'Hello', template.render({ 'var' => 'Hello' })
+    assert_equal 'HELLO!', template.render({ 'var' => 'Hello' }, filters: [ShoutFilter])
+    assert_equal 'Hello', template.render({ 'var' => 'Hello' })
+  end
+
+  module UpcaseOverrideFilter
+    def upcase(input)
+      "overridden #{input}"
+    end
+  end
+
+  def test_overridden_standard_filter
+    template = Liquid::Template.parse("{{ var | upcase }}")
+
+    assert_equal 'HELLO', template.render({ 'var' => 'hello' })
+    assert_equal 'overridden hello', template.render({ 'var' => 'hello' }, filters: [UpcaseOverrideFilter])
+  end
+
+  def test_standard_string_filters
+    assert_equal 'HÉLLO 42', Liquid::Template.parse("{{ var | upcase }} {{ 42 | upcase }}").render({ 'var' => 'héllo' })
+    assert_equal 'a-b-', Liquid::Template.parse("{{ var | append: '-' | prepend: nil }}{{ nil | append: 'b-' }}").render({ 'var' => 'a' })
+    assert_equal '3 5 0', Liquid::Template.parse("{{ ary | size }} {{ str | size }} {{ nil | size }}").render({ 'ary' => [1, 2, 3], 'str' => 'héllo' })
+
+    source = %q{<a title="Tom & Jerry's">&amp; &#39; &copy</a>}
+    output = Liquid::Template.parse("{{ var | escape }}|{{ var | escape_once }}|{{ nil | escape }}").render({ 'var' => source })
+    assert_equal '&lt;a title=&quot;Tom &amp; Jerry&#39;s&quot;&gt;&amp;amp; &amp;#39; &amp;copy&lt;/a&gt;|' \
+      '&lt;a title=&quot;Tom &amp; Jerry&#39;s&quot;&gt;&amp; &#39; &amp;copy&lt;/a&gt;|', output
+  end
+
+  def test_standard_array_filters
+    products = [
+      { 'title' => 'b', 'price' => 5, 'available' => true },
+      { 'title' => 'a', 'price' => 2, 'available' => false },
+      { 'title' => 'c', 'price' => 7, 'available' => true },
+    ]
+    template = Liquid::Template.parse(
+      "{{ products | sort: 'price' | map: 'title' | join: ', ' }}|{{ products | where: 'available' | map: 'title' | join }}|" \
+      "{{ products | where: 'price', 2 | first | map: 'title' }}|{{ products | uniq: 'available' | size }}|" \
+      "{{ ary | compact | last }}|{{ ary | compact | sort | join: '' }}|{{ ary | map: 'x' }}"
+    )
+    output = template.render({ 'products' => products, 'ary' => [3, nil, [1, nil]] })
+    assert_equal "a, b, c|b c|a|2|1|13|Liquid error: cannot select the property 'x'", output
+  end
+
+  def test_standard_number_filters
+    template = Liquid::Template.parse(
+      "{{ 0.1 | plus: 0.2 }} {{ price | times: 3 | divided_by: 100.0 }} {{ 7 | divided_by: 2 }} {{ -7 | modulo: 3 }} " \
+      "{{ '2.5' | round }} {{ 1.005 | round: 2 }} {{ -1.5 | ceil }} {{ 'abc' | plus: 1 }} {{ 5 | at_least: 7.5 | at_most: 6 }} " \
+      "{{ -3.5 | abs }} {{ 1 | divided_by: 0 }}"
+    )
+    output = template.render({ 'price' => 1999 })
+    assert_equal "0.3 59.97 3 2 3 1.01 -1 1 6 3.5 Liquid error: divided by 0", output
+  end
+
   def test_filter_error
     output = Liquid::Template.parse("before ({{ ary | concat: 2 }}) after").render({ 'ary' => [1] })
     assert_equal 'before (Liquid error: concat filter requires an array argument) after', output